@@ -0,0 +1,107 @@
+#ifndef __ADDR_FILTER__
+#define __ADDR_FILTER__
+
+#include <linux/math64.h>
+
+#include "common.h"
+
+/*
+  Count only requests to a physical range, the "NVM region".
+  Include after large_header.h.
+
+  The HA address match compares address bits 45:6, i.e. one 64B line, and
+  has no mask, so a range can not be matched at once. Instead the filter
+  walks the region: every tick one line is matched, and the region's
+  requests are estimated as the mean matched count per tick times the
+  number of lines in the region.
+
+  The mean is an exponential average over ADDR_FILTER_WINDOW ticks, so a
+  single matched request is not charged at once as lines requests (for a
+  128MiB region that would be 2M accesses and seconds of stall in one
+  tick) but spread over the following ticks; the total charged is the same.
+  Regions of one line are exact. For larger ones the estimate is unbiased
+  for traffic spread evenly over the region and over time, but its
+  variance grows with the number of lines: with n requests per tick spread
+  over L lines, one tick samples n / L of them on average and the relative
+  standard deviation of the averaged estimate is about
+      sqrt(L / (n * ADDR_FILTER_WINDOW))
+  A skewed access pattern is only seen when the walk passes its hot lines,
+  and a full walk takes L ticks. Keep the region small, or use source=pebs
+  for large ones.
+  The region must be homed on the HA box being programmed.
+*/
+
+#define ADDR_FILTER_WINDOW           (64)      // ticks, power of two
+#define ADDR_FILTER_SHIFT            (6)       // log2 of ADDR_FILTER_WINDOW
+#define ADDR_FILTER_FRAC             (24)      // fraction bits of the mean
+
+typedef struct {
+    uint64_t start;           // first line of the region
+    uint64_t lines;           // lines in the region
+    uint64_t cur;             // index of the line matched in this tick
+    uint64_t mean;            // matched per tick, << ADDR_FILTER_FRAC
+    int opcode;               // -1 for any opcode
+} addr_filter_t;
+
+// @habox must be frozen, @pairnr is switched to the ADDR_OPC_MATCH event
+int init_addr_filter(addr_filter_t *filter, HABox_t *habox, int pairnr,
+                     uint64_t start, uint64_t size, int opcode) {
+    const event_t *event = &HA_event_addr_match;
+    if (!filter || !habox || !size) {
+        printk(KERN_ERR "Invalid address filter\n");
+        return -1;
+    }
+
+    filter->start = start & ~((uint64_t)HA_ADDRMATCH_GRANULE - 1);
+    filter->lines = DIV_ROUND_UP(start + size - filter->start,
+                                 HA_ADDRMATCH_GRANULE);
+    filter->cur = 0;
+    filter->mean = 0;
+    filter->opcode = opcode;
+
+    if (opcode >= 0) {
+        if (HA_set_opcode_match(habox, opcode) != 0)
+            return -1;
+        event = &HA_event_filter_match;
+    }
+    if (HA_set_addr_match(habox, filter->start) != 0)
+        return -1;
+    if (HA_choose_event(habox, pairnr, event) != 0)
+        return -1;
+
+    printk(KERN_INFO "counting %llu lines from %llx only\n",
+           filter->lines, filter->start);
+    if (filter->lines > ADDR_FILTER_WINDOW)
+        printk(KERN_WARNING "a walk of the region takes %llu ticks, its "
+               "counts are a sampled estimate\n", filter->lines);
+    return 0;
+}
+
+// move the match to the next line, @habox must be frozen
+int addr_filter_advance(addr_filter_t *filter, HABox_t *habox) {
+    if (filter->lines == 1)
+        return 0;
+    if (++filter->cur == filter->lines)
+        filter->cur = 0;
+    return HA_set_addr_match(habox, filter->start +
+                             filter->cur * HA_ADDRMATCH_GRANULE);
+}
+
+// estimated requests to the whole region from the count of one line
+uint64_t addr_filter_scale(addr_filter_t *filter, uint64_t count) {
+    if (filter->lines == 1)
+        return count;
+    // rounded up so that the mean of a single request decays to 0
+    filter->mean -= (filter->mean + ADDR_FILTER_WINDOW - 1) >>
+                    ADDR_FILTER_SHIFT;
+    filter->mean += count << (ADDR_FILTER_FRAC - ADDR_FILTER_SHIFT);
+    return mul_u64_u64_shr(filter->mean, filter->lines, ADDR_FILTER_FRAC);
+}
+
+void free_addr_filter(addr_filter_t *filter, HABox_t *habox) {
+    if (filter->lines)
+        HA_clear_match(habox);
+    filter->lines = 0;
+}
+
+#endif
@@ -0,0 +1,300 @@
+/*
+  STREAM style bandwidth benchmark.
+
+  Kernels:
+      copy    b = a
+      scale   b = s * a
+      add     c = a + b
+      triad   c = a + s * b
+      ntcopy  b = a with non-temporal stores
+      mix     reads and writes of whole lines in a given ratio, swept from
+              1:0 (read only) to 0:1 (write only)
+
+  Every thread works on its own slice of the arrays and the best of -r
+  repetitions is reported. Output is CSV:
+      kernel,ratio,threads,bytes,mbps
+
+  usage: bandwidth [-t threads] [-c first_cpu] [-n node] [-s bytes]
+                   [-r reps] [-x]
+      -t  number of threads, default 1
+      -c  pin thread i to cpu first_cpu + i
+      -n  bind the arrays to NUMA node @node
+      -s  bytes per array, default 1G, should be far beyond LLC
+      -r  repetitions, default 5
+      -x  delay only the timed repetitions: load the emulator with
+          start_paused=1 and every repetition is bracketed by
+          NVMEMU_CTL_START and NVMEMU_CTL_PAUSE on /dev/nvmemu_ctl, so
+          first touch and thread setup run undelayed
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../emulator_uapi.h"
+
+#define LINE_DOUBLES     (8)
+#define MPOL_BIND        (2)
+#define CTL_DEV          "/dev/nvmemu_ctl"
+
+enum { COPY, SCALE, ADD, TRIAD, NTCOPY, MIX };
+
+static const char *kernel_names[] = {
+    "copy", "scale", "add", "triad", "ntcopy", "mix",
+};
+
+// read:write ratios of the mix kernel, in lines
+static const int mix_ratios[][2] = {
+    { 1, 0 }, { 3, 1 }, { 2, 1 }, { 1, 1 }, { 1, 2 }, { 1, 3 }, { 0, 1 },
+};
+
+typedef struct {
+    int cpu;
+    double *a, *b, *c;
+    size_t n;                  // doubles in this thread's slice
+    int kernel;
+    int reads, writes;         // mix ratio
+    double sink;
+} worker_t;
+
+static pthread_barrier_t start_barrier, end_barrier;
+static int nthreads = 1;
+static volatile int running = 1;
+static int ctl_fd = -1;        // /dev/nvmemu_ctl with -x
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 0);
+    switch (*end) {
+    case 'g': case 'G': v <<= 10; /* fall through */
+    case 'm': case 'M': v <<= 10; /* fall through */
+    case 'k': case 'K': v <<= 10;
+    }
+    return v;
+}
+
+static double *alloc_array(size_t bytes, int node) {
+    double *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+    if (node >= 0) {
+        unsigned long mask[16] = { 0 };
+        mask[node / 64] = 1UL << (node % 64);
+        if (syscall(SYS_mbind, mem, bytes, MPOL_BIND, mask,
+                    sizeof(mask) * 8, 0) != 0) {
+            fprintf(stderr, "mbind to node %d failed: %s\n", node,
+                    strerror(errno));
+            munmap(mem, bytes);
+            return NULL;
+        }
+    }
+    return mem;
+}
+
+static void run_kernel(worker_t *w) {
+    double *a = w->a, *b = w->b, *c = w->c, s = 3.0, sum = 0;
+    size_t i, j, n = w->n;
+    int k, period;
+
+    switch (w->kernel) {
+    case COPY:
+        for (i = 0; i < n; i++)
+            b[i] = a[i];
+        break;
+    case SCALE:
+        for (i = 0; i < n; i++)
+            b[i] = s * a[i];
+        break;
+    case ADD:
+        for (i = 0; i < n; i++)
+            c[i] = a[i] + b[i];
+        break;
+    case TRIAD:
+        for (i = 0; i < n; i++)
+            c[i] = a[i] + s * b[i];
+        break;
+    case NTCOPY:
+#ifdef __SSE2__
+        for (i = 0; i + 2 <= n; i += 2)
+            _mm_stream_pd(&b[i], _mm_load_pd(&a[i]));
+        _mm_sfence();
+#else
+        for (i = 0; i < n; i++)
+            b[i] = a[i];
+#endif
+        break;
+    case MIX:
+        // line i is read if (i % period) < reads, otherwise written
+        period = w->reads + w->writes;
+        for (i = 0, k = 0; i + LINE_DOUBLES <= n; i += LINE_DOUBLES) {
+            if (k < w->reads) {
+                // one load brings in the whole line
+                sum += a[i];
+            } else {
+                for (j = 0; j < LINE_DOUBLES; j++)
+                    a[i + j] = s;
+            }
+            if (++k == period)
+                k = 0;
+        }
+        break;
+    }
+    w->sink += sum;
+}
+
+static void *worker(void *arg) {
+    worker_t *w = arg;
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+            fprintf(stderr, "can not pin to cpu %d\n", w->cpu);
+    }
+    // first touch the slice from its own thread
+    memset(w->a, 0, w->n * sizeof(double));
+    memset(w->b, 0, w->n * sizeof(double));
+    memset(w->c, 0, w->n * sizeof(double));
+
+    for (;;) {
+        pthread_barrier_wait(&start_barrier);
+        if (!running)
+            break;
+        run_kernel(w);
+        pthread_barrier_wait(&end_barrier);
+    }
+    return NULL;
+}
+
+// bytes moved by one pass of @kernel over @n doubles, as STREAM counts them
+static uint64_t kernel_bytes(int kernel, size_t n) {
+    switch (kernel) {
+    case ADD:
+    case TRIAD:
+        return 3 * n * sizeof(double);
+    case MIX:
+        return n * sizeof(double);
+    default:
+        return 2 * n * sizeof(double);
+    }
+}
+
+static double measure(worker_t *workers, int kernel, int reads, int writes,
+                      int reps) {
+    uint64_t best = UINT64_MAX, start, t, bytes = 0;
+    int r, i;
+    for (i = 0; i < nthreads; i++) {
+        workers[i].kernel = kernel;
+        workers[i].reads = reads;
+        workers[i].writes = writes;
+        bytes += kernel_bytes(kernel, workers[i].n);
+    }
+    for (r = 0; r < reps; r++) {
+        if (ctl_fd >= 0 && ioctl(ctl_fd, NVMEMU_CTL_START) != 0)
+            perror("NVMEMU_CTL_START");
+        start = now_ns();
+        pthread_barrier_wait(&start_barrier);
+        pthread_barrier_wait(&end_barrier);
+        t = now_ns() - start;
+        if (ctl_fd >= 0 && ioctl(ctl_fd, NVMEMU_CTL_PAUSE) != 0)
+            perror("NVMEMU_CTL_PAUSE");
+        if (t < best)
+            best = t;
+    }
+    return (double)bytes * 1000.0 / best;      // MB/s
+}
+
+int main(int argc, char **argv) {
+    uint64_t bytes = 1ULL << 30;
+    int first_cpu = -1, node = -1, reps = 5, ctl = 0, opt, i, k;
+    double *a, *b, *c;
+    size_t n, slice;
+    pthread_t *threads;
+    worker_t *workers;
+
+    while ((opt = getopt(argc, argv, "t:c:n:s:r:x")) != -1) {
+        switch (opt) {
+        case 't': nthreads = atoi(optarg); break;
+        case 'c': first_cpu = atoi(optarg); break;
+        case 'n': node = atoi(optarg); break;
+        case 's': bytes = parse_size(optarg); break;
+        case 'r': reps = atoi(optarg); break;
+        case 'x': ctl = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-c first_cpu] [-n node] "
+                    "[-s bytes] [-r reps] [-x]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads < 1 || reps < 1) {
+        fprintf(stderr, "threads and reps must be positive\n");
+        return 1;
+    }
+    if (ctl && (ctl_fd = open(CTL_DEV, O_RDWR)) < 0) {
+        fprintf(stderr, "can not open %s: %s\n", CTL_DEV, strerror(errno));
+        return 1;
+    }
+
+    a = alloc_array(bytes, node);
+    b = alloc_array(bytes, node);
+    c = alloc_array(bytes, node);
+    if (!a || !b || !c) {
+        fprintf(stderr, "can not allocate 3 x %llu bytes\n",
+                (unsigned long long)bytes);
+        return 1;
+    }
+    n = bytes / sizeof(double);
+    // slices are whole lines so the mix kernel never shares lines
+    slice = n / nthreads / LINE_DOUBLES * LINE_DOUBLES;
+
+    threads = calloc(nthreads, sizeof(pthread_t));
+    workers = calloc(nthreads, sizeof(worker_t));
+    if (!threads || !workers)
+        return 1;
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    pthread_barrier_init(&end_barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+        workers[i].cpu = first_cpu >= 0 ? first_cpu + i : -1;
+        workers[i].a = a + i * slice;
+        workers[i].b = b + i * slice;
+        workers[i].c = c + i * slice;
+        workers[i].n = slice;
+        pthread_create(&threads[i], NULL, worker, &workers[i]);
+    }
+
+    printf("kernel,ratio,threads,bytes,mbps\n");
+    for (k = COPY; k < MIX; k++)
+        printf("%s,-,%d,%llu,%.1f\n", kernel_names[k], nthreads,
+               (unsigned long long)bytes, measure(workers, k, 0, 0, reps));
+    for (i = 0; i < (int)(sizeof(mix_ratios) / sizeof(mix_ratios[0])); i++)
+        printf("%s,%d:%d,%d,%llu,%.1f\n", kernel_names[MIX],
+               mix_ratios[i][0], mix_ratios[i][1], nthreads,
+               (unsigned long long)bytes,
+               measure(workers, MIX, mix_ratios[i][0], mix_ratios[i][1], reps));
+
+    running = 0;
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+  Pointer chasing latency benchmark.
+
+  A working set is cut into cache lines which are linked into one random
+  cycle, so every load depends on the previous one and neither the prefetcher
+  nor out-of-order execution can hide memory latency. The average time per
+  load is the latency seen by the program.
+
+  usage: latency [-c cpu] [-n node] [-s min_size] [-m max_size] [-w]
+                 [-i loads]
+      -c  pin the benchmark to @cpu, the emulator delays TARGET_CPU only
+      -n  bind the working set to NUMA node @node, the emulator counts
+          remote accesses, so use a node on the other socket
+      -s  smallest working set in bytes, default 16K (inside L1)
+      -m  largest working set in bytes, default 16G
+      -w  write heavy variant, every visited line is dirtied
+      -i  dependent loads per working set, default 2^24
+
+  Sizes accept K, M and G suffixes. One line is printed per working set:
+      size_bytes mode ns_per_load
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define LINE_SIZE        (64)
+#define MPOL_BIND        (2)
+
+typedef struct line {
+    struct line *next;
+    uint64_t pad[LINE_SIZE / 8 - 1];
+} line_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 0);
+    switch (*end) {
+    case 'g': case 'G': v <<= 10; /* fall through */
+    case 'm': case 'M': v <<= 10; /* fall through */
+    case 'k': case 'K': v <<= 10;
+    }
+    return v;
+}
+
+// xorshift, the permutation only needs to defeat the prefetcher
+static uint64_t rand_state = 88172645463325252ULL;
+static uint64_t next_rand(void) {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+static line_t *alloc_lines(uint64_t size, int node) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+    if (node >= 0) {
+        unsigned long mask[16] = { 0 };
+        mask[node / 64] = 1UL << (node % 64);
+        if (syscall(SYS_mbind, mem, size, MPOL_BIND, mask,
+                    sizeof(mask) * 8, 0) != 0) {
+            fprintf(stderr, "mbind to node %d failed: %s\n", node,
+                    strerror(errno));
+            munmap(mem, size);
+            return NULL;
+        }
+    }
+    return mem;
+}
+
+// Sattolo's algorithm gives a single cycle through all lines
+static line_t *link_lines(line_t *lines, uint64_t n) {
+    uint64_t *order = malloc(n * sizeof(uint64_t));
+    uint64_t i, j, t;
+    if (!order)
+        return NULL;
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    for (i = n - 1; i > 0; i--) {
+        j = next_rand() % i;
+        t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (i = 0; i < n; i++)
+        lines[order[i]].next = &lines[order[(i + 1) % n]];
+    free(order);
+    return lines;
+}
+
+static double chase(line_t *p, uint64_t loads, int write) {
+    uint64_t start, i;
+    // pages are already faulted in by link_lines(), warm up caches and TLBs
+    for (i = 0; i < loads / 8; i++)
+        p = p->next;
+
+    start = now_ns();
+    if (write) {
+        for (i = 0; i < loads; i++) {
+            p->pad[0]++;
+            p = p->next;
+        }
+    } else {
+        for (i = 0; i < loads; i++)
+            p = p->next;
+    }
+    // keep the compiler from dropping the chain
+    __asm__ volatile("" : : "r"(p) : "memory");
+    return (double)(now_ns() - start) / loads;
+}
+
+int main(int argc, char **argv) {
+    uint64_t min_size = 16ULL << 10, max_size = 16ULL << 30;
+    uint64_t loads = 1ULL << 24, size;
+    int cpu = -1, node = -1, write = 0, opt;
+
+    while ((opt = getopt(argc, argv, "c:n:s:m:wi:")) != -1) {
+        switch (opt) {
+        case 'c': cpu = atoi(optarg); break;
+        case 'n': node = atoi(optarg); break;
+        case 's': min_size = parse_size(optarg); break;
+        case 'm': max_size = parse_size(optarg); break;
+        case 'w': write = 1; break;
+        case 'i': loads = parse_size(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c cpu] [-n node] [-s min] [-m max] "
+                    "[-w] [-i loads]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            fprintf(stderr, "can not pin to cpu %d: %s\n", cpu, strerror(errno));
+            return 1;
+        }
+    }
+
+    for (size = min_size; size <= max_size; size *= 2) {
+        uint64_t n = size / LINE_SIZE;
+        line_t *lines = alloc_lines(size, node);
+        line_t *head;
+        if (!lines) {
+            fprintf(stderr, "can not allocate %llu bytes\n",
+                    (unsigned long long)size);
+            return 1;
+        }
+        head = link_lines(lines, n);
+        if (!head) {
+            munmap(lines, size);
+            return 1;
+        }
+        printf("%llu %s %.2f\n", (unsigned long long)size,
+               write ? "write" : "read", chase(head, loads, write));
+        fflush(stdout);
+        munmap(lines, size);
+    }
+    return 0;
+}
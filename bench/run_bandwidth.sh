@@ -0,0 +1,118 @@
+#!/bin/sh
+# Sweep the bandwidth benchmark over emulated latencies and compare against
+# the bandwidth expected from the emulator's latency model.
+#
+# usage: run_bandwidth.sh [-l "latencies"] [-t threads] [-c first_cpu]
+#                         [-n node] [-s bytes] [-e tolerance] [-b]
+#   -l  nvm_latency values in ns to sweep, default "100 300 600"
+#   -t  threads, default 1; more than one only with -b
+#   -c  cpu of the first thread, default 12 (the emulator's target cpu)
+#   -n  NUMA node of the arrays, remote to the threads, default 0
+#   -s  bytes per array, default 1G
+#   -e  allowed deviation from the expected bandwidth in %, default 20
+#   -b  baseline only, do not load the module (CI without uncore PMON)
+#
+# Prints CSV, one row per kernel and latency:
+#   kernel,ratio,threads,latency_ns,mbps_off,mbps_on,mbps_expected,error_pct
+# and exits with 1 if any row deviates more than the tolerance.
+#
+# Every counted line access stalls for nvm_latency ns, so the expected
+# bandwidth is 1000 / (1000 / mbps_off + lines * latency / 64) MB/s, with
+# lines the HA line accesses per 64 bytes STREAM counts: stores that are
+# not non-temporal read the line for ownership (RFO) before writing it
+# back, so copy and scale make 3 accesses per 2 counted lines, add and
+# triad 4 per 3, ntcopy 1 per 1 and mix r:w (r + 2w) per r + w.
+#
+# All accesses are charged to the emulator's target cpu, whatever thread
+# made them, so the model only holds for a single thread on that cpu and
+# the sweep refuses -t above 1.
+#
+# The module is loaded once with start_paused=1 and nvm_latency is
+# rewritten through sysfs for every point; bandwidth -x starts the
+# emulation through /dev/nvmemu_ctl for the timed repetitions only.
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+MODULE="$DIR/../emulator.ko"
+LATENCIES="100 300 600"
+THREADS=1
+CPU=12
+NODE=0
+SIZE=1G
+TOLERANCE=20
+BASELINE_ONLY=0
+
+while getopts "l:t:c:n:s:e:b" opt; do
+    case $opt in
+    l) LATENCIES=$OPTARG ;;
+    t) THREADS=$OPTARG ;;
+    c) CPU=$OPTARG ;;
+    n) NODE=$OPTARG ;;
+    s) SIZE=$OPTARG ;;
+    e) TOLERANCE=$OPTARG ;;
+    b) BASELINE_ONLY=1 ;;
+    *) sed -n '5,13p' "$0"; exit 1 ;;
+    esac
+done
+
+if [ $BASELINE_ONLY = 0 ] && [ "$THREADS" != 1 ]; then
+    echo "the latency model holds for -t 1 only, use -b for more threads" >&2
+    exit 1
+fi
+
+if [ ! -f "$MODULE" ] || [ "$(id -u)" != 0 ]; then
+    BASELINE_ONLY=1
+fi
+[ -d /sys/devices/system/node/node$NODE ] || NODE=-1
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"; if [ -n "$LOADED" ]; then rmmod emulator; fi' EXIT
+
+run() {
+    out=$1
+    shift
+    "$DIR/bandwidth" -t "$THREADS" -c "$CPU" -n "$NODE" -s "$SIZE" "$@" \
+        > "$OUT/$out"
+}
+
+run off
+if [ $BASELINE_ONLY = 1 ]; then
+    cat "$OUT/off"
+    exit 0
+fi
+
+insmod "$MODULE" mode=wr start_paused=1
+LOADED=1
+for latency in $LATENCIES; do
+    echo "$latency" > /sys/module/emulator/parameters/nvm_latency
+    run "on-$latency" -x
+done
+
+echo "kernel,ratio,threads,latency_ns,mbps_off,mbps_on,mbps_expected,error_pct"
+status=0
+for latency in $LATENCIES; do
+    awk -F, -v l="$latency" -v tol="$TOLERANCE" '
+        FNR == 1 { next }
+        FILENAME == ARGV[1] { off[$1 "," $2] = $5; next }
+        {
+            key = $1 "," $2
+            if ($1 == "copy" || $1 == "scale")
+                lines = 3 / 2
+            else if ($1 == "add" || $1 == "triad")
+                lines = 4 / 3
+            else if ($1 == "mix") {
+                split($2, rw, ":")
+                lines = (rw[1] + 2 * rw[2]) / (rw[1] + rw[2])
+            } else
+                lines = 1
+            expected = 1000 / (1000 / off[key] + lines * l / 64)
+            err = ($5 - expected) * 100 / expected
+            printf "%s,%s,%s,%.1f,%.1f,%.1f,%.1f\n",
+                   key, $3, l, off[key], $5, expected, err
+            if (err > tol || err < -tol)
+                bad = 1
+        }
+        END { exit bad }' "$OUT/off" "$OUT/on-$latency" || status=1
+done
+exit $status
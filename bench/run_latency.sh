@@ -0,0 +1,94 @@
+#!/bin/sh
+# Run the pointer chasing benchmark with the emulator off and on and print
+# achieved vs. configured extra latency per working set.
+#
+# usage: run_latency.sh [-l nvm_latency] [-c cpu] [-L local_node]
+#                       [-R remote_node] [-m max_size] [-b]
+#   -l  ns per access passed to the emulator as nvm_latency, default 300
+#   -c  cpu to run on, must be the emulator's target cpu, default 12
+#   -L  NUMA node local to @cpu, default 1
+#   -R  NUMA node remote to @cpu, default 0
+#   -m  largest working set, default 16G
+#   -b  baseline only, do not load the module (CI without uncore PMON)
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+MODULE="$DIR/../emulator.ko"
+LATENCY=300
+CPU=12
+LOCAL=1
+REMOTE=0
+MAX=16G
+BASELINE_ONLY=0
+
+while getopts "l:c:L:R:m:b" opt; do
+    case $opt in
+    l) LATENCY=$OPTARG ;;
+    c) CPU=$OPTARG ;;
+    L) LOCAL=$OPTARG ;;
+    R) REMOTE=$OPTARG ;;
+    m) MAX=$OPTARG ;;
+    b) BASELINE_ONLY=1 ;;
+    *) sed -n '4,12p' "$0"; exit 1 ;;
+    esac
+done
+
+if [ ! -f "$MODULE" ] || [ "$(id -u)" != 0 ]; then
+    BASELINE_ONLY=1
+fi
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"; if [ -n "$LOADED" ]; then rmmod emulator; fi' EXIT
+
+run() {
+    # $1: tag, $2: node, $3: extra flags
+    node=$2
+    # single node CI hosts have no remote memory, run unbound there
+    [ -d /sys/devices/system/node/node$node ] || node=-1
+    "$DIR/latency" -c "$CPU" -n "$node" -m "$MAX" $3 > "$OUT/$1"
+}
+
+for variant in read write; do
+    flag=""
+    [ $variant = write ] && flag="-w"
+    run "off-local-$variant" "$LOCAL" "$flag"
+    run "off-remote-$variant" "$REMOTE" "$flag"
+done
+
+if [ $BASELINE_ONLY = 0 ]; then
+    insmod "$MODULE" mode=wr nvm_latency="$LATENCY"
+    LOADED=1
+    for variant in read write; do
+        flag=""
+        [ $variant = write ] && flag="-w"
+        run "on-local-$variant" "$LOCAL" "$flag"
+        run "on-remote-$variant" "$REMOTE" "$flag"
+    done
+    rmmod emulator
+    LOADED=
+fi
+
+printf "%-12s %-7s %-6s %10s %10s %10s %10s\n" \
+       size placement mode off_ns on_ns achieved configured
+for variant in read write; do
+    for placement in local remote; do
+        off="$OUT/off-$placement-$variant"
+        on="$OUT/on-$placement-$variant"
+        [ -f "$on" ] || on=/dev/null
+        # only remote accesses are counted, local runs should stay unchanged
+        configured=$LATENCY
+        [ $placement = local ] && configured=0
+        [ $BASELINE_ONLY = 1 ] && configured=-
+        awk -v p=$placement -v c=$configured '
+            FILENAME == ARGV[1] { on[$1] = $3; next }
+            {
+                if ($1 in on)
+                    printf "%-12s %-7s %-6s %10.2f %10.2f %10.2f %10s\n",
+                           $1, p, $2, $3, on[$1], on[$1] - $3, c
+                else
+                    printf "%-12s %-7s %-6s %10.2f %10s %10s %10s\n",
+                           $1, p, $2, $3, "-", "-", c
+            }' "$on" "$off"
+    done
+done
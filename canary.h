@@ -0,0 +1,303 @@
+#ifndef __CANARY__
+#define __CANARY__
+
+#include <linux/cache.h>
+#include <linux/delay.h>
+#include <linux/gfp.h>
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
+
+#include "common.h"
+
+/*
+  Closed-loop latency control (nvm_target_ns). Include after stats.h,
+  phase.h and period.h.
+
+  The open loop charges accesses * nvm_latency, which drifts with the
+  workload: prefetches, the share of requests the HA does not count and
+  the overhead of the injection itself all move the latency a thread sees.
+  Instead, a canary thread on a delayed cpu chases a random cyclic chain
+  of cache lines in memory of the emulated region every interval, and a
+  PI controller moves the per-access penalty until the canary's latency
+  per dependent load is the target:
+      error    = target - measured
+      integral = integral + error
+      penalty  = base + kp * error + ki * integral     (kp, ki per mille)
+  The integral is clamped so that the penalty stays in [0, CANARY_MAX],
+  no windup while saturated. The loop has converged when the error stayed
+  within CANARY_BAND % of the target for CANARY_SETTLE probes in a row.
+  Gains, error, penalty and convergence are in debugfs nvmemu/closed_loop.
+
+  The delay is not spread over the accesses: the target cpu runs at DRAM
+  speed and then stalls once per sampling tick for all of them. A probe
+  shorter than a tick sees either no stall or a whole one, so the loop
+  would regulate how often probes hit a stall. A probe therefore chases
+  for at least CANARY_TICKS sampling periods, so that it averages whole
+  ticks with their stalls, and the loop is fed the median of the last
+  CANARY_FILTER probes, which drops the odd probe that caught one stall
+  more or less. The canary takes about 2 periods out of every interval of
+  the target cpu (2% at the defaults, more with long periods).
+
+  If no delay at all was requested while a probe ran, the penalty had no
+  accesses to act on, e.g. for a workload too light to cross
+  MIN_DELAYED_ACCESSES in the probe; the probe is reported but the
+  integral is held instead of winding up towards CANARY_MAX.
+
+  The chain spans far more than the LLC and visits its lines in random
+  order, so neither the caches nor the prefetchers help; TLB misses are part of
+  the latency, as for any pointer chase. Its pages are taken from @node
+  only; the NVM node is online_movable, so they are movable pages mapped
+  with vmap() and keep the node from being offlined until unload.
+*/
+
+#define CANARY_MAX                   (10000)   // ns per access
+#define CANARY_BAND                  (2)       // % of the target
+#define CANARY_SETTLE                (5)       // probes
+#define CANARY_TICKS                 (2)       // sampling periods per probe
+#define CANARY_FILTER                (3)       // probes, median of
+
+typedef struct {
+    struct task_struct *thread;
+    void **chain;             // one pointer per cache line
+    struct page **pages;      // of the chain, all on its node
+    uint64_t nr_pages;
+    uint64_t lines;
+    uint64_t loads;           // between two clock reads of a probe
+    unsigned int interval_ms;
+    void *sink;               // keeps the chase from being optimized away
+
+    uint64_t target;          // ns per load
+    int64_t kp;               // per mille
+    int64_t ki;               // per mille
+    int64_t base;             // ns, penalty at zero error
+    int64_t integral;         // ns
+    atomic64_t penalty;       // ns per access, read by the sampler
+
+    uint64_t raw[CANARY_FILTER];   // ns per load of the last probes
+    uint64_t measured;        // ns per load, their median
+    int64_t error;            // ns
+    uint64_t probes;
+    uint64_t held;            // probes without delay, integral held
+    uint64_t in_band;         // probes in a row within CANARY_BAND
+    uint64_t converged;       // probe the loop converged at, 0 if not
+} canary_t;
+
+static canary_t canary;
+
+// ns per access the sampler charges in closed-loop mode
+uint64_t canary_penalty(void) {
+    return atomic64_read(&canary.penalty);
+}
+
+// ns per load over at least @min_ns
+static noinline uint64_t canary_chase(uint64_t min_ns) {
+    void **p = canary.chain;
+    uint64_t start = ktime_get_ns(), elapsed, loads = 0, n;
+
+    do {
+        for (n = canary.loads; n; n--)
+            p = (void **)READ_ONCE(*p);
+        loads += canary.loads;
+        elapsed = ktime_get_ns() - start;
+    } while (elapsed < min_ns && !kthread_should_stop());
+    WRITE_ONCE(canary.sink, p);
+    return elapsed / loads;
+}
+
+static uint64_t canary_median(void) {
+    uint64_t a = canary.raw[0], b = canary.raw[1], c = canary.raw[2];
+
+    BUILD_BUG_ON(CANARY_FILTER != 3);
+    if (canary.probes < CANARY_FILTER)
+        return canary.raw[canary.probes % CANARY_FILTER];
+    return max(min(a, b), min(max(a, b), c));
+}
+
+// @delayed is false if no delay was requested while the probe ran
+static void canary_update(uint64_t raw, bool delayed) {
+    int64_t limit, out;
+
+    canary.raw[canary.probes % CANARY_FILTER] = raw;
+    canary.measured = canary_median();
+    canary.error = (int64_t)canary.target - (int64_t)canary.measured;
+    if (delayed)
+        canary.integral += canary.error;
+    else
+        canary.held++;
+    // anti-windup, the integral alone can not drive past the bounds
+    if (canary.ki) {
+        limit = CANARY_MAX * 1000 / canary.ki;
+        canary.integral = clamp_t(int64_t, canary.integral, -limit, limit);
+    }
+    out = canary.base + (canary.kp * canary.error +
+                         canary.ki * canary.integral) / 1000;
+    atomic64_set(&canary.penalty, clamp_t(int64_t, out, 0, CANARY_MAX));
+
+    canary.probes++;
+    if (abs(canary.error) * 100 <= canary.target * CANARY_BAND) {
+        if (++canary.in_band == CANARY_SETTLE && !canary.converged)
+            canary.converged = canary.probes;
+    } else {
+        canary.in_band = 0;
+        canary.converged = 0;
+    }
+}
+
+static int canary_thread(void *data) {
+    uint64_t requested, raw;
+
+    while (!kthread_should_stop()) {
+        // no penalty while paused, the integral would only wind up
+        if (phase_running()) {
+            requested = stats_sum(delay_requested);
+            raw = canary_chase(CANARY_TICKS * READ_ONCE(period.cur));
+            canary_update(raw, stats_sum(delay_requested) != requested);
+        }
+        msleep_interruptible(canary.interval_ms);
+    }
+    return 0;
+}
+
+static void canary_free_chain(void) {
+    uint64_t i;
+
+    if (canary.chain)
+        vunmap(canary.chain);
+    canary.chain = NULL;
+    for (i = 0; canary.pages && i < canary.nr_pages; i++)
+        if (canary.pages[i])
+            __free_page(canary.pages[i]);
+    kvfree(canary.pages);
+    canary.pages = NULL;
+    canary.nr_pages = 0;
+}
+
+/*
+  vmalloc_node() falls back to other nodes and never takes movable pages,
+  which is all the online_movable NVM node has, so the pages are allocated
+  one by one from @node only and mapped contiguously.
+*/
+static int canary_alloc_chain(int node, uint64_t size) {
+    const gfp_t gfp = GFP_HIGHUSER_MOVABLE | __GFP_THISNODE | __GFP_NOWARN;
+    uint64_t i;
+
+    canary.nr_pages = size >> PAGE_SHIFT;
+    canary.pages = kvcalloc(canary.nr_pages, sizeof(struct page *),
+                            GFP_KERNEL);
+    if (!canary.pages)
+        return -ENOMEM;
+    for (i = 0; i < canary.nr_pages; i++) {
+        canary.pages[i] = alloc_pages_node(node, gfp, 0);
+        if (!canary.pages[i])
+            return -ENOMEM;
+        if (page_to_nid(canary.pages[i]) != node) {
+            printk(KERN_ERR "canary page of node %d instead of %d\n",
+                   page_to_nid(canary.pages[i]), node);
+            return -ENOMEM;
+        }
+    }
+    canary.chain = vmap(canary.pages, canary.nr_pages, VM_MAP, PAGE_KERNEL);
+    return canary.chain ? 0 : -ENOMEM;
+}
+
+// link the lines to one random cycle, Sattolo's algorithm
+static int canary_build_chain(void) {
+    const uint64_t stride = L1_CACHE_BYTES / sizeof(void *);
+    uint64_t *order, i, j;
+
+    order = kvmalloc_array(canary.lines, sizeof(*order), GFP_KERNEL);
+    if (!order)
+        return -ENOMEM;
+    for (i = 0; i < canary.lines; i++)
+        order[i] = i;
+    for (i = canary.lines - 1; i > 0; i--) {
+        j = get_random_u32() % i;
+        swap(order[i], order[j]);
+    }
+    for (i = 0; i < canary.lines; i++)
+        canary.chain[order[i] * stride] =
+            &canary.chain[order[(i + 1) % canary.lines] * stride];
+    kvfree(order);
+    return 0;
+}
+
+static int stats_closed_loop_show(struct seq_file *m, void *v) {
+    seq_printf(m, "target_ns       %llu\n", canary.target);
+    seq_printf(m, "measured_ns     %llu\n", canary.measured);
+    seq_printf(m, "error_ns        %lld\n", canary.error);
+    seq_printf(m, "penalty_ns      %lld\n", atomic64_read(&canary.penalty));
+    seq_printf(m, "gains           kp %lld ki %lld (per mille)\n", canary.kp,
+               canary.ki);
+    seq_printf(m, "integral_ns     %lld\n", canary.integral);
+    seq_printf(m, "probes          %llu\n", canary.probes);
+    seq_printf(m, "held            %llu\n", canary.held);
+    if (canary.converged)
+        seq_printf(m, "converged       at probe %llu\n", canary.converged);
+    else
+        seq_printf(m, "converged       no\n");
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_closed_loop);
+
+/*
+  Probe @size bytes of node @node from @cpu, which must be a delayed cpu,
+  every @interval_ms. @base is the initial penalty, e.g. nvm_latency.
+*/
+int init_canary(uint64_t target, uint64_t base, int64_t kp, int64_t ki,
+                int cpu, int node, uint64_t size, uint64_t loads,
+                unsigned int interval_ms) {
+    memset(&canary, 0, sizeof(canary));
+    if (!target || !loads || size < 2 * L1_CACHE_BYTES) {
+        printk(KERN_ERR "closed loop needs a target, loads and a chain\n");
+        return -EINVAL;
+    }
+    // negative gains would invert the bounds of the integral
+    if (kp < 0 || ki < 0) {
+        printk(KERN_ERR "closed loop gains kp %lld ki %lld must not be "
+               "negative\n", kp, ki);
+        return -EINVAL;
+    }
+    canary.target = target;
+    canary.base = min_t(uint64_t, base, CANARY_MAX);
+    canary.kp = kp;
+    canary.ki = ki;
+    canary.loads = loads;
+    canary.interval_ms = interval_ms;
+    atomic64_set(&canary.penalty, canary.base);
+
+    size = round_up(size, PAGE_SIZE);
+    canary.lines = size / L1_CACHE_BYTES;
+    if (canary_alloc_chain(node, size) != 0 || canary_build_chain() != 0) {
+        printk(KERN_ERR "no %llu bytes on node %d for the canary\n", size, node);
+        canary_free_chain();
+        return -ENOMEM;
+    }
+
+    canary.thread = kthread_create(canary_thread, NULL, "Emulator canary");
+    if (IS_ERR(canary.thread)) {
+        printk(KERN_ERR "canary thread creation failed\n");
+        canary_free_chain();
+        canary.thread = NULL;
+        return -ENOMEM;
+    }
+    kthread_bind(canary.thread, cpu);
+    wake_up_process(canary.thread);
+
+    if (stats_dir)
+        debugfs_create_file("closed_loop", 0444, stats_dir, NULL,
+                            &stats_closed_loop_fops);
+    printk(KERN_INFO "closed loop to %llu ns, canary on cpu %d node %d\n",
+           target, cpu, node);
+    return 0;
+}
+
+void free_canary(void) {
+    if (canary.thread)
+        kthread_stop(canary.thread);
+    canary.thread = NULL;
+    canary_free_chain();
+}
+
+#endif
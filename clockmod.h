@@ -0,0 +1,182 @@
+#ifndef __CLOCKMOD__
+#define __CLOCKMOD__
+
+#include <linux/smp.h>
+#include <asm/msr.h>
+#include <asm/processor.h>
+
+#include "common.h"
+
+/*
+  Clock modulation delay (delay_mode=clockmod). Include after stats.h.
+
+  The stall path spins the target cpu for the whole delay of a tick, so a
+  thread runs at full speed and then stops for milliseconds, which request
+  handlers with latency targets do not survive. Instead, this path slows
+  the target cpu evenly through the software controlled clock of
+  IA32_CLOCK_MODULATION: with duty level l of n steps (n = 8, or 16 with
+  extended clock modulation), the core runs l/n of the time.
+
+  A tick that lasted elapsed ns at level l did work = elapsed * l / n ns of
+  full speed execution and owes delay ns for its accesses. Running the same
+  work per access at fraction f costs work * (1 - f) / f, so the next level
+  is the one closest to
+      f = work / (work + delay + backlog / CLOCKMOD_REPAY)
+  where backlog is the delay computed so far minus the delay paid, clamped
+  to one tick so that a saturated duty cycle does not wind up; repaying
+  only part of it per tick keeps the level from oscillating.
+  The MSR is written, by an IPI, only when the level changes; it is
+  restored when the emulator is unloaded.
+
+  Levels are coarse (12.5% or 6.25%) and on cores with hyper-threading the
+  modulation of one thread may slow or be overridden by its sibling, so
+  keep the sibling of the target cpu idle. The paid delay has no single
+  task to charge, so cost pages (cost_page.h) do not count it. Levels and
+  the paid delay are in debugfs nvmemu/clockmod.
+*/
+
+#define IA32_CLOCK_MODULATION        (0x19a)
+#define IA32_CLOCK_MODULATION_en     (1ULL << 4)
+#define IA32_CLOCK_MODULATION_duty   (0xfULL)      // bit 0 needs ECMD
+#define CPUID_6_EAX_ECMD             (1U << 5)
+#define CLOCKMOD_MAX_STEPS           (16)
+#define CLOCKMOD_REPAY               (4)           // ticks to repay backlog
+
+typedef struct {
+    int cpu;
+    bool armed;
+    uint64_t saved;           // MSR value at load
+    unsigned int steps;       // 8, or 16 with ECMD
+    unsigned int level;       // runs level / steps of the time, steps is off
+    uint64_t last;            // ns, timestamp of the previous update
+    int64_t backlog;          // ns computed but not paid yet
+    uint64_t computed;        // ns, totals
+    uint64_t paid;            // ns
+    uint64_t changes;
+    uint64_t failures;
+    uint64_t ticks[CLOCKMOD_MAX_STEPS + 1];  // per level
+} clockmod_t;
+
+static clockmod_t clockmod;
+
+static int clockmod_write(unsigned int level) {
+    uint64_t val = clockmod.saved &
+                   ~(IA32_CLOCK_MODULATION_en | IA32_CLOCK_MODULATION_duty);
+
+    if (level < clockmod.steps)
+        val |= IA32_CLOCK_MODULATION_en |
+               (level * (CLOCKMOD_MAX_STEPS / clockmod.steps));
+    if (wrmsrl_on_cpu(clockmod.cpu, IA32_CLOCK_MODULATION, val) != 0) {
+        clockmod.failures++;
+        return -EIO;
+    }
+    clockmod.level = level;
+    clockmod.changes++;
+    return 0;
+}
+
+/*
+  Charge @delay ns for the tick ending at @now. Returns the delay the
+  level of the ending tick was equivalent to.
+*/
+uint64_t clockmod_update(uint64_t delay, uint64_t now) {
+    uint64_t elapsed, work, paid;
+    int64_t want;
+    unsigned int level;
+
+    elapsed = clockmod.last ? now - clockmod.last : 0;
+    clockmod.last = now;
+    work = elapsed * clockmod.level / clockmod.steps;
+    paid = elapsed - work;
+
+    clockmod.backlog = clamp_t(int64_t,
+                               clockmod.backlog + (int64_t)delay - (int64_t)paid,
+                               -(int64_t)elapsed, elapsed);
+    want = max_t(int64_t,
+                 (int64_t)delay + clockmod.backlog / CLOCKMOD_REPAY, 0);
+    clockmod.computed += delay;
+    clockmod.paid += paid;
+    clockmod.ticks[clockmod.level]++;
+
+    if (!work)
+        return paid;
+    // closest level, at least 1
+    level = div64_u64(2 * clockmod.steps * work + work + want,
+                      2 * (work + want));
+    level = clamp_t(unsigned int, level, 1, clockmod.steps);
+    if (level != clockmod.level)
+        clockmod_write(level);
+    return paid;
+}
+
+// back to full speed while the emulation is paused
+void clockmod_pause(uint64_t now) {
+    clockmod.last = now;
+    clockmod.backlog = 0;
+    if (clockmod.level != clockmod.steps)
+        clockmod_write(clockmod.steps);
+}
+
+// ns the paid delay is behind (or ahead of) the computed one
+uint64_t clockmod_error(void) {
+    return abs(clockmod.backlog);
+}
+
+static int stats_clockmod_show(struct seq_file *m, void *v) {
+    unsigned int i;
+
+    seq_printf(m, "cpu             %d\n", clockmod.cpu);
+    seq_printf(m, "steps           %u\n", clockmod.steps);
+    seq_printf(m, "level           %u (%u%% duty)\n", clockmod.level,
+               clockmod.level * 100 / clockmod.steps);
+    seq_printf(m, "computed_ns     %llu\n", clockmod.computed);
+    seq_printf(m, "paid_ns         %llu\n", clockmod.paid);
+    seq_printf(m, "backlog_ns      %lld\n", clockmod.backlog);
+    seq_printf(m, "changes         %llu\n", clockmod.changes);
+    seq_printf(m, "failures        %llu\n", clockmod.failures);
+    seq_printf(m, "ticks per level\n");
+    for (i = 1; i <= clockmod.steps; i++)
+        seq_printf(m, "  %2u/%-2u         %llu\n", i, clockmod.steps,
+                   clockmod.ticks[i]);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_clockmod);
+
+int init_clockmod(int cpu) {
+    memset(&clockmod, 0, sizeof(clockmod));
+    if (!boot_cpu_has(X86_FEATURE_ACPI)) {
+        printk(KERN_ERR "no software controlled clock modulation\n");
+        return -ENODEV;
+    }
+    clockmod.cpu = cpu;
+    clockmod.steps = cpuid_eax(6) & CPUID_6_EAX_ECMD ? 16 : 8;
+    if (rdmsrl_on_cpu(cpu, IA32_CLOCK_MODULATION, &clockmod.saved) != 0) {
+        printk(KERN_ERR "Can not read IA32_CLOCK_MODULATION of cpu %d\n", cpu);
+        return -EIO;
+    }
+    if (clockmod.saved & IA32_CLOCK_MODULATION_en)
+        printk(KERN_WARNING "cpu %d is already clock modulated, overriding\n",
+               cpu);
+    if (clockmod_write(clockmod.steps) != 0) {
+        printk(KERN_ERR "Can not write IA32_CLOCK_MODULATION of cpu %d\n", cpu);
+        return -EIO;
+    }
+    clockmod.changes = 0;
+    clockmod.armed = true;
+
+    if (stats_dir)
+        debugfs_create_file("clockmod", 0444, stats_dir, NULL,
+                            &stats_clockmod_fops);
+    printk(KERN_INFO "clock modulation of cpu %d in %u steps\n", cpu,
+           clockmod.steps);
+    return 0;
+}
+
+void free_clockmod(void) {
+    if (!clockmod.armed)
+        return;
+    clockmod.armed = false;
+    wrmsrl_on_cpu(clockmod.cpu, IA32_CLOCK_MODULATION, clockmod.saved);
+}
+
+#endif
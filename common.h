@@ -6,3 +6,6 @@
 #include <linux/pci.h>
 #define enter() printk(KERN_INFO "ENTER %s\n", __FUNCTION__);
 #define leave() printk(KERN_INFO "LEAVE %s\n", __FUNCTION__);
+
+// every config space access is timed and reported here, see stats.h
+void account_cfg_access(uint64_t ns);
@@ -0,0 +1,204 @@
+#ifndef __COST_PAGE__
+#define __COST_PAGE__
+
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "common.h"
+#include "emulator_uapi.h"
+
+/*
+  Per-thread and per-process cost pages, /dev/nvmemu_cost. See
+  emulator_uapi.h for the page and the read protocol seen by userspace.
+  Include before inject.h, whose delay handlers charge the pages.
+
+  Every open file owns a page and is hashed by the pid, or the tgid, of the
+  task that opened it. A delay runs in an IPI on the delayed cpu, so the
+  task it interrupted is current there: the handler looks up the pages of
+  current and of its process under RCU and adds the accesses, the requested
+  and the spun delay of the tick. Writers of one page are serialized by its
+  lock and publish like a seqcount, odd seq while an update runs.
+  Without open files a delay only pays one atomic read.
+
+  Only stalls are charged, of TARGET_CPU or of tenant cpus. The clock
+  modulation path (clockmod.h) never interrupts the target cpu, its delay
+  is spread over the tick and whichever tasks ran in it, so under
+  delay_mode=clockmod the pages stay at 0.
+*/
+
+#define COST_PAGE_DEV                "nvmemu_cost"
+#define COST_PAGE_HASH_BITS          (8)
+
+typedef struct {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    pid_t id;                 // pid or tgid, by scope
+    uint32_t scope;           // NVMEMU_COST_THREAD or NVMEMU_COST_PROCESS
+    raw_spinlock_t lock;      // writers of the page
+    struct mutex rehash;      // NVMEMU_COST_SCOPE of threads sharing the file
+    struct page *page;
+    cost_page_t *cost;        // page_address(page)
+} cost_file_t;
+
+static DEFINE_HASHTABLE(cost_files, COST_PAGE_HASH_BITS);
+static DEFINE_SPINLOCK(cost_files_lock);
+static atomic_t nr_cost_files = ATOMIC_INIT(0);
+
+static void cost_file_add(cost_file_t *f, pid_t id, uint32_t scope) {
+    f->id = id;
+    f->scope = scope;
+    spin_lock(&cost_files_lock);
+    hash_add_rcu(cost_files, &f->node, f->id);
+    spin_unlock(&cost_files_lock);
+}
+
+static void cost_file_del(cost_file_t *f) {
+    spin_lock(&cost_files_lock);
+    hash_del_rcu(&f->node);
+    spin_unlock(&cost_files_lock);
+    // a delay handler may still write the page
+    synchronize_rcu();
+}
+
+static void cost_page_update(cost_file_t *f, uint64_t accesses,
+                             uint64_t requested, uint64_t injected) {
+    cost_page_t *cost = f->cost;
+    unsigned long flags;
+
+    raw_spin_lock_irqsave(&f->lock, flags);
+    WRITE_ONCE(cost->seq, cost->seq + 1);
+    smp_wmb();
+    WRITE_ONCE(cost->accesses, cost->accesses + accesses);
+    WRITE_ONCE(cost->requested_ns, cost->requested_ns + requested);
+    WRITE_ONCE(cost->injected_ns, cost->injected_ns + injected);
+    WRITE_ONCE(cost->delays, cost->delays + 1);
+    smp_wmb();
+    WRITE_ONCE(cost->seq, cost->seq + 1);
+    raw_spin_unlock_irqrestore(&f->lock, flags);
+}
+
+// charge a delay to the task it interrupted, runs in the delay's IPI
+void cost_charge(uint64_t accesses, uint64_t requested, uint64_t injected) {
+    pid_t pid, tgid;
+    cost_file_t *f;
+
+    if (!atomic_read(&nr_cost_files))
+        return;
+    pid = task_pid_nr(current);
+    tgid = task_tgid_nr(current);
+    if (!pid)
+        return;               // the idle task
+    rcu_read_lock();
+    hash_for_each_possible_rcu(cost_files, f, node, pid)
+        if (f->id == pid && f->scope == NVMEMU_COST_THREAD)
+            cost_page_update(f, accesses, requested, injected);
+    hash_for_each_possible_rcu(cost_files, f, node, tgid)
+        if (f->id == tgid && f->scope == NVMEMU_COST_PROCESS)
+            cost_page_update(f, accesses, requested, injected);
+    rcu_read_unlock();
+}
+
+static int cost_page_open(struct inode *inode, struct file *file) {
+    cost_file_t *f = kzalloc(sizeof(*f), GFP_KERNEL);
+
+    if (!f)
+        return -ENOMEM;
+    f->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!f->page) {
+        kfree(f);
+        return -ENOMEM;
+    }
+    f->cost = page_address(f->page);
+    f->cost->version = COST_PAGE_VERSION;
+    raw_spin_lock_init(&f->lock);
+    mutex_init(&f->rehash);
+    file->private_data = f;
+    cost_file_add(f, task_pid_nr(current), NVMEMU_COST_THREAD);
+    atomic_inc(&nr_cost_files);
+    return 0;
+}
+
+static int cost_page_release(struct inode *inode, struct file *file) {
+    cost_file_t *f = file->private_data;
+
+    atomic_dec(&nr_cost_files);
+    cost_file_del(f);
+    // a mapping keeps its own reference to the page
+    __free_page(f->page);
+    kfree(f);
+    return 0;
+}
+
+static long cost_page_ioctl(struct file *file, unsigned int cmd,
+                            unsigned long arg) {
+    cost_file_t *f = file->private_data;
+    uint32_t scope;
+
+    if (cmd != NVMEMU_COST_SCOPE)
+        return -ENOTTY;
+    if (copy_from_user(&scope, (void __user *)arg, sizeof(scope)))
+        return -EFAULT;
+    if (scope != NVMEMU_COST_THREAD && scope != NVMEMU_COST_PROCESS)
+        return -EINVAL;
+
+    // the node must not be deleted twice nor added while hashed
+    mutex_lock(&f->rehash);
+    cost_file_del(f);
+    cost_file_add(f, scope == NVMEMU_COST_THREAD ? task_pid_nr(current)
+                                                 : task_tgid_nr(current),
+                  scope);
+    mutex_unlock(&f->rehash);
+    return 0;
+}
+
+static int cost_page_mmap(struct file *file, struct vm_area_struct *vma) {
+    cost_file_t *f = file->private_data;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+    // the module is the only writer
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vm_flags_clear(vma, VM_MAYWRITE);
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    return vm_insert_page(vma, vma->vm_start, f->page);
+}
+
+static const struct file_operations cost_page_fops = {
+    .owner = THIS_MODULE,
+    .open = cost_page_open,
+    .release = cost_page_release,
+    .unlocked_ioctl = cost_page_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = cost_page_mmap,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice cost_page_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = COST_PAGE_DEV,
+    .fops = &cost_page_fops,
+    .mode = 0444,
+};
+
+int init_cost_pages(void) {
+    if (misc_register(&cost_page_dev) != 0) {
+        printk(KERN_ERR "Can not register /dev/%s\n", COST_PAGE_DEV);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+void free_cost_pages(void) {
+    // open files hold the module, none is left here
+    misc_deregister(&cost_page_dev);
+}
+
+#endif
@@ -8,9 +8,31 @@
 #include <linux/slab.h>
 #include <linux/delay.h>
 #include <linux/string.h>
+#include <linux/ktime.h>
 
 // #include "instance.h"
 #include "large_header.h"
+#include "platform.h"
+#include "sample_ring.h"
+#include "stats.h"
+#include "phase.h"
+#include "cost_page.h"
+#include "inject.h"
+#include "addr_filter.h"
+#include "nvm_node.h"
+#include "pmem_dev.h"
+#include "wear.h"
+#include "replay.h"
+#include "period.h"
+#include "tickless.h"
+#include "fanout.h"
+#include "tenant.h"
+#include "mux.h"
+#include "perf_source.h"
+#include "nearmem.h"
+#include "pebs.h"
+#include "canary.h"
+#include "clockmod.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Dicridon Xiong");
@@ -21,21 +43,253 @@ static char *mode = "wr";
 module_param(mode, charp, 0);
 MODULE_PARM_DESC(mode, "specify an emulating mode: w, r, wr");
 
+static unsigned long ring_pages = 16;
+module_param(ring_pages, ulong, 0);
+MODULE_PARM_DESC(ring_pages, "data pages of each per-cpu sample ring, power of 2");
+
+static unsigned long nvm_latency = 0;
+module_param(nvm_latency, ulong, 0644);
+MODULE_PARM_DESC(nvm_latency, "extra ns per counted access, 0 keeps the legacy per-tick delay; writable at runtime");
+
+static char *profile = NULL;
+module_param(profile, charp, 0);
+MODULE_PARM_DESC(profile, "calibration profile, loaded if it exists, written otherwise");
+
+static bool recalibrate = false;
+module_param(recalibrate, bool, 0);
+MODULE_PARM_DESC(recalibrate, "calibrate even if the profile exists");
+
+static unsigned long nvm_start = 0;
+module_param(nvm_start, ulong, 0);
+MODULE_PARM_DESC(nvm_start, "physical start of the NVM region, only its accesses are delayed");
+
+static unsigned long nvm_size = 0;
+module_param(nvm_size, ulong, 0);
+MODULE_PARM_DESC(nvm_size, "bytes of the NVM region, 0 counts all remote accesses");
+
+static int nvm_opcode = -1;
+module_param(nvm_opcode, int, 0);
+MODULE_PARM_DESC(nvm_opcode, "QPI opcode to match within the NVM region, -1 for any");
+
+static int nvm_node = -1;
+module_param(nvm_node, int, 0);
+MODULE_PARM_DESC(nvm_node, "move the NVM region into this NUMA node and count all remote accesses of nvm_socket, -1 to leave it");
+
+static int nvm_socket = 0;
+module_param(nvm_socket, int, 0);
+MODULE_PARM_DESC(nvm_socket, "socket whose HA0 is monitored, the NVM region must be homed there");
+
+static unsigned long pmem_start = 0;
+module_param(pmem_start, ulong, 0);
+MODULE_PARM_DESC(pmem_start, "physical start of /dev/nvmemu_pmem, reserved with memmap=");
+
+static unsigned long pmem_size = 0;
+module_param(pmem_size, ulong, 0);
+MODULE_PARM_DESC(pmem_size, "bytes of /dev/nvmemu_pmem, 0 for no pmem device");
+
+static unsigned long pmem_flush_latency = 300;
+module_param(pmem_flush_latency, ulong, 0);
+MODULE_PARM_DESC(pmem_flush_latency, "ns charged per flushed cache line of /dev/nvmemu_pmem");
+
+static unsigned int media_block = 0;
+module_param(media_block, uint, 0);
+MODULE_PARM_DESC(media_block, "bytes written to NVM media at once, 64 to 512 (256 for Optane), 0 disables wear accounting");
+
+static unsigned int wear_locality = 50;
+module_param(wear_locality, uint, 0);
+MODULE_PARM_DESC(wear_locality, "% of counted writes assumed sequential, filling whole media blocks");
+
+static unsigned long rmw_latency = 0;
+module_param(rmw_latency, ulong, 0);
+MODULE_PARM_DESC(rmw_latency, "extra ns per media read-modify-write");
+
+static char *source = "live";
+module_param(source, charp, 0);
+MODULE_PARM_DESC(source, "where counter deltas come from: live HA counters, perf uncore PMUs, pebs loads of tagged pages, or replay of /dev/nvmemu_replay");
+
+static bool perf_imc = false;
+module_param(perf_imc, bool, 0);
+MODULE_PARM_DESC(perf_imc, "source=perf: count CAS commands of the uncore_imc channels instead of the HA events");
+
+static unsigned long replay_records = 4096;
+module_param(replay_records, ulong, 0);
+MODULE_PARM_DESC(replay_records, "records queued by /dev/nvmemu_replay, power of 2");
+
+static unsigned long period_min_us = 1000;
+module_param(period_min_us, ulong, 0);
+MODULE_PARM_DESC(period_min_us, "shortest sampling period in us");
+
+static unsigned long period_max_us = 100000;
+module_param(period_max_us, ulong, 0);
+MODULE_PARM_DESC(period_max_us, "longest sampling period in us, equal to period_min_us for a fixed period");
+
+static unsigned long period_busy = 50000;
+module_param(period_busy, ulong, 0);
+MODULE_PARM_DESC(period_busy, "accesses per ms above which the sampling period is shortened");
+
+static unsigned long period_quiet = 100;
+module_param(period_quiet, ulong, 0);
+MODULE_PARM_DESC(period_quiet, "accesses per ms below which the sampling period is lengthened");
+
+static unsigned long period_max_error = 100000;
+module_param(period_max_error, ulong, 0);
+MODULE_PARM_DESC(period_max_error, "ns of delay error per tick above which the sampling period is shortened");
+
+static bool tickless_mode = false;
+module_param_named(tickless, tickless_mode, bool, 0);
+MODULE_PARM_DESC(tickless, "sleep until the counter overflows instead of polling");
+
+static unsigned long tickless_threshold = 100000;
+module_param(tickless_threshold, ulong, 0);
+MODULE_PARM_DESC(tickless_threshold, "accesses after which a tickless sampler wakes up");
+
+static unsigned int tickless_timeout_ms = 1000;
+module_param(tickless_timeout_ms, uint, 0);
+MODULE_PARM_DESC(tickless_timeout_ms, "longest sleep of a tickless sampler in ms");
+
+static char *tenants_spec = NULL;
+module_param_named(tenants, tenants_spec, charp, 0);
+MODULE_PARM_DESC(tenants, "name:cpulist:ns per access;... emulated side by side instead of TARGET_CPU");
+
+static char *mux_events = NULL;
+module_param(mux_events, charp, 0);
+MODULE_PARM_DESC(mux_events, "diagnostic HA events multiplexed on the unpinned pairs, e.g. local_reads,imc_writes");
+
+static unsigned long mux_slice_us = 100000;
+module_param(mux_slice_us, ulong, 0);
+MODULE_PARM_DESC(mux_slice_us, "time slice of a multiplexed event group in us");
+
+static char *platform = NULL;
+module_param(platform, charp, 0);
+MODULE_PARM_DESC(platform, "uncore register map: haswell-ep, broadwell or skylake-sp, detected by CPUID by default");
+
+static bool platform_check = false;
+module_param(platform_check, bool, 0);
+MODULE_PARM_DESC(platform_check, "check every register map against a simulated register file at load");
+
+static unsigned long nvm_target_ns = 0;
+module_param(nvm_target_ns, ulong, 0);
+MODULE_PARM_DESC(nvm_target_ns, "closed loop: ns per dependent load a canary on TARGET_CPU should see, 0 for the open loop");
+
+static long closed_loop_kp = 300;
+module_param(closed_loop_kp, long, 0);
+MODULE_PARM_DESC(closed_loop_kp, "proportional gain of the closed loop, per mille");
+
+static long closed_loop_ki = 100;
+module_param(closed_loop_ki, long, 0);
+MODULE_PARM_DESC(closed_loop_ki, "integral gain of the closed loop, per mille");
+
+static unsigned int canary_interval_ms = 1000;
+module_param(canary_interval_ms, uint, 0);
+MODULE_PARM_DESC(canary_interval_ms, "ms between two canary probes, a probe lasts two sampling periods");
+
+static unsigned long canary_loads = 4096;
+module_param(canary_loads, ulong, 0);
+MODULE_PARM_DESC(canary_loads, "dependent loads between two clock reads of a canary probe");
+
+static unsigned long canary_size_mb = 64;
+module_param(canary_size_mb, ulong, 0);
+MODULE_PARM_DESC(canary_size_mb, "MB chased by the canary, well above the LLC");
+
+static unsigned long pebs_period = 1000;
+module_param(pebs_period, ulong, 0);
+MODULE_PARM_DESC(pebs_period, "source=pebs: loads per PEBS sample");
+
+static unsigned long pebs_ldlat = 128;
+module_param(pebs_ldlat, ulong, 0);
+MODULE_PARM_DESC(pebs_ldlat, "source=pebs: cycles above which a load is sampled, keeps cache hits out");
+
+static unsigned long nearmem_mb = 0;
+module_param(nearmem_mb, ulong, 0);
+MODULE_PARM_DESC(nearmem_mb, "source=pebs: MB of modeled Memory Mode near memory in front of all memory, 0 for none");
+
+static unsigned int nearmem_line = 64;
+module_param(nearmem_line, uint, 0);
+MODULE_PARM_DESC(nearmem_line, "bytes per near-memory line");
+
+static bool start_paused = false;
+module_param(start_paused, bool, 0);
+MODULE_PARM_DESC(start_paused, "load without injecting delays until NVMEMU_CTL_START on /dev/nvmemu_ctl");
+
+static char *delay_mode = "stall";
+module_param(delay_mode, charp, 0);
+MODULE_PARM_DESC(delay_mode, "how TARGET_CPU pays the delay: stall spins in an IPI, clockmod lowers its duty cycle through IA32_CLOCK_MODULATION");
+
+#define TARGET_CPU                   (12)
+
 struct task_struct *kthread;
 HABox_t *HA0;
+addr_filter_t nvm_filter;
+enum {
+    SOURCE_LIVE,              // raw HA PMON registers through pcicfg
+    SOURCE_PERF,              // HA events through the uncore perf PMUs
+    SOURCE_REPLAY,            // deltas written to /dev/nvmemu_replay
+    SOURCE_PEBS,              // sampled loads of tagged pages, pebs.h
+} counter_source;
+enum {
+    DELAY_STALL,              // spin in delay() by IPI
+    DELAY_CLOCKMOD,           // duty cycle of the target cpu, clockmod.h
+} delay_path;
 
-void delay(void *d) {
-    uint64_t delay_time = (*((uint64_t *)d));
-    int cpu = get_cpu();
-    put_cpu();
-    printk(KERN_INFO "SMP on cpu %d, access number: %lld\n", cpu, delay_time);
-    
-    mdelay(delay_time / 2 + 2000);
+uint64_t compute_delay(uint64_t accesses) {
+    // nvm_latency may be rewritten through sysfs at any time
+    unsigned long latency = READ_ONCE(nvm_latency);
+
+    if (nvm_target_ns)
+        return accesses * canary_penalty();
+    if (latency)
+        return accesses * latency;
+    return (accesses / 2 + 2000) * NSEC_PER_MSEC;
+}
+
+// memory of the emulated region: the NVM node, or the one of nvm_socket
+static int nvm_memory_node(void) {
+    int cpu;
+
+    if (nvm_node >= 0)
+        return nvm_node;
+    for_each_online_cpu(cpu)
+        if (topology_physical_package_id(cpu) == nvm_socket)
+            return cpu_to_node(cpu);
+    return NUMA_NO_NODE;
+}
+
+static const event_t *mode_event(const char *mode) {
+    if (strcmp(mode, "wr") == 0) {
+        printk(KERN_INFO "read and write emulation\n");
+        return uncore_map->remote_access;
+    }
+    else if (strcmp(mode, "w") == 0) {
+        printk(KERN_INFO "only write emulation\n");
+        return uncore_map->remote_writes;
+    }
+    else if (strcmp(mode, "r") == 0) {
+        printk(KERN_INFO "only read emulation\n");
+        return uncore_map->remote_reads;
+    }
+    printk(KERN_INFO "Unknown option, default is wr emulation\n");
+    return uncore_map->remote_access;
+}
+
+// CAS commands of the iMC channels by mode, for perf_imc
+static const event_t *imc_event(const char *mode) {
+    if (strcmp(mode, "w") == 0)
+        return &IMC_event_cas_writes;
+    if (strcmp(mode, "r") == 0)
+        return &IMC_event_cas_reads;
+    return &IMC_event_cas_all;
 }
 
 int emulator(void* mode) {
     uint64_t counter = 0;
-    uint64_t delay_count = 100;
+    uint64_t writes = 0;
+    uint64_t rmw = 0;
+    uint64_t carried = 0;
+    uint64_t tick_start;
+    uint64_t last_sample = 0;
+    uint64_t error;
+    delay_t req;
+    sample_t sample;
     int cpu = get_cpu();
     int err = 0;
     put_cpu();
@@ -46,59 +300,253 @@ int emulator(void* mode) {
         printk(KERN_INFO "Emulation started\n");
     }
     
-    HA0 = get_HAbox(XEON_DOMAIN, 0, 0);
-    HA_box_freeze(HA0);
-    HA_box_reset_ctls(HA0);
-    HA_box_reset_ctrs(HA0);
-    HA_box_clear_overflow(HA0);
-    HA_disable_overflow(HA0, 0);
-
-    if (strcmp((char*)mode, "wr") == 0) {
-        printk(KERN_INFO "read and write emulation\n");
-        HA_choose_event(HA0, 0, &HA_event_remote_access);        
-    }
-    else if (strcmp((char*)mode, "w") == 0) {
-        printk(KERN_INFO "only write emulation\n");
-        HA_choose_event(HA0, 0, &HA_event_remote_writes);
-    }
-    else if (strcmp((char*)mode, "r") == 0) {
-        printk(KERN_INFO "only read emulation\n");
-        HA_choose_event(HA0, 0, &HA_event_remote_reads);        
-    }
-    else {
-        printk(KERN_INFO "Unknown option, default is wr emulation\n");
-        HA_choose_event(HA0, 0, &HA_event_remote_access);        
-    }
+    if (counter_source == SOURCE_PEBS) {
+        // no uncore counters at all, the loads come from the overflow NMI
+        stats_set_event(nvm_socket, 0, 0, "pebs tagged loads");
+        if (strcmp((char*)mode, "r") != 0 || pmem_size || media_block ||
+            tickless_mode || mux_events)
+            printk(KERN_WARNING "the pebs source only charges loads and "
+                   "ignores tickless and mux_events\n");
+        tickless_mode = false;
 
+        if (!profile || recalibrate || load_calibration(profile) != 0) {
+            if (calibrate(NULL, TARGET_CPU) == 0 && profile)
+                save_calibration(profile);
+        }
+        // drop what was sampled while calibrating
+        pebs_delta();
+    } else if (counter_source == SOURCE_REPLAY) {
+        // the deltas come from the trace, no HA is needed or programmed
+        stats_set_event(nvm_socket, 0, 0, "replayed accesses");
+        if (nvm_size || tickless_mode || mux_events)
+            printk(KERN_WARNING "the replay source ignores nvm_size, tickless "
+                   "and mux_events\n");
+        tickless_mode = false;
 
-    HA_enable(HA0, 0);        // pair0 in HA0 in socket0 will monitor remote reads
-    HA_box_unfreeze(HA0);
-    msleep(10);
+        if (!profile || recalibrate || load_calibration(profile) != 0) {
+            if (calibrate(NULL, TARGET_CPU) == 0 && profile)
+                save_calibration(profile);
+        }
+    } else if (counter_source == SOURCE_PERF) {
+        const event_t *writes_event = perf_imc ? &IMC_event_cas_writes
+                                               : uncore_map->remote_writes;
 
-    while(1) {
+        // perf owns the HA registers, they are never touched here
+        if (init_perf_source(nvm_socket, 0, perf_imc) != 0 ||
+            perf_source_add(0, perf_imc ? imc_event((char*)mode)
+                                        : mode_event((char*)mode)) != 0) {
+            printk(KERN_ERR "perf counter source failed\n");
+            return -1;
+        }
+        stats_set_event(nvm_socket, 0, 0, perf_source.counters[0].ha_event->name);
+        if ((pmem_size || media_block) &&
+            perf_source_add(1, writes_event) == 0)
+            stats_set_event(nvm_socket, 0, 1, writes_event->name);
+        if (nvm_size || tickless_mode || mux_events)
+            printk(KERN_WARNING "the perf source ignores nvm_size, tickless "
+                   "and mux_events\n");
+        tickless_mode = false;
+
+        if (!profile || recalibrate || load_calibration(profile) != 0) {
+            if (calibrate(NULL, TARGET_CPU) == 0) {
+                calibration.tick = perf_source_tick_cost();
+                if (profile)
+                    save_calibration(profile);
+            }
+        }
+        // drop what was counted while calibrating
+        perf_source_delta(0);
+        perf_source_delta(1);
+        msleep(10);
+    } else {
+        HA0 = get_HAbox(XEON_DOMAIN, nvm_socket, 0);
+        if (!HA0)
+            return -1;
         HA_box_freeze(HA0);
-        HA_read_counter(HA0, 0, &counter);
-        if (counter >= 1000) {
-	    delay_count = counter;
-	    printk(KERN_INFO "delay count is %lld\n", delay_count);
-            err = smp_call_function_single(12, delay, &delay_count, 1);
+        HA_box_reset_ctls(HA0);
+        HA_box_reset_ctrs(HA0);
+        HA_box_clear_overflow(HA0);
+        HA_disable_overflow(HA0, 0);
+
+        if (!profile || recalibrate || load_calibration(profile) != 0) {
+            if (calibrate(HA0, TARGET_CPU) == 0 && profile)
+                save_calibration(profile);
+        }
+
+        HA_choose_event(HA0, 0, mode_event((char*)mode));
+        /*
+          the region filter replaces the event chosen by mode, an NVM node is
+          far too large to walk and counts the socket unfiltered, nvm_node.h
+        */
+        if (nvm_size && nvm_node < 0 &&
+            init_addr_filter(&nvm_filter, HA0, 0, nvm_start, nvm_size,
+                             nvm_opcode) != 0) {
+            printk(KERN_ERR "NVM region filter failed\n");
+            return -1;
+        }
+        stats_set_event(nvm_socket, 0, 0, HA0->event->name);
+        // pair1 counts the writes charged at pmem fences and wearing the media
+        if (pmem_size || media_block) {
+            HA_choose_event(HA0, 1, uncore_map->remote_writes);
+            HA_enable(HA0, 1);
+            stats_set_event(nvm_socket, 0, 1, uncore_map->remote_writes->name);
+        }
+
+        HA_enable(HA0, 0);        // pair0 in HA0 in socket0 will monitor remote reads
+        // the pairs feeding the delay are pinned, diagnostics share the rest
+        if (mux_events && counter_source == SOURCE_LIVE &&
+            init_mux(HA0, mux_events, (pmem_size || media_block) ? 0x3 : 0x1,
+                     mux_slice_us) != 0)
+            printk(KERN_WARNING "multiplexing failed, no diagnostic events\n");
+        if (tickless_mode && counter_source == SOURCE_LIVE &&
+            init_tickless(HA0, 0, nvm_socket, 0, tickless_threshold) != 0) {
+            printk(KERN_WARNING "tickless sampling failed, polling instead\n");
+            tickless_mode = false;
+        }
+        HA_box_unfreeze(HA0);
+        msleep(10);
+    }
+
+    while(1) {
+        if (kthread_should_stop()) {
+            printk(KERN_INFO "Signal received, thread ends\n");
+            do_exit(0);
+        }
+        tick_start = ktime_get_ns();
+        if (counter_source == SOURCE_REPLAY) {
+            // wake up regularly to notice kthread_stop, paced by the record
+            if (replay_next(&sample, msecs_to_jiffies(10)) != 0)
+                continue;
+            tick_start = ktime_get_ns();
+            counter = sample.deltas[0];
+            writes = sample.deltas[1];
+            sample.flags = SAMPLE_FLAG_REPLAY;
+            sample.computed_delay = 0;
+            sample.injected_delay = 0;
+        } else if (counter_source == SOURCE_PEBS) {
+            memset(&sample, 0, sizeof(sample));
+            counter = pebs_delta();
+            writes = 0;
+            sample.deltas[0] = counter;
+        } else if (counter_source == SOURCE_PERF) {
+            memset(&sample, 0, sizeof(sample));
+            counter = perf_source_delta(0);
+            writes = perf_source_delta(1);
+            sample.deltas[0] = counter;
+            sample.deltas[1] = writes;
+        } else {
+            HA_box_freeze(HA0);
+            HA_read_counter(HA0, 0, &counter);
+            if (tickless_mode)
+                counter = tickless_count(counter);
+            if (nvm_filter.lines) {
+                counter = addr_filter_scale(&nvm_filter, counter);
+                addr_filter_advance(&nvm_filter, HA0);
+            }
+            memset(&sample, 0, sizeof(sample));
+            sample.deltas[0] = counter;
+            if (pmem_size || media_block) {
+                HA_read_counter(HA0, 1, &writes);
+                HA_reset_ctr(HA0, 1);
+                sample.deltas[1] = writes;
+            }
+            mux_tick(ktime_get_ns());
+        }
+        sample.timestamp = ktime_get_ns();
+        sample.socket = nvm_socket;
+        sample.target_cpu = TARGET_CPU;
+        stats_add_accesses(nvm_socket, 0, 0, counter);
+        error = 0;
+        if (pmem_size || media_block) {
+            stats_add_accesses(nvm_socket, 0, 1, writes);
+            pmem_account_writes(writes);
+            rmw = wear_write_lines(writes);
         }
-        // printk(KERN_INFO "REMOTE READS %lld\n", counter);
+        /*
+          Ticks with few accesses are not worth an IPI, but whatever the
+          period, their accesses are carried over until MIN_DELAYED_ACCESSES
+          add up instead of being dropped.
+        */
+        carried += counter;
+        if (!phase_running()) {
+            // warm-up or a pause: the deltas are drained, nobody pays
+            carried = 0;
+            if (delay_path == DELAY_CLOCKMOD)
+                clockmod_pause(sample.timestamp);
+        } else if (nr_tenants) {
+            // the tenants write their own samples
+            carried = 0;
+            tenants_charge(counter, rmw, &sample);
+        } else if (delay_path == DELAY_CLOCKMOD) {
+            // every tick, a quiet one raises the duty cycle again
+            sample.computed_delay = wear_delay(rmw);
+            if (carried >= MIN_DELAYED_ACCESSES) {
+                sample.computed_delay += compute_delay(carried);
+                carried = 0;
+            }
+            sample.injected_delay = clockmod_update(sample.computed_delay,
+                                                    sample.timestamp);
+            sample.flags |= SAMPLE_FLAG_CLOCKMOD;
+            stats_add_delay(sample.computed_delay, sample.injected_delay);
+            error = clockmod_error();
+        } else if (carried >= MIN_DELAYED_ACCESSES || wear_delay(rmw)) {
+            sample.computed_delay = wear_delay(rmw);
+            req.accesses = 0;
+            if (carried >= MIN_DELAYED_ACCESSES) {
+                sample.computed_delay += compute_delay(carried);
+                req.accesses = carried;
+                carried = 0;
+            }
+            // the victim already pays for this tick and the IPI itself
+            req.delay = compensate_delay(sample.computed_delay);
+            req.injected = 0;
+            req.requested = sample.computed_delay;
+            if (req.delay) {
+                err = smp_call_function_single(TARGET_CPU, delay, &req, 1);
+                sample.injected_delay = req.injected;
+                sample.flags |= SAMPLE_FLAG_DELAYED;
+                stats_add_delay(sample.computed_delay,
+                                req.injected + calibration_overhead());
+                error = abs_diff(sample.computed_delay,
+                                 req.injected + calibration_overhead());
+                if (err != 0) {
+                    sample.flags |= SAMPLE_FLAG_IPI_FAILED;
+                    stats_ipi_failed();
+                }
+            } else {
+                stats_add_delay(sample.computed_delay, 0);
+            }
+        }
+        phase_account(counter, sample.computed_delay, sample.injected_delay);
+        if (!nr_tenants)
+            sample_ring_write(&sample);
 	if (err != 0) {
             printk(KERN_WARNING "sending smp failed\n");
 	    err = 0;
 	    msleep(2000);
 	}
-        HA_reset_ctr(HA0, 0);
-        // disable overflow only disable PMI interrupt, must clear overflow signal
-        // manually
-        HA_box_clear_overflow(HA0);
-        HA_box_unfreeze(HA0);
-        if (kthread_should_stop()) {
-            printk(KERN_INFO "Signal received, thread ends\n");
-            do_exit(0);
+        if (counter_source == SOURCE_LIVE) {
+            if (tickless_mode)
+                tickless_rearm();
+            else
+                HA_reset_ctr(HA0, 0);
+            // disable overflow only disable PMI interrupt, must clear overflow signal
+            // manually
+            HA_box_clear_overflow(HA0);
+            HA_box_unfreeze(HA0);
+        }
+        stats_tick(ktime_get_ns() - tick_start);
+        // replay_next() waits for the recorded gap of the next record
+        if (counter_source == SOURCE_REPLAY)
+            continue;
+        if (tickless_mode) {
+            tickless_wait(msecs_to_jiffies(tickless_timeout_ms));
+        } else {
+            if (last_sample)
+                period_update(counter, sample.timestamp - last_sample, error);
+            last_sample = sample.timestamp;
+            period_sleep(ktime_get_ns() - tick_start);
         }
-        msleep(10);
     }
     return 0;
 }
@@ -109,23 +557,199 @@ static int __init start_emulator(void) {
         printk(KERN_INFO "insmod emulator.ko w/r/wr\n");
         return -1;
     }
+
+    if (strcmp("live", source) == 0) {
+        counter_source = SOURCE_LIVE;
+    } else if (strcmp("perf", source) == 0) {
+        counter_source = SOURCE_PERF;
+    } else if (strcmp("replay", source) == 0) {
+        counter_source = SOURCE_REPLAY;
+    } else if (strcmp("pebs", source) == 0) {
+        counter_source = SOURCE_PEBS;
+    } else {
+        printk(KERN_WARNING "Invalid source %s, live, perf, pebs or replay\n",
+               source);
+        return -1;
+    }
+
+    if (strcmp("stall", delay_mode) == 0) {
+        delay_path = DELAY_STALL;
+    } else if (strcmp("clockmod", delay_mode) == 0) {
+        delay_path = DELAY_CLOCKMOD;
+    } else {
+        printk(KERN_WARNING "Invalid delay_mode %s, stall or clockmod\n",
+               delay_mode);
+        return -1;
+    }
+
+    if (init_platform(platform, platform_check) != 0) {
+        printk(KERN_ERR "unsupported platform\n");
+        return -1;
+    }
+
+    if (nvm_node >= 0 && !nvm_size) {
+        printk(KERN_WARNING "nvm_node needs nvm_start and nvm_size\n");
+        return -1;
+    }
+    if (nvm_node >= 0 && nvm_opcode >= 0)
+        printk(KERN_WARNING "nvm_node counts unfiltered, nvm_opcode is "
+               "ignored\n");
+
+    if (nvm_node >= 0 && init_nvm_node(nvm_node, nvm_start, nvm_size) != 0) {
+        printk(KERN_ERR "NVM node creation failed\n");
+        return -1;
+    }
+
+    if (init_sample_rings(ring_pages) != 0) {
+        printk(KERN_ERR "sample rings initialization failed\n");
+        goto err_rings;
+    }
+    if (init_cost_pages() != 0) {
+        printk(KERN_ERR "cost pages initialization failed\n");
+        free_sample_rings();
+        goto err_rings;
+    }
+    // statistics are optional, the emulator runs without debugfs
+    init_stats();
+    init_calibration_stats();
+    if (init_phases(start_paused) != 0) {
+        printk(KERN_ERR "emulation control initialization failed\n");
+        free_stats();
+        free_cost_pages();
+        free_sample_rings();
+        goto err_rings;
+    }
+
+    if (init_period(period_min_us, period_max_us, period_busy, period_quiet,
+                    period_max_error) != 0) {
+        printk(KERN_ERR "sampling period initialization failed\n");
+        goto err_pmem;
+    }
+    init_period_stats();
+
+    if (media_block) {
+        if (init_wear(media_block, wear_locality, rmw_latency) != 0) {
+            printk(KERN_ERR "wear accounting initialization failed\n");
+            goto err_pmem;
+        }
+        init_wear_stats();
+    }
+
+    if (counter_source == SOURCE_REPLAY && init_replay(replay_records) != 0) {
+        printk(KERN_ERR "replay source creation failed\n");
+        goto err_pmem;
+    }
+
+    if (nearmem_mb && counter_source != SOURCE_PEBS) {
+        printk(KERN_WARNING "nearmem_mb needs the sampled addresses of "
+               "source=pebs\n");
+        goto err_pmem;
+    }
+
+    if (counter_source == SOURCE_PEBS) {
+        if (tenants_spec) {
+            printk(KERN_ERR "source=pebs only samples TARGET_CPU, no tenants\n");
+            goto err_pmem;
+        }
+        if (nearmem_mb && init_nearmem(nearmem_mb, nearmem_line) != 0) {
+            printk(KERN_ERR "near memory model creation failed\n");
+            goto err_pmem;
+        }
+        if (init_pebs(TARGET_CPU, pebs_period, pebs_ldlat, nvm_start,
+                      nvm_size) != 0) {
+            printk(KERN_ERR "PEBS source creation failed\n");
+            goto err_pmem;
+        }
+    }
+
+    if (tenants_spec) {
+        char *specs = kstrdup(tenants_spec, GFP_KERNEL);
+        int ret = specs ? init_tenants(specs) : -ENOMEM;
+        kfree(specs);
+        if (ret != 0) {
+            printk(KERN_ERR "tenants initialization failed\n");
+            goto err_pmem;
+        }
+    }
+
+    if (nvm_target_ns) {
+        if (nr_tenants)
+            printk(KERN_WARNING "the closed loop only drives TARGET_CPU, "
+                   "not the tenants\n");
+        if (init_canary(nvm_target_ns, nvm_latency, closed_loop_kp,
+                        closed_loop_ki, TARGET_CPU, nvm_memory_node(),
+                        canary_size_mb << 20, canary_loads,
+                        canary_interval_ms) != 0) {
+            printk(KERN_ERR "closed loop initialization failed\n");
+            goto err_pmem;
+        }
+    }
+
+    if (delay_path == DELAY_CLOCKMOD) {
+        if (nr_tenants)
+            printk(KERN_WARNING "clock modulation only slows TARGET_CPU, "
+                   "tenants are stalled\n");
+        if (init_clockmod(TARGET_CPU) != 0) {
+            printk(KERN_ERR "clock modulation initialization failed\n");
+            goto err_pmem;
+        }
+    }
+
+    if (pmem_size && init_pmem_dev(pmem_start, pmem_size,
+                                   pmem_flush_latency) != 0) {
+        printk(KERN_ERR "pmem device creation failed\n");
+        goto err_pmem;
+    }
     
     kthread = kthread_create(emulator, mode, "Emulator");
 
     if (!kthread) {
         printk(KERN_ERR "kernel thread creation failed\n");
-        return -1;
+        goto err_kthread;
     }
     // cpu 1 on socket 0, client should run on socket 1
     kthread_bind(kthread, 1); 
     wake_up_process(kthread);
     printk(KERN_INFO "module installed\n");
     return 0;
+
+err_kthread:
+    free_pmem_dev();
+err_pmem:
+    free_clockmod();
+    free_canary();
+    free_tenants();
+    free_pebs();
+    free_nearmem();
+    free_replay();
+    free_phases();
+    free_stats();
+    free_cost_pages();
+    free_sample_rings();
+err_rings:
+    free_nvm_node();
+    return -1;
 }
 
 static void __exit terminate_emulator(void) {
     kthread_stop(kthread);
+    free_clockmod();
+    free_canary();
+    free_tickless();
+    free_mux();
+    free_addr_filter(&nvm_filter, HA0);
     free_HAbox(HA0);
+    free_perf_source();
+    free_pmem_dev();
+    free_tenants();
+    free_pebs();
+    free_nearmem();
+    free_replay();
+    free_phases();
+    free_stats();
+    free_cost_pages();
+    free_sample_rings();
+    free_nvm_node();
     printk(KERN_INFO "module removed\n");
 }
 
@@ -0,0 +1,135 @@
+#ifndef __EMULATOR_UAPI__
+#define __EMULATOR_UAPI__
+
+/*
+  Structures shared by the emulator module and userspace tools.
+  Only fixed-width types are used here so that the layout is the same on
+  both sides.
+*/
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+  Sample ring buffer, exported by /dev/nvmemu_samples.
+
+  Every cpu owns one ring which is mmaped at offset
+  cpu * (1 + data pages) * page size. Like perf, the first page of a ring is a
+  control page and the data pages follow it:
+
+      +--------------+----------------------------------+
+      | control page | data pages (power of two)        |
+      +--------------+----------------------------------+
+
+  The emulator only moves data_head, userspace only moves data_tail. Both are
+  free running byte counters, so a record lives at (pos & (data_size - 1)).
+  Read data_head, issue a read barrier, consume records up to data_head, issue
+  a full barrier and store data_tail. If the ring is full, new samples are
+  dropped and counted in lost.
+*/
+
+#define SAMPLE_RING_VERSION          (1)
+
+typedef struct {
+    __u32 version;
+    __u32 record_size;       // sizeof(sample_t)
+    __u64 data_offset;       // offset of the first data page in the ring
+    __u64 data_size;         // bytes of data pages, power of two
+    __u64 lost;              // samples dropped because the ring was full
+    __u64 __reserved[12];    // keep data_head on its own cache line
+
+    __u64 data_head;         // written by the emulator
+    __u64 __pad[7];
+    __u64 data_tail;         // written by userspace
+} sample_ring_page_t;
+
+#define SAMPLE_NR_COUNTERS           (4)
+
+// one record per sampling tick, 64 bytes so records never cross a page
+typedef struct {
+    __u64 timestamp;                   // ns, ktime_get_ns()
+    __u8  socket;
+    __u8  box;
+    __u16 target_cpu;
+    __u32 flags;
+    __u64 deltas[SAMPLE_NR_COUNTERS];  // counter delta of every pair
+    __u64 computed_delay;              // ns the latency model asked for
+    __u64 injected_delay;              // ns actually spun on target_cpu,
+                                       // calibrated overhead excluded
+} sample_t;
+
+#define SAMPLE_FLAG_DELAYED          (1 << 0)    // an IPI was sent
+#define SAMPLE_FLAG_IPI_FAILED       (1 << 1)
+#define SAMPLE_FLAG_REPLAY           (1 << 2)    // deltas came from a trace
+#define SAMPLE_FLAG_CLOCKMOD         (1 << 3)    // injected_delay is the
+                                                 // duty cycle's equivalent
+
+/*
+  Cost page, exported by /dev/nvmemu_cost.
+
+  Every open file descriptor owns one read-only page, mmaped at offset 0,
+  with the emulated NVM cost of the thread that opened it, or of its whole
+  process after NVMEMU_COST_SCOPE. A delay is charged to the thread it
+  interrupted. The module updates the page like a seqcount, so a thread
+  reads its cost without syscalls:
+      do {
+          seq = load(page->seq);
+          read barrier;
+          copy accesses, requested_ns, injected_ns and delays;
+          read barrier;
+      } while ((seq & 1) || seq != load(page->seq));
+*/
+
+#define COST_PAGE_VERSION            (1)
+
+typedef struct {
+    __u32 version;
+    __u32 seq;               // odd while the module updates the page
+    __u64 accesses;          // counted accesses of the delays charged here
+    __u64 requested_ns;      // ns the latency model asked for
+    __u64 injected_ns;       // ns actually spun, calibrated overhead excluded
+    __u64 delays;            // number of delays charged
+} cost_page_t;
+
+#define NVMEMU_COST_THREAD           (0)
+#define NVMEMU_COST_PROCESS          (1)
+
+/*
+  ioctls of the emulator's char devices, all share one magic number.
+*/
+#define NVMEMU_IOC_MAGIC             'N'
+
+// /dev/nvmemu_pmem: charge write-back latency of [offset, offset + len)
+struct nvmemu_flush {
+    __u64 offset;            // byte offset into the device
+    __u64 len;
+};
+
+#define NVMEMU_PMEM_FLUSH            _IOW(NVMEMU_IOC_MAGIC, 1, struct nvmemu_flush)
+// /dev/nvmemu_pmem: charge every line written since the last fence
+#define NVMEMU_PMEM_FENCE            _IO(NVMEMU_IOC_MAGIC, 2)
+// /dev/nvmemu_cost: charge the thread (default) or the process of the caller
+#define NVMEMU_COST_SCOPE            _IOW(NVMEMU_IOC_MAGIC, 3, __u32)
+
+// /dev/nvmemu_ctl: measurement windows, see phase.h
+#define NVMEMU_PHASE_NAME            (32)
+
+struct nvmemu_phase {
+    char name[NVMEMU_PHASE_NAME];
+};
+
+#define NVMEMU_CTL_START             _IO(NVMEMU_IOC_MAGIC, 4)
+#define NVMEMU_CTL_PAUSE             _IO(NVMEMU_IOC_MAGIC, 5)
+#define NVMEMU_CTL_STOP              _IO(NVMEMU_IOC_MAGIC, 6)
+#define NVMEMU_CTL_PHASE             _IOW(NVMEMU_IOC_MAGIC, 7, struct nvmemu_phase)
+
+// /dev/nvmemu_pebs: tag [start, start + len) of the caller as NVM, or untag
+struct nvmemu_range {
+    __u64 start;             // virtual, rounded to pages
+    __u64 len;
+};
+
+#define NVMEMU_PEBS_TAG              _IOW(NVMEMU_IOC_MAGIC, 8, struct nvmemu_range)
+#define NVMEMU_PEBS_UNTAG            _IOW(NVMEMU_IOC_MAGIC, 9, struct nvmemu_range)
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef __FANOUT__
+#define __FANOUT__
+
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/perf_event.h>
+#include <linux/smp.h>
+
+#include "common.h"
+
+/*
+  Fan-out delay injection. Include after stats.h, cost_page.h and inject.h.
+
+  Delaying n cpus with one smp_call_function_single() each queues and sends
+  n IPIs one after the other, so the last cpu starts its delay n round
+  trips after the first. Here the sampler writes the delay of every cpu to
+  that cpu's slot and marks it pending; fanout_send() then delivers all of
+  them with one smp_call_function_many(), where every cpu reads its own
+  slot. The broadcast does not wait, the cpus spin in parallel and a slot
+  is collected in a later tick:
+      fanout_collect()   the delay a finished slot spun, -EBUSY if running
+      fanout_count()     the slot's counter as read by its last broadcast
+      fanout_set()       the delay of the next broadcast, may be 0
+      fanout_send()      one broadcast to every cpu set since the last one
+  A slot may carry a perf counter of its cpu (fanout_set_counter()), read
+  with perf_event_read_local() on that cpu when the broadcast lands, so the
+  sampler never reads counters of other cpus through an IPI of its own.
+  The sampler's own cpu can not be delayed, smp_call_function_many() skips
+  it, and neither can an offline one; their delays are dropped.
+
+  Send cost per broadcast and the dispatch latency, from the broadcast to
+  the start of the delay on a cpu, are in debugfs nvmemu/fanout.
+*/
+
+#define FANOUT_RUNNING               (U64_MAX)
+
+typedef struct {
+    uint64_t delay;           // ns, may be 0 for a counter read only
+    uint64_t accesses;        // charged to the cost pages with the delay
+    uint64_t requested;       // ns before compensation, ditto
+    uint64_t injected;        // ns spun, FANOUT_RUNNING while busy
+    uint64_t sent;            // ns, broadcast time, 0 if the slot is idle
+    uint64_t started;         // ns, start of the delay on the cpu
+    struct perf_event *counter;  // of this cpu, NULL for none
+    uint64_t count;           // its value when the last broadcast landed
+} ____cacheline_aligned fanout_slot_t;
+
+typedef struct {
+    struct cpumask pending;
+    uint64_t broadcasts;
+    uint64_t cpus;
+    uint64_t send_ns;         // sum over broadcasts
+    uint64_t send_max;
+    uint64_t dispatched;      // slots collected
+    uint64_t dispatch_ns;     // sum over collected slots
+    uint64_t dispatch_max;
+    uint64_t dropped;         // delays to offline cpus or the sampler's
+} fanout_t;
+
+static DEFINE_PER_CPU_ALIGNED(fanout_slot_t, fanout_slots);
+static fanout_t fanout;
+
+static void fanout_delay(void *unused) {
+    fanout_slot_t *slot = this_cpu_ptr(&fanout_slots);
+    uint64_t ns = 0, count;
+
+    WRITE_ONCE(slot->started, ktime_get_ns());
+    if (slot->counter && perf_event_read_local(slot->counter, &count,
+                                               NULL, NULL) == 0)
+        slot->count = count;
+    if (slot->delay) {
+        ns = spin_delay(slot->delay);
+        cost_charge(slot->accesses, slot->requested, ns);
+    }
+    smp_store_release(&slot->injected, ns);
+}
+
+/*
+  The delay the last broadcast spun on @cpu to @injected, 0 if it had none.
+  -EBUSY while it still spins, the slot can not be set then.
+*/
+int fanout_collect(int cpu, uint64_t *injected) {
+    fanout_slot_t *slot = per_cpu_ptr(&fanout_slots, cpu);
+    uint64_t ns, dispatch;
+
+    *injected = 0;
+    if (!slot->sent)
+        return 0;
+    ns = smp_load_acquire(&slot->injected);
+    if (ns == FANOUT_RUNNING)
+        return -EBUSY;
+    if (slot->delay) {
+        dispatch = READ_ONCE(slot->started) - slot->sent;
+        fanout.dispatched++;
+        fanout.dispatch_ns += dispatch;
+        fanout.dispatch_max = max(fanout.dispatch_max, dispatch);
+    }
+    slot->sent = 0;
+    *injected = ns;
+    return 0;
+}
+
+// counter of @cpu at its last collected broadcast, see fanout_set_counter()
+uint64_t fanout_count(int cpu) {
+    return per_cpu_ptr(&fanout_slots, cpu)->count;
+}
+
+// @counter of @cpu is read by every broadcast to it, NULL to stop
+void fanout_set_counter(int cpu, struct perf_event *counter) {
+    fanout_slot_t *slot = per_cpu_ptr(&fanout_slots, cpu);
+
+    slot->counter = counter;
+    slot->count = 0;
+}
+
+/*
+  Delay @cpu by @delay ns for @accesses, which were charged @requested ns
+  before compensation, at the next fanout_send(). Its slot must be idle.
+  With @delay 0 the broadcast only reads the slot's counter.
+*/
+int fanout_set(int cpu, uint64_t delay, uint64_t accesses,
+               uint64_t requested) {
+    fanout_slot_t *slot = per_cpu_ptr(&fanout_slots, cpu);
+
+    if (!delay && !slot->counter)
+        return 0;
+    if (!cpu_online(cpu) || cpu == raw_smp_processor_id()) {
+        if (delay)
+            fanout.dropped++;
+        return -ENODEV;
+    }
+    slot->delay = delay;
+    slot->accesses = accesses;
+    slot->requested = requested;
+    slot->injected = FANOUT_RUNNING;
+    cpumask_set_cpu(cpu, &fanout.pending);
+    return 0;
+}
+
+void fanout_send(void) {
+    uint64_t start, now, cost;
+    int cpu;
+
+    if (cpumask_empty(&fanout.pending))
+        return;
+    cpus_read_lock();
+    preempt_disable();
+    start = ktime_get_ns();
+    for_each_cpu(cpu, &fanout.pending) {
+        fanout_slot_t *slot = per_cpu_ptr(&fanout_slots, cpu);
+
+        // a slot nobody runs would stay busy forever
+        if (!cpu_online(cpu)) {
+            slot->sent = 0;
+            cpumask_clear_cpu(cpu, &fanout.pending);
+            if (slot->delay)
+                fanout.dropped++;
+            continue;
+        }
+        slot->sent = start;
+    }
+    smp_call_function_many(&fanout.pending, fanout_delay, NULL, false);
+    now = ktime_get_ns();
+    preempt_enable();
+    cpus_read_unlock();
+    if (cpumask_empty(&fanout.pending))
+        return;
+
+    cost = now - start;
+    fanout.broadcasts++;
+    fanout.cpus += cpumask_weight(&fanout.pending);
+    fanout.send_ns += cost;
+    fanout.send_max = max(fanout.send_max, cost);
+    cpumask_clear(&fanout.pending);
+}
+
+// the delays still spinning on @mask run module code
+void fanout_wait(const struct cpumask *mask) {
+    uint64_t injected;
+    int cpu;
+
+    for_each_cpu(cpu, mask)
+        while (fanout_collect(cpu, &injected) == -EBUSY)
+            cpu_relax();
+}
+
+static int stats_fanout_show(struct seq_file *m, void *v) {
+    seq_printf(m, "broadcasts      %llu\n", fanout.broadcasts);
+    seq_printf(m, "cpus            %llu\n", fanout.cpus);
+    seq_printf(m, "send_ns         avg %llu max %llu\n",
+               fanout.broadcasts ? div64_u64(fanout.send_ns, fanout.broadcasts)
+                                 : 0, fanout.send_max);
+    seq_printf(m, "dispatch_ns     avg %llu max %llu\n",
+               fanout.dispatched ? div64_u64(fanout.dispatch_ns,
+                                             fanout.dispatched) : 0,
+               fanout.dispatch_max);
+    seq_printf(m, "dropped         %llu\n", fanout.dropped);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_fanout);
+
+void init_fanout(void) {
+    memset(&fanout, 0, sizeof(fanout));
+    if (stats_dir)
+        debugfs_create_file("fanout", 0444, stats_dir, NULL,
+                            &stats_fanout_fops);
+}
+
+#endif
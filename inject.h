@@ -0,0 +1,227 @@
+#ifndef __INJECT__
+#define __INJECT__
+
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/smp.h>
+#include <linux/sort.h>
+
+#include "common.h"
+
+/*
+  Delay injection and its self calibration.
+  Include after large_header.h, stats.h and cost_page.h: calibration replays
+  the HA register sequence of one sampling tick and reports to debugfs, and
+  every delay is charged to the cost pages of the thread it interrupts.
+
+  Every tick costs time on its own (freeze, counter read, reset, unfreeze),
+  every IPI costs a round trip and the spin loop overshoots. All of them slow
+  down the victim on top of the delay the emulator asks for, so calibrate()
+  measures them once at load and compensate_delay() subtracts them from every
+  computed delay.
+
+  The results can be kept in a profile file:
+      nvmemu-calibration 1
+      tick <ns>
+      ipi <ns>
+      spin <ns>
+  If the file given by the profile parameter exists, it is loaded instead of
+  calibrating again; otherwise the fresh calibration is written to it.
+*/
+
+#define CALIBRATION_VERSION          (1)
+#define CALIBRATION_ROUNDS           (64)
+#define CALIBRATION_SPIN             (10 * NSEC_PER_USEC)
+#define CALIBRATION_PROFILE_SIZE     (128)
+// fewer accesses are carried to the next tick instead of sending an IPI
+#define MIN_DELAYED_ACCESSES         (1000)
+
+typedef struct {
+    uint64_t delay;           // ns requested by the emulator
+    uint64_t injected;        // ns really spent in delay()
+    uint64_t accesses;        // of the tick, for the cost pages
+    uint64_t requested;       // ns computed before compensation, ditto
+} delay_t;
+
+typedef struct {
+    uint64_t tick;            // ns of one sampling tick
+    uint64_t ipi;             // ns round trip of an empty IPI
+    uint64_t spin;            // ns the spin loop overshoots
+    int loaded;               // read from a profile instead of measured
+} calibration_t;
+
+static calibration_t calibration;
+
+// spins @ns on this cpu, returns the ns really spun
+uint64_t spin_delay(uint64_t ns) {
+    uint64_t start = ktime_get_ns();
+
+    mdelay(ns / NSEC_PER_MSEC);
+    ndelay(ns % NSEC_PER_MSEC);
+    return ktime_get_ns() - start;
+}
+
+void delay(void *d) {
+    delay_t *req = (delay_t *)d;
+
+    req->injected = spin_delay(req->delay);
+    cost_charge(req->accesses, req->requested, req->injected);
+}
+
+static void delay_nop(void *d) {
+}
+
+// delay() without the cost pages, calibration delays are nobody's cost
+static void delay_calibration(void *d) {
+    delay_t *req = (delay_t *)d;
+
+    req->injected = spin_delay(req->delay);
+}
+
+uint64_t calibration_overhead(void) {
+    return calibration.tick + calibration.ipi + calibration.spin;
+}
+
+// delay to inject so that the victim is slowed by @delay in total
+uint64_t compensate_delay(uint64_t delay) {
+    uint64_t overhead = calibration_overhead();
+    return delay > overhead ? delay - overhead : 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// median is robust against the odd interrupt hitting a round
+static uint64_t median(uint64_t *samples, int n) {
+    sort(samples, n, sizeof(uint64_t), cmp_u64, NULL);
+    return samples[n / 2];
+}
+
+/*
+  Must run on the emulator's cpu with @habox frozen and not yet enabled, the
+  counters of pair 0 are reset by the replayed ticks. Without @habox the
+  tick is not measured, sources other than the raw registers set it.
+*/
+int calibrate(HABox_t *habox, int target_cpu) {
+    uint64_t samples[CALIBRATION_ROUNDS];
+    uint64_t counter, start;
+    delay_t req = {0};
+    int i;
+
+    for (i = 0; i < CALIBRATION_ROUNDS && habox; i++) {
+        start = ktime_get_ns();
+        HA_box_freeze(habox);
+        HA_read_counter(habox, 0, &counter);
+        HA_reset_ctr(habox, 0);
+        HA_box_clear_overflow(habox);
+        HA_box_unfreeze(habox);
+        samples[i] = ktime_get_ns() - start;
+    }
+    if (habox) {
+        HA_box_freeze(habox);
+        calibration.tick = median(samples, CALIBRATION_ROUNDS);
+    }
+
+    for (i = 0; i < CALIBRATION_ROUNDS; i++) {
+        start = ktime_get_ns();
+        if (smp_call_function_single(target_cpu, delay_nop, NULL, 1) != 0) {
+            printk(KERN_ERR "calibration IPI to cpu %d failed\n", target_cpu);
+            return -1;
+        }
+        samples[i] = ktime_get_ns() - start;
+    }
+    calibration.ipi = median(samples, CALIBRATION_ROUNDS);
+
+    for (i = 0; i < CALIBRATION_ROUNDS; i++) {
+        req.delay = CALIBRATION_SPIN;
+        req.injected = 0;
+        if (smp_call_function_single(target_cpu, delay_calibration, &req,
+                                     1) != 0) {
+            printk(KERN_ERR "calibration IPI to cpu %d failed\n", target_cpu);
+            return -1;
+        }
+        samples[i] = req.injected > req.delay ? req.injected - req.delay : 0;
+    }
+    calibration.spin = median(samples, CALIBRATION_ROUNDS);
+    calibration.loaded = 0;
+
+    printk(KERN_INFO "calibrated: tick %llu ns, ipi %llu ns, spin %llu ns\n",
+           calibration.tick, calibration.ipi, calibration.spin);
+    return 0;
+}
+
+int load_calibration(const char *path) {
+    char buf[CALIBRATION_PROFILE_SIZE];
+    struct file *file;
+    loff_t pos = 0;
+    ssize_t len;
+    int version;
+    calibration_t loaded;
+
+    file = filp_open(path, O_RDONLY, 0);
+    if (IS_ERR(file))
+        return -1;
+    len = kernel_read(file, buf, sizeof(buf) - 1, &pos);
+    filp_close(file, NULL);
+    if (len <= 0)
+        return -1;
+    buf[len] = '\0';
+
+    if (sscanf(buf, "nvmemu-calibration %d tick %llu ipi %llu spin %llu",
+               &version, &loaded.tick, &loaded.ipi, &loaded.spin) != 4 ||
+        version != CALIBRATION_VERSION) {
+        printk(KERN_WARNING "calibration profile %s is invalid\n", path);
+        return -1;
+    }
+    loaded.loaded = 1;
+    calibration = loaded;
+    printk(KERN_INFO "calibration loaded from %s: tick %llu ns, ipi %llu ns, "
+           "spin %llu ns\n", path, calibration.tick, calibration.ipi,
+           calibration.spin);
+    return 0;
+}
+
+int save_calibration(const char *path) {
+    char buf[CALIBRATION_PROFILE_SIZE];
+    struct file *file;
+    loff_t pos = 0;
+    int len;
+
+    len = scnprintf(buf, sizeof(buf),
+                    "nvmemu-calibration %d\ntick %llu\nipi %llu\nspin %llu\n",
+                    CALIBRATION_VERSION, calibration.tick, calibration.ipi,
+                    calibration.spin);
+    file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (IS_ERR(file)) {
+        printk(KERN_WARNING "can not write calibration profile %s\n", path);
+        return -1;
+    }
+    if (kernel_write(file, buf, len, &pos) != len) {
+        printk(KERN_WARNING "writing calibration profile %s failed\n", path);
+        filp_close(file, NULL);
+        return -1;
+    }
+    filp_close(file, NULL);
+    return 0;
+}
+
+static int stats_calibration_show(struct seq_file *m, void *v) {
+    seq_printf(m, "source          %s\n",
+               calibration.loaded ? "profile" : "measured");
+    seq_printf(m, "tick_ns         %llu\n", calibration.tick);
+    seq_printf(m, "ipi_ns          %llu\n", calibration.ipi);
+    seq_printf(m, "spin_ns         %llu\n", calibration.spin);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_calibration);
+
+void init_calibration_stats(void) {
+    if (stats_dir)
+        debugfs_create_file("calibration", 0444, stats_dir, NULL,
+                            &stats_calibration_fops);
+}
+
+#endif
@@ -19,31 +19,9 @@
 // HA1
 #define HA1_FUNCTION                    (0x05)
 
-#define HA_PCI_PMON_BOX_CTL            (0xF4)
-#define HA_PCI_PMON_BOX_STATUS         (0xF8)
-#define HA_PCI_PMON_CTL3               (0xE4)
-#define HA_PCI_PMON_CTL2               (0xE0)
-#define HA_PCI_PMON_CTL1               (0xDC)
-#define HA_PCI_PMON_CTL0               (0xD8)
-#define HA_PCI_PMON_CTR3               (0xB8)
-#define HA_PCI_PMON_CTR2               (0xB0)
-#define HA_PCI_PMON_CTR1               (0xA8)
-#define HA_PCI_PMON_CTR0               (0xA0)
-#define HA_PCI_PMON_BOX_OPCODEMATCH    (0x48)
-#define HA_PCI_PMON_BOX_ADDRMATCH1     (0x48)
-#define HA_PCI_PMON_BOX_ADDRMATCH0     (0x40)
-    
-#define HA_PCI_PMON_BOX_CTL_frz        (1 << 8)
-#define HA_PCI_PMON_BOX_CTL_rst_ctrs   (1 << 1)
-#define HA_PCI_PMON_BOX_CTL_rst_ctrl   (1)
-#define HA_PCI_PMON_BOX_STATUS_ov      (0xf)
-#define HA_PCI_PMON_CTRL_thresh        (0xff << 24)
-#define HA_PCI_PMON_CTRL_invert        (1 << 23)
-#define HA_PCI_PMON_CTRL_en            (1 << 22)
-#define HA_PCI_PMON_CTRL_ov_en         (1 << 20)
-#define HA_PCI_PMON_CTRL_rst           (1 << 17)
-#define HA_PCI_PMON_CTRL_umask         (0xff << 8)
-#define HA_PCI_PMON_CTRL_ev_sel        (0xff)
+#define HA_PCI_PMON_CTR_MASK           ((1ULL << 48) - 1)   // 48 bit counters
+// the HA compares address bits 45:6, matching is per 64B line
+#define HA_ADDRMATCH_GRANULE                  (64)
 
 
 
@@ -55,30 +33,9 @@ typedef struct {
     char name[24];
 } event_t;
 
-const event_t HA_event_clock_ticks = {
-    .event_code = 0x00,
-    .umask = 0x00,
-    .name = "clock ticks",
-};
-
-const event_t HA_event_remote_reads = {
-    .event_code = 0x01,
-    .umask = 0x02,
-    .name = "remote reads",
-};
-
-const event_t HA_event_local_reads = {
-    .event_code = 0x01,
-    .umask = 0x01,
-    .name = "local reads",
-};
+// register offsets, fields and events of uncore.def
+#include "uncore_gen.h"
 
-const event_t HA_event_reads = {
-    .event_code = 0x01,
-    .umask = 0x01,
-    .name = "reads",
-};
-  
 typedef struct {
     pcicfg_box_t *box;
     event_t *event;
@@ -119,15 +76,15 @@ HABox_t *get_HAbox(int domain, uint32_t scktnr, int boxnr) {
                                SCKT0_HA_BUS,
                                HA_DEVICE,
                                HA0_FUNCTION,
-                               HA_PCI_PMON_BOX_CTL,
-                               HA_PCI_PMON_BOX_STATUS);
+                               HA_box_ctl,
+                               HA_box_status);
         } else if (boxnr == 1) {
             return __get_HAbox(domain,
                                SCKT0_HA_BUS,
                                HA_DEVICE,
                                HA1_FUNCTION,
-                               HA_PCI_PMON_BOX_CTL,
-                               HA_PCI_PMON_BOX_STATUS);
+                               HA_box_ctl,
+                               HA_box_status);
         } else {
             printk(KERN_ERR "Invalid box number %u\b", boxnr);
         }
@@ -137,15 +94,15 @@ HABox_t *get_HAbox(int domain, uint32_t scktnr, int boxnr) {
                                SCKT1_HA_BUS,
                                HA_DEVICE,
                                HA0_FUNCTION,
-                               HA_PCI_PMON_BOX_CTL,
-                               HA_PCI_PMON_BOX_STATUS);
+                               HA_box_ctl,
+                               HA_box_status);
         } else if (boxnr == 1) {
             return __get_HAbox(domain,
                                SCKT1_HA_BUS,
                                HA_DEVICE,
                                HA1_FUNCTION,
-                               HA_PCI_PMON_BOX_CTL,
-                               HA_PCI_PMON_BOX_STATUS);
+                               HA_box_ctl,
+                               HA_box_status);
         } else {
             printk(KERN_ERR "Invalid box number %u\b", boxnr);
             return NULL;
@@ -165,102 +122,63 @@ void free_HAbox(HABox_t *habox) {
     habox = NULL;
 }
 
-int HA_box_freeze(HABox_t *habox) {
-    uint32_t freeze_dword;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to freeze an empty habox???\n");
-        return -1;
-    }
+/*
+  Read-modify-write of a box register: the bits in @mask get those of @val.
+  All box and pair operations below are one call of this.
+*/
+static int HA_update(HABox_t *habox, uint32_t where, uint32_t mask,
+                     uint32_t val) {
+    uint32_t dword;
 
-    if (pcicfg_box_read_dword(habox->box,
-                              habox->box->control_addr,
-                              &freeze_dword) != YEAH)
+    if (pcicfg_box_read_dword(habox->box, where, &dword) != YEAH)
         return -1;
-    freeze_dword |= HA_PCI_PMON_BOX_CTL_frz;
-    if (pcicfg_box_write_dword(habox->box,
-                               habox->box->control_addr,
-                               freeze_dword) != YEAH)
+    dword = (dword & ~mask) | (val & mask);
+    if (pcicfg_box_write_dword(habox->box, where, dword) != YEAH)
         return -1;
     return 0;
 }
 
-int HA_box_unfreeze(HABox_t *habox) {
-    uint32_t unfreeze_dword;
+static int HA_box_check(HABox_t *habox, const char *what) {
     if (!habox) {
-        printk(KERN_ERR "Why you try to unfreeze an empty habox???\n");
+        printk(KERN_ERR "Why you try to %s an empty habox???\n", what);
         return -1;
     }
-
-    if (pcicfg_box_read_dword(habox->box,
-                              habox->box->control_addr,
-                              &unfreeze_dword) != YEAH)
-        return -1;
-    unfreeze_dword &= (~HA_PCI_PMON_BOX_CTL_frz);
-    if (pcicfg_box_write_dword(habox->box,
-                               habox->box->control_addr,
-                               unfreeze_dword) != YEAH)
-        return -1;
     return 0;
 }
 
-int HA_box_reset_ctls(HABox_t *habox) {
-    uint32_t reset_dword;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to reset an empty habox???\n");
+int HA_box_freeze(HABox_t *habox) {
+    if (HA_box_check(habox, "freeze") != 0)
         return -1;
-    }
+    return HA_update(habox, habox->box->control_addr,
+                     HA_box_ctl_frz_mask, HA_box_ctl_frz_mask);
+}
 
-    if (pcicfg_box_read_dword(habox->box,
-                              habox->box->control_addr,
-                              &reset_dword) != YEAH)
+int HA_box_unfreeze(HABox_t *habox) {
+    if (HA_box_check(habox, "unfreeze") != 0)
         return -1;
-    reset_dword |= HA_PCI_PMON_BOX_CTL_rst_ctrl;
-    if (pcicfg_box_write_dword(habox->box,
-                               habox->box->control_addr,
-                               reset_dword) != YEAH)
+    return HA_update(habox, habox->box->control_addr, HA_box_ctl_frz_mask, 0);
+}
+
+int HA_box_reset_ctls(HABox_t *habox) {
+    if (HA_box_check(habox, "reset") != 0)
         return -1;
- 
-    return 0;
+    return HA_update(habox, habox->box->control_addr,
+                     HA_box_ctl_rst_ctrl_mask, HA_box_ctl_rst_ctrl_mask);
 }
 
 int HA_box_reset_ctrs(HABox_t *habox) {
-    uint32_t reset_dword;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to reset an empty habox???\n");
-        return -1;
-    }
- 
-    if (pcicfg_box_read_dword(habox->box,
-                              habox->box->control_addr,
-                              &reset_dword) != YEAH)
-        return -1;
-    reset_dword |= HA_PCI_PMON_BOX_CTL_rst_ctrs;
-    if (pcicfg_box_write_dword(habox->box,
-                               habox->box->control_addr,
-                               reset_dword) != YEAH)
+    if (HA_box_check(habox, "reset") != 0)
         return -1;
- 
-    return 0;
+    return HA_update(habox, habox->box->control_addr,
+                     HA_box_ctl_rst_ctrs_mask, HA_box_ctl_rst_ctrs_mask);
 }
 
 int HA_box_clear_overflow(HABox_t *habox) {
-    uint32_t overflow;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to clear overflow of an empty habox???\n");
-        return -1;
-    }
-
-    if (pcicfg_box_read_dword(habox->box,
-                              habox->box->status_addr,
-                              &overflow) != YEAH)
+    if (HA_box_check(habox, "clear overflow of") != 0)
         return -1;
-    overflow |= HA_PCI_PMON_BOX_STATUS_ov;
-    if (pcicfg_box_write_dword(habox->box,
-                               habox->box->status_addr,
-                               overflow) != YEAH)
-        return -1;
- 
-    return 0;
+    // RW1C
+    return HA_update(habox, habox->box->status_addr,
+                     HA_box_status_ov_mask, HA_box_status_ov_mask);
 }
 
 typedef struct {
@@ -270,196 +188,158 @@ typedef struct {
 
 const pair_t HA_pairs[4] = {
     {
-        .counter = HA_PCI_PMON_CTR0,
-        .controller = HA_PCI_PMON_CTL0,
+        .counter = UNCORE_AT(HA, ctr, 0),
+        .controller = UNCORE_AT(HA, ctl, 0),
     },
 
     {
-        .counter = HA_PCI_PMON_CTR1,
-        .controller = HA_PCI_PMON_CTL1,
+        .counter = UNCORE_AT(HA, ctr, 1),
+        .controller = UNCORE_AT(HA, ctl, 1),
     },
     
     {
-        .counter = HA_PCI_PMON_CTR2,
-        .controller = HA_PCI_PMON_CTL2,
+        .counter = UNCORE_AT(HA, ctr, 2),
+        .controller = UNCORE_AT(HA, ctl, 2),
     },
 
     {
-        .counter = HA_PCI_PMON_CTR3,
-        .controller = HA_PCI_PMON_CTL3,
+        .counter = UNCORE_AT(HA, ctr, 3),
+        .controller = UNCORE_AT(HA, ctl, 3),
     },
 };
 
-int HA_reset_ctr(HABox_t *habox, int pairnr) {
-    uint32_t cl;
+static int HA_pair_check(HABox_t *habox, int pairnr, const char *what) {
     if (!habox) {
-        printk(KERN_ERR "Why you try to reset an empty box?\n");
+        printk(KERN_ERR "Why you try to %s an empty box?\n", what);
         return -1;
     }
 
     if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Why you try to reset a non-exist pari?\n");
+        printk(KERN_ERR "Why you try to %s a non-exist pair?\n", what);
         return -1;
     }
-
-
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
-        return -1;
-    cl |= HA_PCI_PMON_CTRL_rst;
-    if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
-        return -1;
     return 0;
 }
 
-int HA_enable(HABox_t *habox, int pairnr) {
-    uint32_t cl;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to enable an empty box?\n");
-        return -1;
-    }
-
-    if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Why you try to enable a non-exist pari?\n");
+// the fields of @mask in the control of @pairnr get those of @val
+static int HA_update_ctl(HABox_t *habox, int pairnr, uint32_t mask,
+                         uint32_t val, const char *what) {
+    if (HA_pair_check(habox, pairnr, what) != 0)
         return -1;
-    }
+    return HA_update(habox, HA_pairs[pairnr].controller, mask, val);
+}
 
+int HA_reset_ctr(HABox_t *habox, int pairnr) {
+    return HA_update_ctl(habox, pairnr, HA_ctl_rst_mask, HA_ctl_rst_mask,
+                         "reset");
+}
 
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
-        return -1;
-    cl |= HA_PCI_PMON_CTRL_en;
-    if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
-        return -1;
-    return 0;
+int HA_enable(HABox_t *habox, int pairnr) {
+    return HA_update_ctl(habox, pairnr, HA_ctl_en_mask, HA_ctl_en_mask,
+                         "enable");
 }
 
 int HA_disable(HABox_t *habox, int pairnr) {
-    uint32_t cl;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to disable an empty box?\n");
-        return -1;
-    }
+    return HA_update_ctl(habox, pairnr, HA_ctl_en_mask, 0, "disable");
+}
 
-    if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Why you try to disable a non-exist pari?\n");
-        return -1;
-    }
+int HA_enable_overflow(HABox_t *habox, int pairnr) {
+    return HA_update_ctl(habox, pairnr, HA_ctl_ov_en_mask, HA_ctl_ov_en_mask,
+                         "enable overflow of");
+}
 
+int HA_disable_overflow(HABox_t *habox, int pairnr) {
+    return HA_update_ctl(habox, pairnr, HA_ctl_ov_en_mask, 0,
+                         "disable overflow of");
+}
 
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
-        return -1;
-    cl &= (~HA_PCI_PMON_CTRL_en);
-    if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
+int HA_choose_event(HABox_t *habox, int pairnr, const event_t *event) {
+    if (HA_pair_check(habox, pairnr, "program") != 0)
         return -1;
-    return 0;
+
+    printk(KERN_INFO "%x : %x on %s\n", event->event_code, event->umask, event->name);
+    habox->event = event;
+    return HA_update(habox, HA_pairs[pairnr].controller,
+                     HA_ctl_ev_sel_mask | HA_ctl_umask_mask,
+                     HA_ctl_ev_sel_set(HA_ctl_umask_set(0, event->umask),
+                                       event->event_code));
 }
 
-int HA_enable_overflow(HABox_t *habox, int pairnr) {
-    uint32_t cl;
+int HA_read_counter(HABox_t *habox, int pairnr, uint64_t *val) {
     if (!habox) {
-        printk(KERN_ERR "Why you try to enable overflow an empty box?\n");
+        printk(KERN_ERR "HA box empty?\n");
         return -1;
     }
 
     if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Why you try to enable overfow a non-exist pari?\n");
+        printk(KERN_ERR "Pair number invalid?\n");
         return -1;
     }
-
-
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
-        return -1;
-    cl |= HA_PCI_PMON_CTRL_ov_en;
-    if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
-        return -1;
-    return 0;
+    
+    return (pcicfg_box_read_qword(habox->box,
+                                  HA_pairs[pairnr].counter,
+                                  val) != YEAH);
 }
 
-int HA_disable_overflow(HABox_t *habox, int pairnr) {
-    uint32_t cl;
+// preload a counter, e.g. with 2^48 - n to overflow after n events
+int HA_write_counter(HABox_t *habox, int pairnr, uint64_t val) {
     if (!habox) {
-        printk(KERN_ERR "Why you try to enable overflow an empty box?\n");
+        printk(KERN_ERR "HA box empty?\n");
         return -1;
     }
 
     if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Why you try to enable overfow a non-exist pari?\n");
+        printk(KERN_ERR "Pair number invalid?\n");
         return -1;
     }
 
-
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
-        return -1;
-    cl &= (~HA_PCI_PMON_CTRL_ov_en);
-    if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
-        return -1;
-    return 0;
+    return (pcicfg_box_write_qword(habox->box,
+                                   HA_pairs[pairnr].counter,
+                                   val & HA_PCI_PMON_CTR_MASK) != YEAH);
 }
 
-int HA_choose_event(HABox_t *habox, int pairnr, const event_t *event) {
-    uint32_t cl;
+/*
+  Filters of the ADDR_OPC_MATCH events. The match registers are box-wide,
+  so all pairs counting ADDR_OPC_MATCH share the same filter.
+  @paddr is a physical address, only its 64B line is compared.
+*/
+int HA_set_addr_match(HABox_t *habox, uint64_t paddr) {
+    uint32_t lo = HA_addrmatch0_lo_addr_set(0, (uint32_t)paddr >> 6);
+    uint32_t hi = HA_addrmatch1_hi_addr_set(0, (uint32_t)(paddr >> 32));
     if (!habox) {
-        printk(KERN_ERR "HA box empty?\n");
+        printk(KERN_ERR "Why you try to filter an empty habox???\n");
         return -1;
     }
 
-    if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Pair number invalid?\n");
+    if (paddr >> 46) {
+        printk(KERN_ERR "address %llx is beyond 46 bits\n", paddr);
         return -1;
     }
 
-    habox->event->event_code = event->event_code;
-    habox->event->umask = event->umask;
-    strncpy(habox->event->name, event->name, 23);
-    habox->event->name[23] = '\0';
-
-
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
+    if (pcicfg_box_write_dword(habox->box,
+                               HA_addrmatch0,
+                               lo) != YEAH)
         return -1;
-    cl &= 0xffff0000;
-    cl |= ((uint32_t)event->event_code << 8) | event->umask;
     if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
+                               HA_addrmatch1,
+                               hi) != YEAH)
         return -1;
     return 0;
 }
 
-int HA_read_counter(HABox_t *habox, int pairnr, uint64_t *val) {
+int HA_set_opcode_match(HABox_t *habox, uint8_t opcode) {
     if (!habox) {
-        printk(KERN_ERR "HA box empty?\n");
+        printk(KERN_ERR "Why you try to filter an empty habox???\n");
         return -1;
     }
 
-    if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Pair number invalid?\n");
+    return HA_update(habox, HA_opcodematch, HA_opcodematch_opc_mask,
+                     HA_opcodematch_opc_set(0, opcode));
+}
+
+int HA_clear_match(HABox_t *habox) {
+    if (HA_set_addr_match(habox, 0) != 0)
         return -1;
-    }
-    
-    return (pcicfg_box_read_qword(habox->box,
-                                  HA_pairs[pairnr].counter,
-                                  val) != YEAH);
+    return HA_set_opcode_match(habox, 0);
 }
 #endif
-
@@ -1,5 +1,6 @@
 #include "common.h"
 #include <linux/pci.h>
+#include <linux/ktime.h>
 
 #define YEAH              (0x0)
 #define INVALID_DOMAIN    (0x1)
@@ -20,8 +21,13 @@ typedef struct {
     uint8_t  device;   // 0 to 31
     uint8_t  function; // 0 to 7
     int inited;        // set to INITED if init_pcicfg is called on this struct
+    struct pcicfg_sim *sim;  // simulated register file instead, see platform.h
 } pcicfg_t;
 
+// defined by platform.h
+int pcicfg_sim_read_dword(struct pcicfg_sim *sim, int where, uint32_t *val);
+int pcicfg_sim_write_dword(struct pcicfg_sim *sim, int where, uint32_t val);
+
 pcicfg_t *get_pcicfg(int domain, int busnr, int device, int fn);
 int pcicfg_read_byte(pcicfg_t *pcicfg, int where, uint8_t *val);
 int pcicfg_read_word(pcicfg_t *pcicfg, int where, uint16_t *val);
@@ -75,6 +81,7 @@ pcicfg_t *get_pcicfg(int domain, int busnr, int device, int fn) {
     }
     
     pcicfg->inited = 0;
+    pcicfg->sim = NULL;
     
     if (domain < 0 || domain > 0xffff) {
         printk(KERN_ERR "domain is not valid\n");
@@ -115,6 +122,46 @@ pcicfg_t *get_pcicfg(int domain, int busnr, int device, int fn) {
     return pcicfg;
 }
 
+// a pcicfg on a simulated register file, used to check the register maps
+pcicfg_t *get_pcicfg_sim(struct pcicfg_sim *sim) {
+    pcicfg_t *pcicfg = (pcicfg_t*)kzalloc(sizeof(pcicfg_t), GFP_KERNEL);
+    if (!pcicfg) {
+        printk(KERN_ERR "No memory for a pcicfg!!!\n");
+        return NULL;
+    }
+    pcicfg->sim = sim;
+    pcicfg->inited = INITED;
+    return pcicfg;
+}
+
+/*
+  HA registers are only accessed by dwords, so dword accesses are timed for
+  the config space latency statistics.
+*/
+static int __pcicfg_bus_read_dword(pcicfg_t *pcicfg, unsigned int devfn,
+                                   int where, uint32_t *val) {
+    uint64_t start;
+    int ret;
+    if (pcicfg->sim)
+        return pcicfg_sim_read_dword(pcicfg->sim, where, val);
+    start = ktime_get_ns();
+    ret = pci_bus_read_config_dword(pcicfg->bus, devfn, where, val);
+    account_cfg_access(ktime_get_ns() - start);
+    return ret;
+}
+
+static int __pcicfg_bus_write_dword(pcicfg_t *pcicfg, unsigned int devfn,
+                                    int where, uint32_t val) {
+    uint64_t start;
+    int ret;
+    if (pcicfg->sim)
+        return pcicfg_sim_write_dword(pcicfg->sim, where, val);
+    start = ktime_get_ns();
+    ret = pci_bus_write_config_dword(pcicfg->bus, devfn, where, val);
+    account_cfg_access(ktime_get_ns() - start);
+    return ret;
+}
+
 static int inited(pcicfg_t *pcicfg) {
     if (!pcicfg || pcicfg->inited != INITED) {
         printk(KERN_WARNING "This pcicfg is not initialized by init_pcicfg!\n");
@@ -153,7 +200,7 @@ int pcicfg_read_dword(pcicfg_t *pcicfg, int where, uint32_t *val) {
         return -PCI_READ_FAILED;
     }
     devfn = (pcicfg->device << 3) | (pcicfg->function);
-    return pci_bus_read_config_dword(pcicfg->bus, devfn, where, val);
+    return __pcicfg_bus_read_dword(pcicfg, devfn, where, val);
 }
 
 /*
@@ -169,7 +216,7 @@ int pcicfg_read_qword(pcicfg_t *pcicfg, int where, uint64_t *val) {
     *val = 0;
     devfn = (pcicfg->device << 3) | (pcicfg->function);
     temp = 0;
-    if (pci_bus_read_config_dword(pcicfg->bus,
+    if (__pcicfg_bus_read_dword(pcicfg,
                               devfn,
                               where + 4,
                               &temp) != PCIBIOS_SUCCESSFUL) {
@@ -178,7 +225,7 @@ int pcicfg_read_qword(pcicfg_t *pcicfg, int where, uint64_t *val) {
     }
     *val |= temp;
     *val = (*val) << 32;
-    if (pci_bus_read_config_dword(pcicfg->bus,
+    if (__pcicfg_bus_read_dword(pcicfg,
                               devfn,
                               where,
                               &temp) != PCIBIOS_SUCCESSFUL) {
@@ -214,7 +261,7 @@ int pcicfg_write_dword(pcicfg_t *pcicfg, int where, uint32_t val) {
         return -PCI_WRITE_FAILED;
     }
     devfn = (pcicfg->device << 3) | (pcicfg->function);
-    return pci_bus_write_config_dword(pcicfg->bus, devfn, where, val);
+    return __pcicfg_bus_write_dword(pcicfg, devfn, where, val);
 }
 
 int pcicfg_write_qword(pcicfg_t *pcicfg, int where, uint64_t val) {
@@ -225,7 +272,7 @@ int pcicfg_write_qword(pcicfg_t *pcicfg, int where, uint64_t val) {
     }
     devfn = (pcicfg->device << 3) | (pcicfg->function);
     temp = (uint32_t)val;
-    if (pci_bus_write_config_dword(pcicfg->bus,
+    if (__pcicfg_bus_write_dword(pcicfg,
                                devfn,
                                where,
                                temp) != PCIBIOS_SUCCESSFUL) {
@@ -233,7 +280,7 @@ int pcicfg_write_qword(pcicfg_t *pcicfg, int where, uint64_t val) {
         return -PCI_WRITE_FAILED;
     }
     temp = val >> 32;
-    if (pci_bus_write_config_dword(pcicfg->bus,
+    if (__pcicfg_bus_write_dword(pcicfg,
                                devfn,
                                where + 4,
                                temp) != PCIBIOS_SUCCESSFUL) {
@@ -251,45 +298,65 @@ void pcicfg_free(pcicfg_t *pcicfg) {
     pcicfg = NULL;
 }
 
-pcicfg_box_t *get_pcicfg_box(int domain,
-                              int busnr,
-                              int device,
-                              int fn,
-                              uint32_t ctrl_addr,
-                              uint32_t status_addr) {
-    pcicfg_t *pcicfg = NULL;
+static pcicfg_box_t *__get_pcicfg_box(pcicfg_t *pcicfg,
+                                      uint32_t ctrl_addr,
+                                      uint32_t status_addr) {
     pcicfg_box_t *pcicfg_box =
         (pcicfg_box_t *)kmalloc(sizeof(pcicfg_box_t), GFP_KERNEL);
     if (!pcicfg_box) {
         printk(KERN_ERR "No memory for a box!!!!\n");
+        pcicfg_free(pcicfg);
         return NULL;
     }
-    
+
     pcicfg_box->inited = 0;
-    
-    if (!(pcicfg = get_pcicfg(domain, busnr, device, fn))) {
-        printk(KERN_ERR "can n1ot initialize this pcicfg box\n");
+    pcicfg_box->pcicfg_space = pcicfg;
+    pcicfg_box->control_addr = ctrl_addr;
+    pcicfg_box->status_addr = status_addr;
+    if (pcicfg_read_dword(pcicfg, ctrl_addr, &pcicfg_box->control) != YEAH) {
+        printk(KERN_WARNING "read control register failed\n");
+        pcicfg_free(pcicfg);
+        kfree(pcicfg_box);
+        return NULL;
+    }
+    // boxes without a status register have status_addr 0
+    pcicfg_box->status = 0;
+    if (status_addr &&
+        pcicfg_read_dword(pcicfg, status_addr, &pcicfg_box->status) != YEAH) {
+        printk(KERN_WARNING "read status register failed\n");
+        pcicfg_free(pcicfg);
         kfree(pcicfg_box);
         return NULL;
-    } else {
-        pcicfg_box->pcicfg_space = pcicfg;
-        pcicfg_box->control_addr = ctrl_addr;
-        pcicfg_box->status_addr = status_addr;
-        if (pcicfg_read_dword(pcicfg, ctrl_addr, &pcicfg_box->control) != YEAH) {
-            printk(KERN_WARNING "read control register failed\n");
-            kfree(pcicfg_box);
-            return NULL;
-        }
-        if (pcicfg_read_dword(pcicfg, status_addr, &pcicfg_box->status) != YEAH) {
-            printk(KERN_WARNING "read status register failed\n");
-            kfree(pcicfg_box);
-            return NULL;
-        }
-        pcicfg_box->inited = INITED;
     }
+    pcicfg_box->inited = INITED;
     return pcicfg_box;
 }
 
+pcicfg_box_t *get_pcicfg_box(int domain,
+                              int busnr,
+                              int device,
+                              int fn,
+                              uint32_t ctrl_addr,
+                              uint32_t status_addr) {
+    pcicfg_t *pcicfg = NULL;
+
+    if (!(pcicfg = get_pcicfg(domain, busnr, device, fn))) {
+        printk(KERN_ERR "can n1ot initialize this pcicfg box\n");
+        return NULL;
+    }
+    return __get_pcicfg_box(pcicfg, ctrl_addr, status_addr);
+}
+
+pcicfg_box_t *get_pcicfg_box_sim(struct pcicfg_sim *sim,
+                                 uint32_t ctrl_addr,
+                                 uint32_t status_addr) {
+    pcicfg_t *pcicfg = get_pcicfg_sim(sim);
+
+    if (!pcicfg)
+        return NULL;
+    return __get_pcicfg_box(pcicfg, ctrl_addr, status_addr);
+}
+
 
 static int box_check(pcicfg_box_t *box) {
     if (!box || box->inited != INITED) {
@@ -369,10 +436,7 @@ void pcicfg_box_free(pcicfg_box_t *box) {
 #define XEON_DOMAIN                           (0x0000)
 
 
-#define SCKT0_HA_BUS                         (0x7F)
-#define SCKT1_HA_BUS                         (0xFF)
-
-
+// the bus of a socket's uncore differs between systems, see get_HAbox
 #define HA_DEVICE                      (0x12)
 
 // HA0
@@ -380,31 +444,9 @@ void pcicfg_box_free(pcicfg_box_t *box) {
 // HA1
 #define HA1_FUNCTION                    (0x05)
 
-#define HA_PCI_PMON_BOX_CTL            (0xF4)
-#define HA_PCI_PMON_BOX_STATUS         (0xF8)
-#define HA_PCI_PMON_CTL3               (0xE4)
-#define HA_PCI_PMON_CTL2               (0xE0)
-#define HA_PCI_PMON_CTL1               (0xDC)
-#define HA_PCI_PMON_CTL0               (0xD8)
-#define HA_PCI_PMON_CTR3               (0xB8)
-#define HA_PCI_PMON_CTR2               (0xB0)
-#define HA_PCI_PMON_CTR1               (0xA8)
-#define HA_PCI_PMON_CTR0               (0xA0)
-#define HA_PCI_PMON_BOX_OPCODEMATCH    (0x48)
-#define HA_PCI_PMON_BOX_ADDRMATCH1     (0x48)
-#define HA_PCI_PMON_BOX_ADDRMATCH0     (0x40)
-    
-#define HA_PCI_PMON_BOX_CTL_frz        (1 << 8)
-#define HA_PCI_PMON_BOX_CTL_rst_ctrs   (1 << 1)
-#define HA_PCI_PMON_BOX_CTL_rst_ctrl   (1)
-#define HA_PCI_PMON_BOX_STATUS_ov      (0xf)
-#define HA_PCI_PMON_CTRL_thresh        (0xff << 24)
-#define HA_PCI_PMON_CTRL_invert        (1 << 23)
-#define HA_PCI_PMON_CTRL_en            (1 << 22)
-#define HA_PCI_PMON_CTRL_ov_en         (1 << 20)
-#define HA_PCI_PMON_CTRL_rst           (1 << 17)
-#define HA_PCI_PMON_CTRL_umask         (0xff << 8)
-#define HA_PCI_PMON_CTRL_ev_sel        (0xff)
+#define HA_PCI_PMON_CTR_MASK           ((1ULL << 48) - 1)   // 48 bit counters
+// the HA compares address bits 45:6, matching is per 64B line
+#define HA_ADDRMATCH_GRANULE                  (64)
 
 
 
@@ -416,57 +458,43 @@ typedef struct {
     char name[24];
 } event_t;
 
-const event_t HA_event_clock_ticks = {
-    .event_code = 0x00,
-    .umask = 0x00,
-    .name = "clock ticks",
-};
-
-// Reads
-const event_t HA_event_remote_reads = {
-    .event_code = 0x01,
-    .umask = 0x02,
-    .name = "remote reads",
-};
+// register offsets, fields and events of uncore.def
+#include "uncore_gen.h"
 
-const event_t HA_event_local_reads = {
-    .event_code = 0x01,
-    .umask = 0x01,
-    .name = "local reads",
-};
-
-const event_t HA_event_reads = {
-    .event_code = 0x01,
-    .umask = 0x03,
-    .name = "reads",
-};
-
-// Writes
-const event_t HA_event_remote_writes = {
-    .event_code = 0x01,
-    .umask = 0x20,
-    .name = "remote writes",
-};
-
-const event_t HA_event_local_writes = {
-    .event_code = 0x01,
-    .umask = 0x10,
-    .name = "local writes",
-};
-
-const event_t HA_event_writes = {
-    .event_code = 0x01,
-    .umask = 0x30,
-    .name = "writes",
-};
+/*
+  Everything the box layer needs that differs between uncore generations:
+  where the boxes are, their PMON offsets and the events feeding the delay.
+  The maps are in platform.h, uncore_map is the one of this machine.
+*/
+typedef struct {
+    uint16_t pci_id;          // PCI device id, the same on every socket
+    uint8_t device;
+    uint8_t function;
+} box_location_t;
 
-const event_t HA_event_remote_access = {
-    .event_code = 0x01,
-    .umask = 0x22,
-    .name = "remote aceess",
-};
+typedef struct {
+    const char *name;
+    uncore_box_t box;         // box type in uncore.def
+    uint8_t models[2];        // CPUID family 6 models, 0 if unused
+    box_location_t boxes[2];
+    const char *perf_pmu;     // sysfs name of the perf PMU of box %d
+    uint32_t box_ctl;
+    uint32_t box_status;      // 0 if the box has none
+    uint32_t ctl[4];
+    uint32_t ctr[4];
+    uint32_t addrmatch0;      // 0 if the box can not filter
+    uint32_t addrmatch1;
+    uint32_t opcodematch;
+    uint64_t ov_bits[2];      // U_MSR_PMON_GLOBAL_STATUS bits, 0 if none
+    bool ha_events;           // the HA_event_* encodings are valid
+    const event_t *clock_ticks;
+    const event_t *remote_reads;
+    const event_t *remote_writes;
+    const event_t *remote_access;
+} uncore_map_t;
+
+static const uncore_map_t *uncore_map;
 
-  
 typedef struct {
     pcicfg_box_t *box;
     event_t *event;
@@ -495,54 +523,68 @@ static HABox_t *__get_HAbox(int domain, uint32_t busnr, uint8_t device,
     return habox;
 }
 
+/*
+  The @n-th box at the map's device and function, counted in bus order,
+  which is socket order. The caller puts the device.
+*/
+static struct pci_dev *find_uncore_box(const box_location_t *loc, int n) {
+    struct pci_dev *pdev = NULL;
+
+    while ((pdev = pci_get_device(PCI_VENDOR_ID_INTEL, loc->pci_id, pdev))) {
+        if (PCI_SLOT(pdev->devfn) != loc->device ||
+            PCI_FUNC(pdev->devfn) != loc->function)
+            continue;
+        if (n-- == 0)
+            return pdev;
+    }
+    return NULL;
+}
+
 HABox_t *get_HAbox(int domain, uint32_t scktnr, int boxnr) {
+    struct pci_dev *pdev;
+    HABox_t *habox;
+
     if (domain != XEON_DOMAIN) {
         printk(KERN_ERR "domain not supported\n");
         return NULL;        
     }
 
-    if (scktnr == 0) {
-        if (boxnr == 0) {
-            return __get_HAbox(domain,
-                               SCKT0_HA_BUS,
-                               HA_DEVICE,
-                               HA0_FUNCTION,
-                               HA_PCI_PMON_BOX_CTL,
-                               HA_PCI_PMON_BOX_STATUS);
-        } else if (boxnr == 1) {
-            return __get_HAbox(domain,
-                               SCKT0_HA_BUS,
-                               HA_DEVICE,
-                               HA1_FUNCTION,
-                               HA_PCI_PMON_BOX_CTL,
-                               HA_PCI_PMON_BOX_STATUS);
-        } else {
-            printk(KERN_ERR "Invalid box number %u\b", boxnr);
-        }
-    } else if (scktnr == 1) {
-        if (boxnr == 0) {
-            return __get_HAbox(domain,
-                               SCKT1_HA_BUS,
-                               HA_DEVICE,
-                               HA0_FUNCTION,
-                               HA_PCI_PMON_BOX_CTL,
-                               HA_PCI_PMON_BOX_STATUS);
-        } else if (boxnr == 1) {
-            return __get_HAbox(domain,
-                               SCKT1_HA_BUS,
-                               HA_DEVICE,
-                               HA1_FUNCTION,
-                               HA_PCI_PMON_BOX_CTL,
-                               HA_PCI_PMON_BOX_STATUS);
-        } else {
-            printk(KERN_ERR "Invalid box number %u\b", boxnr);
-            return NULL;
-        }
-    } else {
-        printk(KERN_ERR "invalid socket number %d\n", scktnr);
+    if (!uncore_map) {
+        printk(KERN_ERR "no uncore register map for this cpu\n");
         return NULL;
     }
-    return NULL;
+
+    if (boxnr < 0 || boxnr > 1) {
+        printk(KERN_ERR "Invalid box number %d\n", boxnr);
+        return NULL;
+    }
+
+    pdev = find_uncore_box(&uncore_map->boxes[boxnr], scktnr);
+    if (!pdev) {
+        printk(KERN_ERR "no %s box %d on socket %u\n", uncore_map->name,
+               boxnr, scktnr);
+        return NULL;
+    }
+    habox = __get_HAbox(pci_domain_nr(pdev->bus), pdev->bus->number,
+                        PCI_SLOT(pdev->devfn), PCI_FUNC(pdev->devfn),
+                        uncore_map->box_ctl, uncore_map->box_status);
+    pci_dev_put(pdev);
+    return habox;
+}
+
+// a box of @map on a simulated register file
+HABox_t *get_HAbox_sim(struct pcicfg_sim *sim, const uncore_map_t *map) {
+    HABox_t *habox = (HABox_t *)kmalloc(sizeof(HABox_t), GFP_KERNEL);
+
+    if (!habox)
+        return NULL;
+    habox->box = get_pcicfg_box_sim(sim, map->box_ctl, map->box_status);
+    if (!habox->box) {
+        kfree(habox);
+        return NULL;
+    }
+    habox->event = &HA_event_clock_ticks;
+    return habox;
 }
 
 void free_HAbox(HABox_t *habox) {
@@ -553,102 +595,65 @@ void free_HAbox(HABox_t *habox) {
     habox = NULL;
 }
 
-int HA_box_freeze(HABox_t *habox) {
-    uint32_t freeze_dword;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to freeze an empty habox???\n");
-        return -1;
-    }
+/*
+  Read-modify-write of a box register: the bits in @mask get those of @val.
+  All box and pair operations below are one call of this.
+*/
+static int HA_update(HABox_t *habox, uint32_t where, uint32_t mask,
+                     uint32_t val) {
+    uint32_t dword;
 
-    if (pcicfg_box_read_dword(habox->box,
-                              habox->box->control_addr,
-                              &freeze_dword) != YEAH)
+    if (pcicfg_box_read_dword(habox->box, where, &dword) != YEAH)
         return -1;
-    freeze_dword |= HA_PCI_PMON_BOX_CTL_frz;
-    if (pcicfg_box_write_dword(habox->box,
-                               habox->box->control_addr,
-                               freeze_dword) != YEAH)
+    dword = (dword & ~mask) | (val & mask);
+    if (pcicfg_box_write_dword(habox->box, where, dword) != YEAH)
         return -1;
     return 0;
 }
 
-int HA_box_unfreeze(HABox_t *habox) {
-    uint32_t unfreeze_dword;
+static int HA_box_check(HABox_t *habox, const char *what) {
     if (!habox) {
-        printk(KERN_ERR "Why you try to unfreeze an empty habox???\n");
+        printk(KERN_ERR "Why you try to %s an empty habox???\n", what);
         return -1;
     }
-
-    if (pcicfg_box_read_dword(habox->box,
-                              habox->box->control_addr,
-                              &unfreeze_dword) != YEAH)
-        return -1;
-    unfreeze_dword &= (~HA_PCI_PMON_BOX_CTL_frz);
-    if (pcicfg_box_write_dword(habox->box,
-                               habox->box->control_addr,
-                               unfreeze_dword) != YEAH)
-        return -1;
     return 0;
 }
 
-int HA_box_reset_ctls(HABox_t *habox) {
-    uint32_t reset_dword;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to reset an empty habox???\n");
+int HA_box_freeze(HABox_t *habox) {
+    if (HA_box_check(habox, "freeze") != 0)
         return -1;
-    }
+    return HA_update(habox, habox->box->control_addr,
+                     HA_box_ctl_frz_mask, HA_box_ctl_frz_mask);
+}
 
-    if (pcicfg_box_read_dword(habox->box,
-                              habox->box->control_addr,
-                              &reset_dword) != YEAH)
+int HA_box_unfreeze(HABox_t *habox) {
+    if (HA_box_check(habox, "unfreeze") != 0)
         return -1;
-    reset_dword |= HA_PCI_PMON_BOX_CTL_rst_ctrl;
-    if (pcicfg_box_write_dword(habox->box,
-                               habox->box->control_addr,
-                               reset_dword) != YEAH)
+    return HA_update(habox, habox->box->control_addr, HA_box_ctl_frz_mask, 0);
+}
+
+int HA_box_reset_ctls(HABox_t *habox) {
+    if (HA_box_check(habox, "reset") != 0)
         return -1;
- 
-    return 0;
+    return HA_update(habox, habox->box->control_addr,
+                     HA_box_ctl_rst_ctrl_mask, HA_box_ctl_rst_ctrl_mask);
 }
 
 int HA_box_reset_ctrs(HABox_t *habox) {
-    uint32_t reset_dword;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to reset an empty habox???\n");
-        return -1;
-    }
- 
-    if (pcicfg_box_read_dword(habox->box,
-                              habox->box->control_addr,
-                              &reset_dword) != YEAH)
+    if (HA_box_check(habox, "reset") != 0)
         return -1;
-    reset_dword |= HA_PCI_PMON_BOX_CTL_rst_ctrs;
-    if (pcicfg_box_write_dword(habox->box,
-                               habox->box->control_addr,
-                               reset_dword) != YEAH)
-        return -1;
- 
-    return 0;
+    return HA_update(habox, habox->box->control_addr,
+                     HA_box_ctl_rst_ctrs_mask, HA_box_ctl_rst_ctrs_mask);
 }
 
 int HA_box_clear_overflow(HABox_t *habox) {
-    uint32_t overflow;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to clear overflow of an empty habox???\n");
-        return -1;
-    }
-
-    if (pcicfg_box_read_dword(habox->box,
-                              habox->box->status_addr,
-                              &overflow) != YEAH)
+    if (HA_box_check(habox, "clear overflow of") != 0)
         return -1;
-    overflow |= HA_PCI_PMON_BOX_STATUS_ov;
-    if (pcicfg_box_write_dword(habox->box,
-                               habox->box->status_addr,
-                               overflow) != YEAH)
-        return -1;
- 
-    return 0;
+    if (!habox->box->status_addr)
+        return 0;
+    // RW1C
+    return HA_update(habox, habox->box->status_addr,
+                     HA_box_status_ov_mask, HA_box_status_ov_mask);
 }
 
 typedef struct {
@@ -656,194 +661,180 @@ typedef struct {
     uint32_t controller;
 } pair_t;
 
-const pair_t HA_pairs[4] = {
+// offsets of the Broadwell HA until HA_set_map
+static pair_t HA_pairs[4] = {
     {
-        .counter = HA_PCI_PMON_CTR0,
-        .controller = HA_PCI_PMON_CTL0,
+        .counter = UNCORE_AT(HA, ctr, 0),
+        .controller = UNCORE_AT(HA, ctl, 0),
     },
 
     {
-        .counter = HA_PCI_PMON_CTR1,
-        .controller = HA_PCI_PMON_CTL1,
+        .counter = UNCORE_AT(HA, ctr, 1),
+        .controller = UNCORE_AT(HA, ctl, 1),
     },
     
     {
-        .counter = HA_PCI_PMON_CTR2,
-        .controller = HA_PCI_PMON_CTL2,
+        .counter = UNCORE_AT(HA, ctr, 2),
+        .controller = UNCORE_AT(HA, ctl, 2),
     },
 
     {
-        .counter = HA_PCI_PMON_CTR3,
-        .controller = HA_PCI_PMON_CTL3,
+        .counter = UNCORE_AT(HA, ctr, 3),
+        .controller = UNCORE_AT(HA, ctl, 3),
     },
 };
 
-int HA_reset_ctr(HABox_t *habox, int pairnr) {
-    uint32_t cl;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to reset an empty box?\n");
-        return -1;
-    }
+void HA_set_map(const uncore_map_t *map) {
+    int i;
 
-    if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Why you try to reset a non-exist pari?\n");
-        return -1;
+    for (i = 0; i < 4; i++) {
+        HA_pairs[i].counter = map->ctr[i];
+        HA_pairs[i].controller = map->ctl[i];
     }
-
-
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
-        return -1;
-    cl |= HA_PCI_PMON_CTRL_rst;
-    if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
-        return -1;
-    return 0;
+    uncore_map = map;
 }
 
-int HA_enable(HABox_t *habox, int pairnr) {
-    uint32_t cl;
+static int HA_pair_check(HABox_t *habox, int pairnr, const char *what) {
     if (!habox) {
-        printk(KERN_ERR "Why you try to enable an empty box?\n");
+        printk(KERN_ERR "Why you try to %s an empty box?\n", what);
         return -1;
     }
 
     if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Why you try to enable a non-exist pari?\n");
+        printk(KERN_ERR "Why you try to %s a non-exist pair?\n", what);
         return -1;
     }
+    return 0;
+}
 
-
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
-        return -1;
-    cl |= HA_PCI_PMON_CTRL_en;
-    if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
+// the fields of @mask in the control of @pairnr get those of @val
+static int HA_update_ctl(HABox_t *habox, int pairnr, uint32_t mask,
+                         uint32_t val, const char *what) {
+    if (HA_pair_check(habox, pairnr, what) != 0)
         return -1;
-    return 0;
+    return HA_update(habox, HA_pairs[pairnr].controller, mask, val);
+}
+
+int HA_reset_ctr(HABox_t *habox, int pairnr) {
+    return HA_update_ctl(habox, pairnr, HA_ctl_rst_mask, HA_ctl_rst_mask,
+                         "reset");
+}
+
+int HA_enable(HABox_t *habox, int pairnr) {
+    return HA_update_ctl(habox, pairnr, HA_ctl_en_mask, HA_ctl_en_mask,
+                         "enable");
 }
 
 int HA_disable(HABox_t *habox, int pairnr) {
-    uint32_t cl;
-    if (!habox) {
-        printk(KERN_ERR "Why you try to disable an empty box?\n");
-        return -1;
-    }
+    return HA_update_ctl(habox, pairnr, HA_ctl_en_mask, 0, "disable");
+}
 
-    if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Why you try to disable a non-exist pari?\n");
-        return -1;
-    }
+int HA_enable_overflow(HABox_t *habox, int pairnr) {
+    return HA_update_ctl(habox, pairnr, HA_ctl_ov_en_mask, HA_ctl_ov_en_mask,
+                         "enable overflow of");
+}
 
+int HA_disable_overflow(HABox_t *habox, int pairnr) {
+    return HA_update_ctl(habox, pairnr, HA_ctl_ov_en_mask, 0,
+                         "disable overflow of");
+}
 
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
-        return -1;
-    cl &= (~HA_PCI_PMON_CTRL_en);
-    if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
+int HA_choose_event(HABox_t *habox, int pairnr, const event_t *event) {
+    if (HA_pair_check(habox, pairnr, "program") != 0)
         return -1;
-    return 0;
+
+    printk(KERN_INFO "%x : %x on %s\n", event->event_code, event->umask, event->name);
+    habox->event = event;
+    return HA_update(habox, HA_pairs[pairnr].controller,
+                     HA_ctl_ev_sel_mask | HA_ctl_umask_mask,
+                     HA_ctl_ev_sel_set(HA_ctl_umask_set(0, event->umask),
+                                       event->event_code));
 }
 
-int HA_enable_overflow(HABox_t *habox, int pairnr) {
-    uint32_t cl;
+int HA_read_counter(HABox_t *habox, int pairnr, uint64_t *val) {
     if (!habox) {
-        printk(KERN_ERR "Why you try to enable overflow an empty box?\n");
+        printk(KERN_ERR "HA box empty?\n");
         return -1;
     }
 
     if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Why you try to enable overfow a non-exist pari?\n");
+        printk(KERN_ERR "Pair number invalid?\n");
         return -1;
     }
-
-
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
-        return -1;
-    cl |= HA_PCI_PMON_CTRL_ov_en;
-    if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
-        return -1;
-    return 0;
+    
+    return (pcicfg_box_read_qword(habox->box,
+                                  HA_pairs[pairnr].counter,
+                                  val) != YEAH);
 }
 
-int HA_disable_overflow(HABox_t *habox, int pairnr) {
-    uint32_t cl;
+// preload a counter, e.g. with 2^48 - n to overflow after n events
+int HA_write_counter(HABox_t *habox, int pairnr, uint64_t val) {
     if (!habox) {
-        printk(KERN_ERR "Why you try to enable overflow an empty box?\n");
+        printk(KERN_ERR "HA box empty?\n");
         return -1;
     }
 
     if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Why you try to enable overfow a non-exist pari?\n");
+        printk(KERN_ERR "Pair number invalid?\n");
         return -1;
     }
 
-
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
-        return -1;
-    cl &= (~HA_PCI_PMON_CTRL_ov_en);
-    if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
-        return -1;
-    return 0;
+    return (pcicfg_box_write_qword(habox->box,
+                                   HA_pairs[pairnr].counter,
+                                   val & HA_PCI_PMON_CTR_MASK) != YEAH);
 }
 
-int HA_choose_event(HABox_t *habox, int pairnr, const event_t *event) {
-    uint32_t cl;
+/*
+  Filters of the ADDR_OPC_MATCH events. The match registers are box-wide,
+  so all pairs counting ADDR_OPC_MATCH share the same filter.
+  @paddr is a physical address, only its 64B line is compared.
+*/
+int HA_set_addr_match(HABox_t *habox, uint64_t paddr) {
+    uint32_t lo = HA_addrmatch0_lo_addr_set(0, (uint32_t)paddr >> 6);
+    uint32_t hi = HA_addrmatch1_hi_addr_set(0, (uint32_t)(paddr >> 32));
     if (!habox) {
-        printk(KERN_ERR "HA box empty?\n");
+        printk(KERN_ERR "Why you try to filter an empty habox???\n");
         return -1;
     }
 
-    if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Pair number invalid?\n");
+    if (!uncore_map->addrmatch0) {
+        printk(KERN_ERR "%s boxes can not match addresses\n", uncore_map->name);
         return -1;
     }
 
-    printk(KERN_INFO "%x : %x on %s\n", event->event_code, event->umask, event->name);
-    habox->event = event;
+    if (paddr >> 46) {
+        printk(KERN_ERR "address %llx is beyond 46 bits\n", paddr);
+        return -1;
+    }
 
-    if (pcicfg_box_read_dword(habox->box,
-                              HA_pairs[pairnr].controller,
-                              &cl) != YEAH)
+    if (pcicfg_box_write_dword(habox->box,
+                               uncore_map->addrmatch0,
+                               lo) != YEAH)
         return -1;
-    cl &= 0xffff0000;
-    cl |= ((uint32_t)event->umask << 8) | event->event_code;
-    printk(KERN_INFO "event is %x\n", cl);
     if (pcicfg_box_write_dword(habox->box,
-                               HA_pairs[pairnr].controller,
-                               cl) != YEAH)
+                               uncore_map->addrmatch1,
+                               hi) != YEAH)
         return -1;
     return 0;
 }
 
-int HA_read_counter(HABox_t *habox, int pairnr, uint64_t *val) {
+int HA_set_opcode_match(HABox_t *habox, uint8_t opcode) {
     if (!habox) {
-        printk(KERN_ERR "HA box empty?\n");
+        printk(KERN_ERR "Why you try to filter an empty habox???\n");
         return -1;
     }
 
-    if (pairnr < 0 || pairnr > 3) {
-        printk(KERN_ERR "Pair number invalid?\n");
+    if (!uncore_map->opcodematch) {
+        printk(KERN_ERR "%s boxes can not match opcodes\n", uncore_map->name);
         return -1;
     }
-    
-    return (pcicfg_box_read_qword(habox->box,
-                                  HA_pairs[pairnr].counter,
-                                  val) != YEAH);
+
+    return HA_update(habox, uncore_map->opcodematch, HA_opcodematch_opc_mask,
+                     HA_opcodematch_opc_set(0, opcode));
+}
+
+int HA_clear_match(HABox_t *habox) {
+    if (HA_set_addr_match(habox, 0) != 0)
+        return -1;
+    return HA_set_opcode_match(habox, 0);
 }
@@ -0,0 +1,215 @@
+#ifndef __MUX__
+#define __MUX__
+
+#include <linux/math64.h>
+#include <linux/string.h>
+
+#include "common.h"
+
+/*
+  Counter multiplexing. Include after platform.h.
+
+  A HA box has 4 counter pairs. Pairs used for delay computation are pinned
+  and never touched here; the others are shared by any number of diagnostic
+  events, which are rotated over them in groups every time slice, like perf
+  does with core events. Every event keeps
+      time_enabled  ns since multiplexing started
+      time_running  ns it was actually on a counter
+  and its count is estimated as count * time_enabled / time_running.
+  Results are in debugfs nvmemu/mux.
+
+  Events are named by mux_events, e.g. "local_reads,local_writes,imc_reads".
+*/
+
+#define MUX_MAX_EVENTS               (16)
+
+typedef struct {
+    const char *name;
+    const event_t *event;
+} mux_name_t;
+
+static const mux_name_t mux_names[] = {
+    { "clock_ticks", &HA_event_clock_ticks },
+    { "remote_reads", &HA_event_remote_reads },
+    { "local_reads", &HA_event_local_reads },
+    { "reads", &HA_event_reads },
+    { "remote_writes", &HA_event_remote_writes },
+    { "local_writes", &HA_event_local_writes },
+    { "writes", &HA_event_writes },
+    { "remote_access", &HA_event_remote_access },
+    { "imc_reads", &HA_event_imc_reads },
+    { "imc_writes", &HA_event_imc_writes },
+};
+
+typedef struct {
+    const event_t *event;
+    uint64_t count;           // counted while on a counter
+    uint64_t time_enabled;    // ns
+    uint64_t time_running;    // ns
+} mux_event_t;
+
+typedef struct {
+    HABox_t *habox;
+    int nr_pairs;             // pairs left to multiplexing
+    int pairs[4];
+    int scheduled[4];         // event on pairs[i], -1 if none
+    mux_event_t events[MUX_MAX_EVENTS];
+    int nr_events;
+    int next;                 // first event of the next group
+    uint64_t slice;           // ns
+    uint64_t slice_start;
+    uint64_t last;            // ns of the previous mux_tick
+    uint64_t rotations;
+} mux_t;
+
+static mux_t mux;
+
+// like HA_choose_event plus HA_enable, but quiet and leaving habox->event
+static int mux_program(int pairnr, const event_t *event) {
+    uint32_t mask = HA_ctl_ev_sel_mask | HA_ctl_umask_mask | HA_ctl_en_mask;
+    uint32_t cl = HA_ctl_ev_sel_set(HA_ctl_umask_set(HA_ctl_en_mask,
+                                                     event->umask),
+                                    event->event_code);
+
+    if (HA_update(mux.habox, HA_pairs[pairnr].controller, mask, cl) != 0)
+        return -1;
+    return HA_reset_ctr(mux.habox, pairnr);
+}
+
+// put the next group on the free pairs, @habox must be frozen
+static void mux_schedule(void) {
+    int i, ev;
+
+    for (i = 0; i < mux.nr_pairs; i++) {
+        HA_disable(mux.habox, mux.pairs[i]);
+        mux.scheduled[i] = -1;
+    }
+    for (i = 0; i < mux.nr_pairs && i < mux.nr_events; i++) {
+        ev = (mux.next + i) % mux.nr_events;
+        if (mux_program(mux.pairs[i], mux.events[ev].event) != 0)
+            continue;
+        mux.scheduled[i] = ev;
+    }
+    mux.next = (mux.next + i) % mux.nr_events;
+}
+
+/*
+  Account the time since the previous call and rotate when the slice is
+  over. Called by the sampler every tick with @habox frozen.
+*/
+void mux_tick(uint64_t now) {
+    uint64_t elapsed, value;
+    int i;
+
+    if (!mux.nr_events)
+        return;
+    elapsed = now - mux.last;
+    mux.last = now;
+
+    for (i = 0; i < mux.nr_events; i++)
+        mux.events[i].time_enabled += elapsed;
+    for (i = 0; i < mux.nr_pairs; i++) {
+        mux_event_t *e;
+        if (mux.scheduled[i] < 0)
+            continue;
+        e = &mux.events[mux.scheduled[i]];
+        if (HA_read_counter(mux.habox, mux.pairs[i], &value) == 0)
+            e->count += value;
+        HA_reset_ctr(mux.habox, mux.pairs[i]);
+        e->time_running += elapsed;
+    }
+
+    // nothing to rotate if every event has a counter
+    if (mux.nr_events > mux.nr_pairs && now - mux.slice_start >= mux.slice) {
+        mux_schedule();
+        mux.slice_start = now;
+        mux.rotations++;
+    }
+}
+
+uint64_t mux_scaled(const mux_event_t *e) {
+    if (!e->time_running)
+        return 0;
+    return mul_u64_u64_div_u64(e->count, e->time_enabled, e->time_running);
+}
+
+static int stats_mux_show(struct seq_file *m, void *v) {
+    int i;
+
+    seq_printf(m, "pairs %d, slice %llu ns, %llu rotations\n", mux.nr_pairs,
+               mux.slice, mux.rotations);
+    seq_printf(m, "%-24s %16s %16s %16s %16s\n", "event", "count",
+               "time_enabled", "time_running", "scaled");
+    for (i = 0; i < mux.nr_events; i++) {
+        mux_event_t *e = &mux.events[i];
+        seq_printf(m, "%-24s %16llu %16llu %16llu %16llu\n", e->event->name,
+                   e->count, e->time_enabled, e->time_running, mux_scaled(e));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_mux);
+
+/*
+  @names is a comma separated list of mux_names, @pinned a bitmask of the
+  pairs used elsewhere. @habox must be frozen.
+*/
+int init_mux(HABox_t *habox, const char *names, uint32_t pinned,
+             uint64_t slice_us) {
+    const char *p = names;
+    size_t len;
+    int i;
+
+    memset(&mux, 0, sizeof(mux));
+    if (!uncore_map->ha_events) {
+        printk(KERN_ERR "%s boxes do not count the HA events\n",
+               uncore_map->name);
+        return -ENODEV;
+    }
+    mux.habox = habox;
+    for (i = 0; i < 4; i++)
+        if (!(pinned & (1 << i)))
+            mux.pairs[mux.nr_pairs++] = i;
+    if (!mux.nr_pairs) {
+        printk(KERN_ERR "all pairs are pinned, nothing to multiplex on\n");
+        return -EBUSY;
+    }
+
+    while (*p) {
+        len = strcspn(p, ",");
+        for (i = 0; i < ARRAY_SIZE(mux_names); i++)
+            if (strlen(mux_names[i].name) == len &&
+                strncmp(mux_names[i].name, p, len) == 0)
+                break;
+        if (i == ARRAY_SIZE(mux_names) || mux.nr_events == MUX_MAX_EVENTS) {
+            printk(KERN_ERR "unknown or too many mux events at %s\n", p);
+            mux.nr_events = 0;
+            return -EINVAL;
+        }
+        mux.events[mux.nr_events++].event = mux_names[i].event;
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    if (!mux.nr_events)
+        return 0;
+
+    mux.slice = slice_us * NSEC_PER_USEC;
+    mux.last = mux.slice_start = ktime_get_ns();
+    mux_schedule();
+
+    if (stats_dir)
+        debugfs_create_file("mux", 0444, stats_dir, NULL, &stats_mux_fops);
+    printk(KERN_INFO "multiplexing %d events on %d pairs\n", mux.nr_events,
+           mux.nr_pairs);
+    return 0;
+}
+
+void free_mux(void) {
+    int i;
+
+    for (i = 0; i < mux.nr_pairs && mux.nr_events; i++)
+        HA_disable(mux.habox, mux.pairs[i]);
+    mux.nr_events = 0;
+}
+
+#endif
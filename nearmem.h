@@ -0,0 +1,130 @@
+#ifndef __NEARMEM__
+#define __NEARMEM__
+
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+
+#include "common.h"
+
+/*
+  Memory Mode near-memory cache (nearmem_mb, source=pebs). Include after
+  stats.h and before pebs.h.
+
+  In Memory Mode DRAM is a direct-mapped cache in front of NVM, invisible
+  to software, and only its misses pay NVM latency. The model is a flat
+  array of tags, one uint32_t per near-memory line, so a lookup is one load
+  and sixteen lines share a cache line of the array:
+      line  = paddr >> line_shift
+      index = line & (lines - 1)
+      tag   = line >> index_bits, stored + 1 so that 0 is an empty line
+  Size and line size are powers of two. Every sampled load is looked up
+  with the physical address pebs.h translated from its virtual one after
+  the NMI; a hit is near memory and not charged, a miss installs its tag,
+  evicting the old one, and charges the sample's period like a tagged
+  load. Page tags of pebs.h do not apply, all memory is far memory. A
+  sample without an address, or whose page could not be translated, is
+  not looked up and not charged; those are counted as no_phys.
+
+  Only sampled loads reach the model, so lines fill at the sampling rate:
+  reuse is measured in samples, and the model warms up pebs_period times
+  slower than the hardware would. Stores never allocate. Hit ratio and
+  occupancy of the tag array are in debugfs nvmemu/nearmem.
+*/
+
+typedef struct {
+    uint32_t *tags;
+    uint64_t lines;
+    unsigned int line_shift;
+    unsigned int index_bits;
+    uint64_t valid;           // occupied lines
+    uint64_t hits;            // samples
+    uint64_t misses;
+    uint64_t evictions;
+    atomic64_t no_phys;       // samples not looked up, also from the NMI
+} nearmem_t;
+
+static nearmem_t nearmem;
+
+bool nearmem_enabled(void) {
+    return nearmem.tags != NULL;
+}
+
+// a sample without a physical address
+void nearmem_no_phys(void) {
+    atomic64_inc(&nearmem.no_phys);
+}
+
+// irq_work of the only sampled cpu, no other writer
+bool nearmem_hit(uint64_t paddr) {
+    uint64_t line = paddr >> nearmem.line_shift;
+    uint32_t *slot = &nearmem.tags[line & (nearmem.lines - 1)];
+    uint32_t tag = (uint32_t)(line >> nearmem.index_bits) + 1;
+
+    if (*slot == tag) {
+        nearmem.hits++;
+        return true;
+    }
+    if (*slot)
+        nearmem.evictions++;
+    else
+        nearmem.valid++;
+    *slot = tag;
+    nearmem.misses++;
+    return false;
+}
+
+static int stats_nearmem_show(struct seq_file *m, void *v) {
+    uint64_t hits = READ_ONCE(nearmem.hits);
+    uint64_t lookups = hits + READ_ONCE(nearmem.misses);
+    uint64_t valid = READ_ONCE(nearmem.valid);
+
+    seq_printf(m, "size            %llu MB\n",
+               (nearmem.lines << nearmem.line_shift) >> 20);
+    seq_printf(m, "line            %u B\n", 1U << nearmem.line_shift);
+    seq_printf(m, "lines           %llu\n", nearmem.lines);
+    seq_printf(m, "occupied        %llu (%llu per mille)\n", valid,
+               div64_u64(valid * 1000, nearmem.lines));
+    seq_printf(m, "lookups         %llu\n", lookups);
+    seq_printf(m, "hits            %llu (%llu per mille)\n", hits,
+               lookups ? div64_u64(hits * 1000, lookups) : 0);
+    seq_printf(m, "misses          %llu\n", lookups - hits);
+    seq_printf(m, "evictions       %llu\n", READ_ONCE(nearmem.evictions));
+    seq_printf(m, "no_phys         %lld\n", atomic64_read(&nearmem.no_phys));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_nearmem);
+
+int init_nearmem(uint64_t size_mb, unsigned int line) {
+    uint64_t size = size_mb << 20;
+
+    memset(&nearmem, 0, sizeof(nearmem));
+    if (!is_power_of_2(size_mb) || !is_power_of_2(line) || line < 64 ||
+        line > size) {
+        printk(KERN_ERR "near memory of %llu MB in %u B lines, both must be "
+               "powers of two\n", size_mb, line);
+        return -EINVAL;
+    }
+    nearmem.line_shift = ilog2(line);
+    nearmem.lines = size >> nearmem.line_shift;
+    nearmem.index_bits = ilog2(nearmem.lines);
+    nearmem.tags = vzalloc(nearmem.lines * sizeof(uint32_t));
+    if (!nearmem.tags) {
+        printk(KERN_ERR "no %llu bytes for the near-memory tags\n",
+               nearmem.lines * sizeof(uint32_t));
+        return -ENOMEM;
+    }
+
+    if (stats_dir)
+        debugfs_create_file("nearmem", 0444, stats_dir, NULL,
+                            &stats_nearmem_fops);
+    printk(KERN_INFO "memory mode, %llu MB of near memory in %u B lines\n",
+           size_mb, line);
+    return 0;
+}
+
+void free_nearmem(void) {
+    vfree(nearmem.tags);
+    nearmem.tags = NULL;
+}
+
+#endif
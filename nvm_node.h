@@ -0,0 +1,120 @@
+#ifndef __NVM_NODE__
+#define __NVM_NODE__
+
+#include <linux/ioport.h>
+#include <linux/memory.h>
+#include <linux/memory_hotplug.h>
+#include <linux/mm.h>
+#include <linux/numa.h>
+#include <linux/version.h>
+
+#include "common.h"
+
+/*
+  Emulated NVM NUMA node.
+
+  A physical range is moved into its own memory-only NUMA node, so that
+  applications place "NVM" explicitly with numactl --membind or mbind().
+
+  A node is made of whole memory blocks, 128MiB or more, i.e. millions of
+  lines, and the line-by-line walk of addr_filter.h would take as many
+  ticks, so the region is not filtered: the remote accesses of nvm_socket
+  are counted as with nvm_size=0. Every remote access to that socket is
+  then charged as NVM, so the emulated workload must keep the rest of its
+  memory off the socket's other nodes, e.g. bind it to the node of its
+  own cpus and the NVM node only.
+
+  Usage:
+  1. pick a range of memory blocks homed on the socket the emulator
+     monitors (nvm_socket) and offline them:
+         echo offline > /sys/devices/system/memory/memoryN/state
+  2. insmod emulator.ko nvm_start=<phys> nvm_size=<bytes> nvm_node=<nid>
+     where nid is a possible but memory-less node, e.g. a hotplug node from
+     the SRAT.
+  3. online the new blocks, online_movable keeps kernel allocations out:
+         echo online_movable > /sys/devices/system/memory/memoryN/state
+
+  On unload the range is offlined again and given back to its original node.
+  This needs the memory hotplug API of 5.15 or newer.
+*/
+
+#define NVM_NODE_RESOURCE            "System RAM (nvmemu)"
+
+typedef struct {
+    int nid;                  // emulated NVM node, -1 if not used
+    int orig_nid;             // node the range belonged to
+    uint64_t start;
+    uint64_t size;
+} nvm_node_t;
+
+static nvm_node_t nvm_node_state = { .nid = NUMA_NO_NODE };
+
+int init_nvm_node(int nid, uint64_t start, uint64_t size) {
+    uint64_t block = memory_block_size_bytes();
+    int orig_nid;
+
+    if (!size || !IS_ALIGNED(start, block) || !IS_ALIGNED(size, block)) {
+        printk(KERN_ERR "NVM node range %llx+%llx is not aligned to memory "
+               "blocks of %llx\n", start, size, block);
+        return -EINVAL;
+    }
+
+    if (nid < 0 || nid >= MAX_NUMNODES || !node_possible(nid)) {
+        printk(KERN_ERR "node %d is not a possible node\n", nid);
+        return -EINVAL;
+    }
+
+    if (region_intersects(start, size, IORESOURCE_SYSTEM_RAM,
+                          IORES_DESC_NONE) != REGION_INTERSECTS) {
+        printk(KERN_ERR "NVM node range %llx+%llx is not System RAM\n",
+               start, size);
+        return -EINVAL;
+    }
+
+    /*
+      All blocks must have been offlined by userspace, see above, so their
+      memmap may be poisoned and pfn_to_nid() can not be trusted. The node
+      comes from the firmware tables, like for any hot-added range.
+    */
+    orig_nid = memory_add_physaddr_to_nid(start);
+    if (remove_memory(start, size) != 0) {
+        printk(KERN_ERR "can not remove %llx+%llx, are the blocks offline?\n",
+               start, size);
+        return -EBUSY;
+    }
+
+    if (add_memory_driver_managed(nid, start, size, NVM_NODE_RESOURCE,
+                                  MHP_NONE) != 0) {
+        printk(KERN_ERR "can not add %llx+%llx to node %d\n", start, size, nid);
+        if (add_memory(orig_nid, start, size, MHP_NONE) != 0)
+            printk(KERN_ERR "%llx+%llx is lost until reboot\n", start, size);
+        return -EIO;
+    }
+
+    nvm_node_state.nid = nid;
+    nvm_node_state.orig_nid = orig_nid;
+    nvm_node_state.start = start;
+    nvm_node_state.size = size;
+    printk(KERN_INFO "NVM node %d: %llx+%llx, online its memory blocks\n",
+           nid, start, size);
+    return 0;
+}
+
+void free_nvm_node(void) {
+    nvm_node_t *node = &nvm_node_state;
+    if (node->nid == NUMA_NO_NODE)
+        return;
+
+    // fails if pages are still in use and can not be migrated
+    if (offline_and_remove_memory(node->start, node->size) != 0) {
+        printk(KERN_ERR "can not remove NVM node %d, its memory stays\n",
+               node->nid);
+        return;
+    }
+    if (add_memory(node->orig_nid, node->start, node->size, MHP_NONE) != 0)
+        printk(KERN_ERR "can not give %llx+%llx back to node %d\n",
+               node->start, node->size, node->orig_nid);
+    node->nid = NUMA_NO_NODE;
+}
+
+#endif
@@ -0,0 +1,383 @@
+#ifndef __PEBS__
+#define __PEBS__
+
+#include <linux/fs.h>
+#include <linux/irq_work.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/perf_event.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+#include "common.h"
+#include "emulator_uapi.h"
+
+/*
+  PEBS load-latency source (source=pebs). Include after stats.h and
+  nearmem.h.
+
+  The HA counts the requests of a whole socket and can not tell pages
+  apart, so "NVM" has to be a socket or a region filtered one line per tick.
+  Here the target cpu samples MEM_TRANS_RETIRED.LOAD_LATENCY (0x1cd, the
+  same on Haswell-EP, Broadwell and Skylake-SP) with PEBS: every
+  pebs_period-th load slower than pebs_ldlat cycles is reported with its
+  virtual data address. A sample whose address falls into a page tagged as
+  NVM stands for period loads of NVM, so the tick's
+  accesses are
+      sum of the periods of tagged samples
+  and the delay path charges them as usual. Untagged loads are not delayed,
+  so hot and cold pages of one process can be placed on "NVM" and DRAM
+  side by side.
+
+  Pages are tagged per process through /dev/nvmemu_pebs,
+      NVMEMU_PEBS_TAG / NVMEMU_PEBS_UNTAG with a virtual range of the caller
+  like madvise(), the tags live as long as the file stays open. A tag
+  stalls TARGET_CPU, which other workloads share, so the device is root's
+  only, like the other control devices. The physical region nvm_start/nvm_size, if any, is always tagged. With a
+  near-memory cache (nearmem.h) tags are not used: every sampled load is a
+  far memory load and only the misses of the cache model are charged.
+
+  Virtual tags are matched in the NMI of the PEBS overflow, without locks:
+  a tag is published by a release store of its owner, so at worst one
+  sample races with a tag being reused.
+
+  An overflow handler in the kernel gets no physical address, perf only
+  computes it when it writes a sample to a ring buffer, and walking page
+  tables in an NMI is what perf itself is careful about. So samples that
+  need one, for the physical region or the near-memory cache, are queued
+  in a ring and an irq_work translates them on the same cpu right after
+  the NMI, while the sampled task is still current, with the lockless
+  get_user_page_fast_only() of perf_virt_to_phys(). A sample whose task
+  is gone by then, or whose page is not mapped, is counted as no_phys and
+  not charged; a full ring counts as overrun.
+
+  Only loads are sampled, writes are not charged. Counts of samples, tagged
+  ones and their mean latency are in debugfs nvmemu/pebs.
+*/
+
+#define PEBS_DEV                     "nvmemu_pebs"
+#define PEBS_EVENT                   (0x01cd)  // MEM_TRANS_RETIRED.LOAD_LATENCY
+#define PEBS_MAX_TAGS                (64)
+#define PEBS_TAG_FREE                (0)
+#define PEBS_TAG_PHYS                (-1)      // owner of a physical range
+#define PEBS_RING                    (64)      // samples to translate
+
+typedef struct {
+    pid_t owner;              // tgid, PEBS_TAG_FREE or PEBS_TAG_PHYS
+    struct file *file;        // that tagged it, NULL for physical ranges
+    uint64_t start;           // page aligned
+    uint64_t end;
+} pebs_tag_t;
+
+// a sample waiting for its physical address
+typedef struct {
+    pid_t tgid;
+    uint64_t vaddr;
+    uint64_t period;
+    uint64_t weight;          // cycles
+} pebs_sample_t;
+
+typedef struct {
+    struct perf_event *event;
+    int cpu;
+    uint64_t period;
+    uint64_t ldlat;           // cycles
+    struct mutex lock;        // writers of tags
+    pebs_tag_t tags[PEBS_MAX_TAGS];
+    bool phys;                // samples need a physical address
+    struct irq_work work;     // translates the ring
+    pebs_sample_t ring[PEBS_RING];
+    unsigned int head;        // written by the NMI only
+    unsigned int tail;        // written by the irq_work only
+    atomic64_t accesses;      // tagged loads since the last tick
+    atomic64_t samples;
+    atomic64_t tagged;
+    atomic64_t no_addr;
+    atomic64_t no_phys;
+    atomic64_t overruns;
+    atomic64_t latency;       // cycles, sum over tagged samples
+} pebs_t;
+
+static pebs_t pebs;
+
+/*
+  Since 6.1 a field of perf_sample_data is only valid with its bit in
+  sample_flags, before that the PEBS handler zeroed what it did not fill.
+*/
+static uint64_t pebs_weight(struct perf_sample_data *data) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+    if (!(data->sample_flags & PERF_SAMPLE_WEIGHT_TYPE))
+        return 0;
+#endif
+    return data->weight.full;
+}
+
+static uint64_t pebs_addr(struct perf_sample_data *data) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+    if (!(data->sample_flags & PERF_SAMPLE_ADDR))
+        return 0;
+#endif
+    return data->addr;
+}
+
+// @addr is virtual for a tgid, physical for PEBS_TAG_PHYS
+static bool pebs_tagged(pid_t owner, uint64_t addr) {
+    int i;
+
+    for (i = 0; i < PEBS_MAX_TAGS; i++) {
+        pebs_tag_t *t = &pebs.tags[i];
+
+        if (smp_load_acquire(&t->owner) == owner && addr >= t->start &&
+            addr < t->end)
+            return true;
+    }
+    return false;
+}
+
+static void pebs_charge(uint64_t period, uint64_t weight) {
+    atomic64_inc(&pebs.tagged);
+    atomic64_add(weight, &pebs.latency);
+    atomic64_add(period, &pebs.accesses);
+}
+
+// physical address of @vaddr in the current task, 0 if it is not mapped
+static uint64_t pebs_phys(uint64_t vaddr) {
+    struct page *page;
+    uint64_t paddr = 0;
+
+    if (vaddr >= TASK_SIZE)
+        return virt_addr_valid((void *)(uintptr_t)vaddr) ? __pa(vaddr) : 0;
+    if (!current->mm)
+        return 0;
+    pagefault_disable();
+    if (get_user_page_fast_only(vaddr, 0, &page)) {
+        paddr = page_to_phys(page) + offset_in_page(vaddr);
+        put_page(page);
+    }
+    pagefault_enable();
+    return paddr;
+}
+
+// irq_work on the sampled cpu, the only consumer of the ring
+static void pebs_translate(struct irq_work *work) {
+    unsigned int tail = pebs.tail;
+    pebs_sample_t s;
+    uint64_t paddr;
+
+    while (tail != smp_load_acquire(&pebs.head)) {
+        s = pebs.ring[tail % PEBS_RING];
+        smp_store_release(&pebs.tail, ++tail);
+
+        paddr = s.tgid == task_tgid_nr(current) ? pebs_phys(s.vaddr) : 0;
+        if (!paddr) {
+            atomic64_inc(&pebs.no_phys);
+            if (nearmem_enabled())
+                nearmem_no_phys();
+            continue;
+        }
+        if (nearmem_enabled() ? nearmem_hit(paddr)
+                              : !pebs_tagged(PEBS_TAG_PHYS, paddr))
+            continue;
+        pebs_charge(s.period, s.weight);
+    }
+}
+
+// NMI context
+static void pebs_overflow(struct perf_event *event,
+                          struct perf_sample_data *data, struct pt_regs *regs) {
+    uint64_t vaddr = pebs_addr(data), weight = pebs_weight(data);
+    uint64_t period = data->period ? data->period : pebs.period;
+    pid_t tgid = task_tgid_nr(current);
+    unsigned int head = pebs.head;
+    pebs_sample_t *s;
+
+    atomic64_inc(&pebs.samples);
+    if (!vaddr) {
+        atomic64_inc(&pebs.no_addr);
+        if (nearmem_enabled())
+            nearmem_no_phys();
+        return;
+    }
+    if (!nearmem_enabled() && pebs_tagged(tgid, vaddr)) {
+        pebs_charge(period, weight);
+        return;
+    }
+    if (!pebs.phys)
+        return;
+    if (head - READ_ONCE(pebs.tail) >= PEBS_RING) {
+        atomic64_inc(&pebs.overruns);
+        return;
+    }
+    s = &pebs.ring[head % PEBS_RING];
+    s->tgid = tgid;
+    s->vaddr = vaddr;
+    s->period = period;
+    s->weight = weight;
+    smp_store_release(&pebs.head, head + 1);
+    irq_work_queue(&pebs.work);
+}
+
+// tagged loads since the previous call
+uint64_t pebs_delta(void) {
+    return atomic64_xchg(&pebs.accesses, 0);
+}
+
+static int pebs_tag(pid_t owner, struct file *file, uint64_t start,
+                    uint64_t len) {
+    pebs_tag_t *t;
+    int i, ret = -ENOSPC;
+
+    if (!len || start + len < start)
+        return -EINVAL;
+    mutex_lock(&pebs.lock);
+    for (i = 0; i < PEBS_MAX_TAGS; i++) {
+        t = &pebs.tags[i];
+        if (t->owner != PEBS_TAG_FREE)
+            continue;
+        t->file = file;
+        t->start = round_down(start, PAGE_SIZE);
+        t->end = round_up(start + len, PAGE_SIZE);
+        smp_store_release(&t->owner, owner);
+        ret = 0;
+        break;
+    }
+    mutex_unlock(&pebs.lock);
+    return ret;
+}
+
+// tags of @file within [start, start + len), all of them if @len is 0
+static int pebs_untag(struct file *file, uint64_t start, uint64_t len) {
+    pebs_tag_t *t;
+    int i, ret = len ? -ENOENT : 0;
+
+    mutex_lock(&pebs.lock);
+    for (i = 0; i < PEBS_MAX_TAGS; i++) {
+        t = &pebs.tags[i];
+        if (t->owner == PEBS_TAG_FREE || t->file != file)
+            continue;
+        if (len && (t->start < round_down(start, PAGE_SIZE) ||
+                    t->end > round_up(start + len, PAGE_SIZE)))
+            continue;
+        WRITE_ONCE(t->owner, PEBS_TAG_FREE);
+        ret = 0;
+    }
+    mutex_unlock(&pebs.lock);
+    return ret;
+}
+
+static long pebs_ioctl(struct file *file, unsigned int cmd,
+                       unsigned long arg) {
+    struct nvmemu_range range;
+
+    if (cmd != NVMEMU_PEBS_TAG && cmd != NVMEMU_PEBS_UNTAG)
+        return -ENOTTY;
+    if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+        return -EFAULT;
+    if (cmd == NVMEMU_PEBS_UNTAG)
+        return range.len ? pebs_untag(file, range.start, range.len) : -EINVAL;
+    return pebs_tag(task_tgid_nr(current), file, range.start, range.len);
+}
+
+static int pebs_release(struct inode *inode, struct file *file) {
+    pebs_untag(file, 0, 0);
+    return 0;
+}
+
+static const struct file_operations pebs_fops = {
+    .owner = THIS_MODULE,
+    .release = pebs_release,
+    .unlocked_ioctl = pebs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice pebs_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = PEBS_DEV,
+    .fops = &pebs_fops,
+    .mode = 0600,
+};
+
+static int stats_pebs_show(struct seq_file *m, void *v) {
+    uint64_t tagged = atomic64_read(&pebs.tagged);
+    int i, tags = 0;
+
+    for (i = 0; i < PEBS_MAX_TAGS; i++)
+        tags += READ_ONCE(pebs.tags[i].owner) != PEBS_TAG_FREE;
+    seq_printf(m, "cpu             %d\n", pebs.cpu);
+    seq_printf(m, "period          %llu\n", pebs.period);
+    seq_printf(m, "ldlat           %llu cycles\n", pebs.ldlat);
+    seq_printf(m, "tags            %d\n", tags);
+    seq_printf(m, "samples         %lld\n", atomic64_read(&pebs.samples));
+    seq_printf(m, "tagged          %llu\n", tagged);
+    seq_printf(m, "no_addr         %lld\n", atomic64_read(&pebs.no_addr));
+    seq_printf(m, "no_phys         %lld\n", atomic64_read(&pebs.no_phys));
+    seq_printf(m, "overruns        %lld\n", atomic64_read(&pebs.overruns));
+    seq_printf(m, "tagged_latency  %llu cycles\n",
+               tagged ? div64_u64(atomic64_read(&pebs.latency), tagged) : 0);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_pebs);
+
+void free_pebs(void) {
+    if (!pebs.event)
+        return;
+    perf_event_release_kernel(pebs.event);
+    irq_work_sync(&pebs.work);
+    pebs.event = NULL;
+    misc_deregister(&pebs_dev);
+}
+
+// sample loads of @cpu, @size bytes from @phys_start are always NVM
+int init_pebs(int cpu, uint64_t period, uint64_t ldlat, uint64_t phys_start,
+              uint64_t size) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_RAW,
+        .size = sizeof(struct perf_event_attr),
+        .config = PEBS_EVENT,
+        .config1 = ldlat,
+        .sample_period = period,
+        .sample_type = PERF_SAMPLE_ADDR | PERF_SAMPLE_WEIGHT,
+        .precise_ip = 2,
+        .exclude_hv = 1,
+        .pinned = 1,
+    };
+
+    memset(&pebs, 0, sizeof(pebs));
+    mutex_init(&pebs.lock);
+    init_irq_work(&pebs.work, pebs_translate);
+    if (!period) {
+        printk(KERN_ERR "PEBS needs a sampling period\n");
+        return -EINVAL;
+    }
+    pebs.cpu = cpu;
+    pebs.period = period;
+    pebs.ldlat = ldlat;
+    if (size)
+        pebs_tag(PEBS_TAG_PHYS, NULL, phys_start, size);
+    pebs.phys = size || nearmem_enabled();
+
+    if (misc_register(&pebs_dev) != 0) {
+        printk(KERN_ERR "Can not register /dev/%s\n", PEBS_DEV);
+        return -ENODEV;
+    }
+    pebs.event = perf_event_create_kernel_counter(&attr, cpu, NULL,
+                                                  pebs_overflow, NULL);
+    if (IS_ERR(pebs.event)) {
+        printk(KERN_ERR "no PEBS load latency on cpu %d: %ld\n", cpu,
+               PTR_ERR(pebs.event));
+        pebs.event = NULL;
+        misc_deregister(&pebs_dev);
+        return -ENODEV;
+    }
+
+    if (stats_dir)
+        debugfs_create_file("pebs", 0444, stats_dir, NULL, &stats_pebs_fops);
+    printk(KERN_INFO "PEBS loads above %llu cycles every %llu on cpu %d\n",
+           ldlat, period, cpu);
+    return 0;
+}
+
+#endif
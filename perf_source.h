@@ -0,0 +1,206 @@
+#ifndef __PERF_SOURCE__
+#define __PERF_SOURCE__
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/perf_event.h>
+#include <linux/topology.h>
+
+#include "common.h"
+
+/*
+  Counter source over the kernel's uncore perf PMUs (source=perf).
+  Include after platform.h.
+
+  The raw pcicfg path owns the HA PMON registers: it freezes, programs and
+  resets them behind the kernel's back, so it and perf stat -e uncore_ha_*
+  corrupt each other's counts. This source opens the same HA events through
+  perf_event_create_kernel_counter() on the uncore_ha_<box> PMU instead
+  (uncore_m2m_<box> on Skylake-SP, see platform.h), and perf arbitrates the
+  counters: events of other users are scheduled next to ours, multiplexed
+  if needed, and counter wrap is handled by perf.
+  Every tick reads the running totals with perf_event_read_value() and
+  takes the difference, scaled by time_enabled/time_running in case perf
+  multiplexed the event.
+
+  With perf_imc=1 the iMC channels are counted instead of the HA: the
+  CAS_COUNT events (reads, writes or both, by mode) are opened on every
+  uncore_imc_<channel> PMU found and summed. They count all DRAM traffic of
+  the socket, local and remote, like the M2M boxes of Skylake-SP, and are
+  there on every platform the uncore driver supports.
+
+  The uncore PMUs do not sample, so tickless sampling and the address filter
+  need the raw path.
+*/
+
+#define PERF_SOURCE_PMU              "/sys/bus/event_source/devices/"
+#define PERF_SOURCE_IMC_PMU          "uncore_imc_%d"
+#define PERF_SOURCE_MAX              (4)
+#define PERF_SOURCE_PMUS             (8)       // iMC channels of a socket
+
+typedef struct {
+    struct perf_event *events[PERF_SOURCE_PMUS];   // one per PMU, summed
+    const event_t *ha_event;
+    uint64_t last[PERF_SOURCE_PMUS];  // scaled totals at the previous read
+} perf_counter_t;
+
+typedef struct {
+    int types[PERF_SOURCE_PMUS];      // dynamic perf types of the PMUs
+    int nr_types;
+    bool imc;
+    int cpu;                  // a cpu of the monitored socket
+    perf_counter_t counters[PERF_SOURCE_MAX];
+} perf_source_t;
+
+static perf_source_t perf_source;
+
+// @fmt is the sysfs name of the PMU with %d for @box
+static int perf_source_pmu_type(const char *fmt, int box) {
+    char path[96], pmu[32], buf[16];
+    struct file *file;
+    loff_t pos = 0;
+    ssize_t len;
+    int type;
+
+    snprintf(pmu, sizeof(pmu), fmt, box);
+    snprintf(path, sizeof(path), PERF_SOURCE_PMU "%s/type", pmu);
+    file = filp_open(path, O_RDONLY, 0);
+    if (IS_ERR(file))
+        return -1;
+    len = kernel_read(file, buf, sizeof(buf) - 1, &pos);
+    filp_close(file, NULL);
+    if (len <= 0)
+        return -1;
+    buf[len] = '\0';
+    if (kstrtoint(strim(buf), 10, &type) != 0)
+        return -1;
+    return type;
+}
+
+// count @event in slot @idx, the same numbering as the HA pairs
+int perf_source_add(int idx, const event_t *event) {
+    struct perf_event_attr attr = {
+        .size = sizeof(struct perf_event_attr),
+        .config = ((uint64_t)event->umask << 8) | event->event_code,
+    };
+    perf_counter_t *c;
+    int i;
+
+    if (idx < 0 || idx >= PERF_SOURCE_MAX)
+        return -EINVAL;
+    c = &perf_source.counters[idx];
+    if (c->ha_event)
+        return -EBUSY;
+
+    for (i = 0; i < perf_source.nr_types; i++) {
+        attr.type = perf_source.types[i];
+        c->events[i] = perf_event_create_kernel_counter(&attr, perf_source.cpu,
+                                                        NULL, NULL, NULL);
+        if (IS_ERR(c->events[i])) {
+            printk(KERN_ERR "Can not open %s on uncore perf: %ld\n",
+                   event->name, PTR_ERR(c->events[i]));
+            c->events[i] = NULL;
+            while (i--) {
+                perf_event_release_kernel(c->events[i]);
+                c->events[i] = NULL;
+            }
+            return -EIO;
+        }
+        c->last[i] = 0;
+    }
+    c->ha_event = event;
+    printk(KERN_INFO "%x : %x on %s through perf, %d PMUs\n",
+           event->event_code, event->umask, event->name,
+           perf_source.nr_types);
+    return 0;
+}
+
+// events counted in slot @idx since the previous call, summed over the PMUs
+uint64_t perf_source_delta(int idx) {
+    perf_counter_t *c = &perf_source.counters[idx];
+    uint64_t count, enabled, running, scaled, delta = 0;
+    int i;
+
+    if (!c->ha_event)
+        return 0;
+    for (i = 0; i < perf_source.nr_types; i++) {
+        count = perf_event_read_value(c->events[i], &enabled, &running);
+        scaled = running && running < enabled ?
+                 mul_u64_u64_div_u64(count, enabled, running) : count;
+        delta += scaled > c->last[i] ? scaled - c->last[i] : 0;
+        c->last[i] = scaled;
+    }
+    return delta;
+}
+
+// ns the sampler spends reading its counters, replaces the raw tick cost
+uint64_t perf_source_tick_cost(void) {
+    uint64_t best = U64_MAX, start;
+    int i, j;
+
+    // the minimum, the reads are short and interrupts only add to them
+    for (i = 0; i < 64; i++) {
+        start = ktime_get_ns();
+        for (j = 0; j < PERF_SOURCE_MAX; j++)
+            perf_source_delta(j);
+        best = min(best, ktime_get_ns() - start);
+    }
+    return best;
+}
+
+// HA (or M2M) @box of @socket, or all its iMC channels if @imc
+int init_perf_source(int socket, int box, bool imc) {
+    int cpu, type, i;
+
+    memset(&perf_source, 0, sizeof(perf_source));
+    perf_source.imc = imc;
+    if (imc) {
+        for (i = 0; i < PERF_SOURCE_PMUS; i++) {
+            type = perf_source_pmu_type(PERF_SOURCE_IMC_PMU, i);
+            if (type >= 0)
+                perf_source.types[perf_source.nr_types++] = type;
+        }
+    } else {
+        type = perf_source_pmu_type(uncore_map->perf_pmu, box);
+        if (type >= 0)
+            perf_source.types[perf_source.nr_types++] = type;
+    }
+    if (!perf_source.nr_types) {
+        printk(KERN_ERR "no perf PMU for %s %s, use the raw source\n",
+               imc ? "the iMC channels of" : "the box of",
+               uncore_map->name);
+        return -ENODEV;
+    }
+
+    // the uncore driver moves the event to its designated cpu of the socket
+    perf_source.cpu = -1;
+    for_each_online_cpu(cpu) {
+        if (topology_physical_package_id(cpu) == socket) {
+            perf_source.cpu = cpu;
+            break;
+        }
+    }
+    if (perf_source.cpu < 0) {
+        printk(KERN_ERR "no online cpu on socket %d\n", socket);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+void free_perf_source(void) {
+    perf_counter_t *c;
+    int i, j;
+
+    for (i = 0; i < PERF_SOURCE_MAX; i++) {
+        c = &perf_source.counters[i];
+        for (j = 0; j < PERF_SOURCE_PMUS; j++) {
+            if (c->events[j])
+                perf_event_release_kernel(c->events[j]);
+            c->events[j] = NULL;
+        }
+        c->ha_event = NULL;
+    }
+}
+
+#endif
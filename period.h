@@ -0,0 +1,106 @@
+#ifndef __PERIOD__
+#define __PERIOD__
+
+#include <linux/delay.h>
+#include <linux/ktime.h>
+
+#include "common.h"
+
+/*
+  Adaptive sampling period.
+
+  After every tick the sampler asks for the next period:
+  - busy: the access rate is above @busy accesses per ms, or the injected
+    delay missed the computed one by more than @max_error ns; the period is
+    halved, so bursts are cut into finer ticks;
+  - quiet: the rate is below @quiet accesses per ms and the delay was on
+    target; the period grows by a quarter, so idle phases cost little CPU;
+  - otherwise it is kept.
+  The period stays within [min, max]; min == max gives a fixed period.
+  Decisions are reported in debugfs nvmemu/period.
+*/
+
+typedef struct {
+    uint64_t min;             // ns
+    uint64_t max;             // ns
+    uint64_t cur;             // ns
+    uint64_t busy;            // accesses per ms
+    uint64_t quiet;           // accesses per ms
+    uint64_t max_error;       // ns
+    uint64_t rate;            // accesses per ms of the last tick
+    uint64_t shortened;
+    uint64_t lengthened;
+    uint64_t kept;
+} period_t;
+
+static period_t period;
+
+int init_period(uint64_t min_us, uint64_t max_us, uint64_t busy,
+                uint64_t quiet, uint64_t max_error) {
+    if (!min_us || min_us > max_us) {
+        printk(KERN_ERR "sampling period bounds %llu-%llu us are invalid\n",
+               min_us, max_us);
+        return -EINVAL;
+    }
+    memset(&period, 0, sizeof(period));
+    period.min = min_us * NSEC_PER_USEC;
+    period.max = max_us * NSEC_PER_USEC;
+    // start at the old fixed 10ms if the bounds allow it
+    period.cur = clamp_t(uint64_t, 10 * NSEC_PER_MSEC, period.min, period.max);
+    period.busy = busy;
+    period.quiet = quiet;
+    period.max_error = max_error;
+    return 0;
+}
+
+// @accesses counted over @elapsed ns, @error is |computed - injected| delay
+uint64_t period_update(uint64_t accesses, uint64_t elapsed, uint64_t error) {
+    uint64_t next = period.cur;
+
+    period.rate = elapsed ? accesses * NSEC_PER_MSEC / elapsed : 0;
+    if (period.rate > period.busy || error > period.max_error)
+        next = max(period.cur / 2, period.min);
+    else if (period.rate < period.quiet)
+        next = min(period.cur + period.cur / 4, period.max);
+
+    if (next < period.cur)
+        period.shortened++;
+    else if (next > period.cur)
+        period.lengthened++;
+    else
+        period.kept++;
+    period.cur = next;
+    return next;
+}
+
+// sleep until the next tick is due, @elapsed ns of it were spent already
+void period_sleep(uint64_t elapsed) {
+    uint64_t us;
+
+    if (elapsed >= period.cur)
+        return;
+    us = (period.cur - elapsed) / NSEC_PER_USEC;
+    // long sleeps may be coalesced with other timers
+    usleep_range(us, us + us / 8);
+}
+
+static int stats_period_show(struct seq_file *m, void *v) {
+    seq_printf(m, "period_ns       %llu\n", period.cur);
+    seq_printf(m, "bounds_ns       %llu %llu\n", period.min, period.max);
+    seq_printf(m, "rate_per_ms     %llu\n", period.rate);
+    seq_printf(m, "thresholds      busy %llu quiet %llu error %llu\n",
+               period.busy, period.quiet, period.max_error);
+    seq_printf(m, "shortened       %llu\n", period.shortened);
+    seq_printf(m, "lengthened      %llu\n", period.lengthened);
+    seq_printf(m, "kept            %llu\n", period.kept);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_period);
+
+void init_period_stats(void) {
+    if (stats_dir)
+        debugfs_create_file("period", 0444, stats_dir, NULL,
+                            &stats_period_fops);
+}
+
+#endif
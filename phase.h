@@ -0,0 +1,224 @@
+#ifndef __PHASE__
+#define __PHASE__
+
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+
+#include "common.h"
+#include "emulator_uapi.h"
+
+/*
+  Measurement windows, /dev/nvmemu_ctl. Include after stats.h.
+
+  Emulation is on from load unless start_paused is set, and benchmarks turn
+  it off for their load and warm-up phases through ioctls:
+      NVMEMU_CTL_START    inject delays, opens a phase if none is open
+      NVMEMU_CTL_PAUSE    no delays, the phase stays open
+      NVMEMU_CTL_STOP     no delays, the phase ends
+      NVMEMU_CTL_PHASE    ends the phase and opens a new named one, the
+                          running state is kept
+  The counters are still sampled while paused, so a started phase begins
+  from fresh deltas, but nothing is delayed: neither the target cpus, nor
+  the pmem fences and flushes. The closed loop does not probe either.
+
+  Every phase sums the accesses, requested and injected delay and the time
+  it ran, only while running; accesses seen while paused are counted apart.
+  The phases are listed in debugfs nvmemu/phases, the first one, "default",
+  is opened at load. The last PHASE_MAX phases are kept: opening one more
+  reuses the slot of the oldest, which is closed, so the ioctls never run
+  out of phases.
+*/
+
+#define PHASE_DEV                    "nvmemu_ctl"
+#define PHASE_MAX                    (32)
+
+typedef struct {
+    char name[NVMEMU_PHASE_NAME];
+    uint64_t running_ns;
+    uint64_t ticks;
+    uint64_t accesses;
+    uint64_t requested;       // ns
+    uint64_t injected;        // ns
+    uint64_t paused_accesses;
+    bool closed;
+} phase_t;
+
+typedef struct {
+    spinlock_t lock;          // the ioctls against the sampler and debugfs
+    bool running;
+    uint64_t since;           // ns, start of the current running stretch
+    uint64_t nr_phases;       // opened since load, slot nr % PHASE_MAX
+    int cur;                  // slot, -1 without an open phase
+    phase_t phases[PHASE_MAX];
+} phase_ctl_t;
+
+static phase_ctl_t phase_ctl;
+
+// true while delays should be injected
+bool phase_running(void) {
+    return READ_ONCE(phase_ctl.running);
+}
+
+// called by the sampler every tick with what it counted and delayed
+void phase_account(uint64_t accesses, uint64_t requested, uint64_t injected) {
+    phase_t *p;
+
+    spin_lock(&phase_ctl.lock);
+    if (phase_ctl.cur >= 0) {
+        p = &phase_ctl.phases[phase_ctl.cur];
+        if (phase_ctl.running) {
+            p->ticks++;
+            p->accesses += accesses;
+            p->requested += requested;
+            p->injected += injected;
+        } else {
+            p->paused_accesses += accesses;
+        }
+    }
+    spin_unlock(&phase_ctl.lock);
+}
+
+// all of them under phase_ctl.lock
+static void phase_set_running(bool running) {
+    uint64_t now = ktime_get_ns();
+
+    if (phase_ctl.running && !running && phase_ctl.cur >= 0)
+        phase_ctl.phases[phase_ctl.cur].running_ns += now - phase_ctl.since;
+    if (!phase_ctl.running && running)
+        phase_ctl.since = now;
+    WRITE_ONCE(phase_ctl.running, running);
+}
+
+static void phase_close(void) {
+    uint64_t now = ktime_get_ns();
+
+    if (phase_ctl.cur < 0)
+        return;
+    if (phase_ctl.running)
+        phase_ctl.phases[phase_ctl.cur].running_ns += now - phase_ctl.since;
+    phase_ctl.since = now;
+    phase_ctl.phases[phase_ctl.cur].closed = true;
+    phase_ctl.cur = -1;
+}
+
+// the slot taken is the oldest one, closed by now
+static void phase_open(const char *name) {
+    int slot = phase_ctl.nr_phases % PHASE_MAX;
+    phase_t *p = &phase_ctl.phases[slot];
+
+    phase_close();
+    memset(p, 0, sizeof(*p));
+    if (name)
+        strscpy(p->name, name, NVMEMU_PHASE_NAME);
+    else
+        snprintf(p->name, NVMEMU_PHASE_NAME, "phase%llu",
+                 phase_ctl.nr_phases);
+    phase_ctl.cur = slot;
+    phase_ctl.nr_phases++;
+    phase_ctl.since = ktime_get_ns();
+}
+
+static long phase_ioctl(struct file *file, unsigned int cmd,
+                        unsigned long arg) {
+    struct nvmemu_phase phase;
+    int ret = 0;
+
+    if (cmd == NVMEMU_CTL_PHASE) {
+        if (copy_from_user(&phase, (void __user *)arg, sizeof(phase)))
+            return -EFAULT;
+        phase.name[NVMEMU_PHASE_NAME - 1] = '\0';
+        if (!phase.name[0])
+            return -EINVAL;
+    }
+
+    spin_lock(&phase_ctl.lock);
+    switch (cmd) {
+    case NVMEMU_CTL_START:
+        if (phase_ctl.cur < 0)
+            phase_open(NULL);
+        phase_set_running(true);
+        break;
+    case NVMEMU_CTL_PAUSE:
+        phase_set_running(false);
+        break;
+    case NVMEMU_CTL_STOP:
+        phase_set_running(false);
+        phase_close();
+        break;
+    case NVMEMU_CTL_PHASE:
+        phase_open(phase.name);
+        break;
+    default:
+        ret = -ENOTTY;
+    }
+    spin_unlock(&phase_ctl.lock);
+    return ret;
+}
+
+static const struct file_operations phase_fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = phase_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice phase_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = PHASE_DEV,
+    .fops = &phase_fops,
+    .mode = 0600,
+};
+
+static int stats_phases_show(struct seq_file *m, void *v) {
+    uint64_t running_ns, n, first;
+    phase_t *p;
+
+    seq_printf(m, "state %s\n", phase_running() ? "running" : "paused");
+    seq_printf(m, "%-32s %-7s %14s %8s %14s %16s %16s %14s\n", "phase",
+               "state", "running_ns", "ticks", "accesses", "requested_ns",
+               "injected_ns", "paused_acc");
+    spin_lock(&phase_ctl.lock);
+    // oldest first
+    first = phase_ctl.nr_phases > PHASE_MAX ? phase_ctl.nr_phases - PHASE_MAX
+                                            : 0;
+    for (n = first; n < phase_ctl.nr_phases; n++) {
+        p = &phase_ctl.phases[n % PHASE_MAX];
+        running_ns = p->running_ns;
+        if (n % PHASE_MAX == phase_ctl.cur && phase_ctl.running)
+            running_ns += ktime_get_ns() - phase_ctl.since;
+        seq_printf(m, "%-32s %-7s %14llu %8llu %14llu %16llu %16llu %14llu\n",
+                   p->name, p->closed ? "closed" : "open", running_ns,
+                   p->ticks, p->accesses, p->requested, p->injected,
+                   p->paused_accesses);
+    }
+    spin_unlock(&phase_ctl.lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_phases);
+
+int init_phases(bool paused) {
+    memset(&phase_ctl, 0, sizeof(phase_ctl));
+    spin_lock_init(&phase_ctl.lock);
+    phase_ctl.cur = -1;
+    phase_open("default");
+    phase_set_running(!paused);
+
+    if (misc_register(&phase_dev) != 0) {
+        printk(KERN_ERR "Can not register /dev/%s\n", PHASE_DEV);
+        return -ENODEV;
+    }
+    if (stats_dir)
+        debugfs_create_file("phases", 0444, stats_dir, NULL,
+                            &stats_phases_fops);
+    if (paused)
+        printk(KERN_INFO "emulation paused until NVMEMU_CTL_START\n");
+    return 0;
+}
+
+void free_phases(void) {
+    misc_deregister(&phase_dev);
+}
+
+#endif
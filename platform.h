@@ -0,0 +1,382 @@
+#ifndef __PLATFORM__
+#define __PLATFORM__
+
+#include <asm/processor.h>
+
+#include "common.h"
+
+/*
+  Uncore register maps per Xeon generation. Include after large_header.h.
+
+  The box layer was written against the Broadwell (E5/E7 v4) HA. Haswell-EP
+  has the same HA PMON at other PCI device ids; Skylake-SP has no HA at all,
+  its closest box is the M2M in front of every iMC, which counts all reads
+  and writes of the iMC but can not tell local from remote requests or
+  match addresses. init_platform() picks the map of the boot cpu by CPUID
+  family/model, or the one named by the platform parameter, and the box
+  layer reads every offset and delay event from it.
+
+  The boxes are found by PCI device id, so BIOS bus numbering does not
+  matter; socket n is the n-th box in bus order.
+
+  Every map can be checked without the hardware against a simulated
+  register file (platform_selftest). Its write semantics, self-clearing
+  resets and RW1C status, come from uncore.def; freezing, enables and
+  48-bit counter overflow are modelled here.
+*/
+
+#define HSX_HA0_DID                    (0x2f30)
+#define HSX_HA1_DID                    (0x2f38)
+#define BDX_HA0_DID                    (0x6f30)
+#define BDX_HA1_DID                    (0x6f38)
+#define SKX_M2M_DID                    (0x2066)
+
+#define SKX_M2M0_DEVICE                (0x08)
+#define SKX_M2M1_DEVICE                (0x09)
+#define SKX_M2M_FUNCTION               (0x00)
+
+// overflow of HA0/HA1 in U_MSR_PMON_GLOBAL_STATUS, for the uncore PMI
+#define U_MSR_PMON_GLOBAL_STATUS_ov_h0     (1ULL << 21)
+#define U_MSR_PMON_GLOBAL_STATUS_ov_h1     (1ULL << 22)
+
+static const uncore_map_t uncore_map_hsx = {
+    .name = "haswell-ep",
+    .box = UNCORE_HA,
+    .models = { 0x3f },
+    .boxes = {
+        { HSX_HA0_DID, HA_DEVICE, HA0_FUNCTION },
+        { HSX_HA1_DID, HA_DEVICE, HA1_FUNCTION },
+    },
+    .perf_pmu = "uncore_ha_%d",
+    .box_ctl = HA_box_ctl,
+    .box_status = HA_box_status,
+    .ctl = { UNCORE_AT(HA, ctl, 0), UNCORE_AT(HA, ctl, 1),
+             UNCORE_AT(HA, ctl, 2), UNCORE_AT(HA, ctl, 3) },
+    .ctr = { UNCORE_AT(HA, ctr, 0), UNCORE_AT(HA, ctr, 1),
+             UNCORE_AT(HA, ctr, 2), UNCORE_AT(HA, ctr, 3) },
+    .addrmatch0 = HA_addrmatch0,
+    .addrmatch1 = HA_addrmatch1,
+    .opcodematch = HA_opcodematch,
+    .ov_bits = { U_MSR_PMON_GLOBAL_STATUS_ov_h0,
+                 U_MSR_PMON_GLOBAL_STATUS_ov_h1 },
+    .ha_events = true,
+    .clock_ticks = &HA_event_clock_ticks,
+    .remote_reads = &HA_event_remote_reads,
+    .remote_writes = &HA_event_remote_writes,
+    .remote_access = &HA_event_remote_access,
+};
+
+// E5/E7 v4 and Xeon D
+static const uncore_map_t uncore_map_bdx = {
+    .name = "broadwell",
+    .box = UNCORE_HA,
+    .models = { 0x4f, 0x56 },
+    .boxes = {
+        { BDX_HA0_DID, HA_DEVICE, HA0_FUNCTION },
+        { BDX_HA1_DID, HA_DEVICE, HA1_FUNCTION },
+    },
+    .perf_pmu = "uncore_ha_%d",
+    .box_ctl = HA_box_ctl,
+    .box_status = HA_box_status,
+    .ctl = { UNCORE_AT(HA, ctl, 0), UNCORE_AT(HA, ctl, 1),
+             UNCORE_AT(HA, ctl, 2), UNCORE_AT(HA, ctl, 3) },
+    .ctr = { UNCORE_AT(HA, ctr, 0), UNCORE_AT(HA, ctr, 1),
+             UNCORE_AT(HA, ctr, 2), UNCORE_AT(HA, ctr, 3) },
+    .addrmatch0 = HA_addrmatch0,
+    .addrmatch1 = HA_addrmatch1,
+    .opcodematch = HA_opcodematch,
+    .ov_bits = { U_MSR_PMON_GLOBAL_STATUS_ov_h0,
+                 U_MSR_PMON_GLOBAL_STATUS_ov_h1 },
+    .ha_events = true,
+    .clock_ticks = &HA_event_clock_ticks,
+    .remote_reads = &HA_event_remote_reads,
+    .remote_writes = &HA_event_remote_writes,
+    .remote_access = &HA_event_remote_access,
+};
+
+// also Cascade Lake, the M2M has no box status nor PMI routing used here
+static const uncore_map_t uncore_map_skx = {
+    .name = "skylake-sp",
+    .box = UNCORE_M2M,
+    .models = { 0x55 },
+    .boxes = {
+        { SKX_M2M_DID, SKX_M2M0_DEVICE, SKX_M2M_FUNCTION },
+        { SKX_M2M_DID, SKX_M2M1_DEVICE, SKX_M2M_FUNCTION },
+    },
+    .perf_pmu = "uncore_m2m_%d",
+    .box_ctl = M2M_box_ctl,
+    .box_status = 0,
+    .ctl = { UNCORE_AT(M2M, ctl, 0), UNCORE_AT(M2M, ctl, 1),
+             UNCORE_AT(M2M, ctl, 2), UNCORE_AT(M2M, ctl, 3) },
+    .ctr = { UNCORE_AT(M2M, ctr, 0), UNCORE_AT(M2M, ctr, 1),
+             UNCORE_AT(M2M, ctr, 2), UNCORE_AT(M2M, ctr, 3) },
+    .ha_events = false,
+    .clock_ticks = &M2M_event_clock_ticks,
+    .remote_reads = &M2M_event_imc_reads,
+    .remote_writes = &M2M_event_imc_writes,
+    // no single event counts both, reads dominate
+    .remote_access = &M2M_event_imc_reads,
+};
+
+static const uncore_map_t *uncore_maps[] = {
+    &uncore_map_hsx,
+    &uncore_map_bdx,
+    &uncore_map_skx,
+};
+
+#define PCICFG_SIM_DWORDS              (1024)   // 4K extended config space
+
+struct pcicfg_sim {
+    const uncore_map_t *map;
+    uint32_t regs[PCICFG_SIM_DWORDS];
+};
+
+static uint64_t sim_counter(struct pcicfg_sim *sim, int pairnr) {
+    uint32_t where = sim->map->ctr[pairnr] / 4;
+    return ((uint64_t)sim->regs[where + 1] << 32) | sim->regs[where];
+}
+
+static void sim_set_counter(struct pcicfg_sim *sim, int pairnr, uint64_t val) {
+    uint32_t where = sim->map->ctr[pairnr] / 4;
+    val &= HA_PCI_PMON_CTR_MASK;
+    sim->regs[where] = (uint32_t)val;
+    sim->regs[where + 1] = (uint32_t)(val >> 32);
+}
+
+int pcicfg_sim_read_dword(struct pcicfg_sim *sim, int where, uint32_t *val) {
+    if (where < 0 || where >= PCICFG_SIM_DWORDS * 4 || (where & 3))
+        return PCIBIOS_BAD_REGISTER_NUMBER;
+    *val = sim->regs[where / 4];
+    return PCIBIOS_SUCCESSFUL;
+}
+
+/*
+  What a write does comes from uncore_fields, i.e. from uncore.def; the
+  upper dword of a 48-bit counter keeps 16 bits.
+*/
+int pcicfg_sim_write_dword(struct pcicfg_sim *sim, int where, uint32_t val) {
+    const uncore_map_t *map = sim->map;
+    const uncore_field_t *f;
+    uint32_t old, bits;
+    int i, j;
+
+    if (where < 0 || where >= PCICFG_SIM_DWORDS * 4 || (where & 3))
+        return PCIBIOS_BAD_REGISTER_NUMBER;
+
+    old = sim->regs[where / 4];
+    for (f = uncore_fields; f < uncore_fields + ARRAY_SIZE(uncore_fields); f++) {
+        if (f->box != map->box || where < f->offset)
+            continue;
+        i = f->stride ? (where - f->offset) / f->stride : 0;
+        if (i >= f->count || where != f->offset + i * f->stride)
+            continue;
+
+        bits = val & f->mask;
+        switch (f->kind) {
+        case UF_RW:
+            break;
+        case UF_W1C:
+            val = (val & ~f->mask) | (old & f->mask & ~bits);
+            break;
+        case UF_RST_CTR:
+            if (bits)
+                sim_set_counter(sim, i, 0);
+            val &= ~f->mask;
+            break;
+        case UF_RST_CTRS:
+            for (j = 0; j < 4 && bits; j++)
+                sim_set_counter(sim, j, 0);
+            val &= ~f->mask;
+            break;
+        case UF_RST_CTLS:
+            for (j = 0; j < 4 && bits; j++)
+                sim->regs[map->ctl[j] / 4] = 0;
+            val &= ~f->mask;
+            break;
+        }
+    }
+    for (i = 0; i < 4; i++)
+        if (where == map->ctr[i] + 4)
+            val &= (uint32_t)(HA_PCI_PMON_CTR_MASK >> 32);
+    sim->regs[where / 4] = val;
+    return PCIBIOS_SUCCESSFUL;
+}
+
+// @n events happen on pair @pairnr, the box layer uses the HA bits on all boxes
+static void sim_count(struct pcicfg_sim *sim, int pairnr, uint64_t n) {
+    const uncore_map_t *map = sim->map;
+    uint64_t before, after;
+
+    if ((sim->regs[map->box_ctl / 4] & HA_box_ctl_frz_mask) ||
+        !(sim->regs[map->ctl[pairnr] / 4] & HA_ctl_en_mask))
+        return;
+    before = sim_counter(sim, pairnr);
+    after = (before + n) & HA_PCI_PMON_CTR_MASK;
+    sim_set_counter(sim, pairnr, after);
+    if (after < before && map->box_status &&
+        (sim->regs[map->ctl[pairnr] / 4] & HA_ctl_ov_en_mask))
+        sim->regs[map->box_status / 4] |= 1 << pairnr;
+}
+
+#define SIM_CHECK(cond)                                                 \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            printk(KERN_ERR "%s map: %s failed\n", map->name, #cond);   \
+            goto out;                                                   \
+        }                                                               \
+    } while (0)
+
+// drive the box layer with @map over a simulated register file
+static int platform_check_map(const uncore_map_t *map) {
+    const uncore_map_t *saved = uncore_map;
+    pair_t saved_pairs[4];
+    struct pcicfg_sim *sim;
+    HABox_t *habox = NULL;
+    const event_t *ev = map->remote_reads;
+    uint64_t val;
+    uint32_t opc;
+    int i, j, ret = -1;
+
+    // no side effects on the box state, whatever was set before
+    memcpy(saved_pairs, HA_pairs, sizeof(saved_pairs));
+    sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+    if (!sim)
+        return -ENOMEM;
+    sim->map = map;
+    HA_set_map(map);
+
+    // no register of a pair overlaps another one
+    for (i = 0; i < 4; i++) {
+        SIM_CHECK(map->ctl[i] % 4 == 0 && map->ctr[i] % 8 == 0);
+        SIM_CHECK(map->ctl[i] != map->box_ctl && map->ctl[i] != map->box_status);
+        for (j = 0; j < 4; j++) {
+            SIM_CHECK(i == j || map->ctl[i] != map->ctl[j]);
+            SIM_CHECK(map->ctl[j] < map->ctr[i] ||
+                      map->ctl[j] >= map->ctr[i] + 8);
+        }
+    }
+    habox = get_HAbox_sim(sim, map);
+    SIM_CHECK(habox != NULL);
+
+    SIM_CHECK(HA_box_freeze(habox) == 0);
+    SIM_CHECK(sim->regs[map->box_ctl / 4] & HA_box_ctl_frz_mask);
+    for (i = 0; i < 4; i++) {
+        SIM_CHECK(HA_choose_event(habox, i, ev) == 0);
+        SIM_CHECK((sim->regs[map->ctl[i] / 4] & 0xffff) ==
+                  (((uint32_t)ev->umask << 8) | ev->event_code));
+        SIM_CHECK(HA_enable(habox, i) == 0);
+
+        // frozen, nothing is counted
+        sim_count(sim, i, 7);
+        SIM_CHECK(HA_read_counter(habox, i, &val) == 0 && val == 0);
+        SIM_CHECK(HA_box_unfreeze(habox) == 0);
+        sim_count(sim, i, 1000 + i);
+        SIM_CHECK(HA_box_freeze(habox) == 0);
+        SIM_CHECK(HA_read_counter(habox, i, &val) == 0 && val == 1000 + i);
+
+        SIM_CHECK(HA_reset_ctr(habox, i) == 0);
+        SIM_CHECK(HA_read_counter(habox, i, &val) == 0 && val == 0);
+        SIM_CHECK(!(sim->regs[map->ctl[i] / 4] & HA_ctl_rst_mask));
+
+        // the tickless preload wraps after 10 events
+        SIM_CHECK(HA_write_counter(habox, i, (1ULL << 48) - 10) == 0);
+        SIM_CHECK(HA_enable_overflow(habox, i) == 0);
+        SIM_CHECK(HA_box_unfreeze(habox) == 0);
+        sim_count(sim, i, 15);
+        SIM_CHECK(HA_box_freeze(habox) == 0);
+        SIM_CHECK(HA_read_counter(habox, i, &val) == 0 && val == 5);
+        if (map->box_status) {
+            SIM_CHECK(sim->regs[map->box_status / 4] & (1 << i));
+            SIM_CHECK(HA_box_clear_overflow(habox) == 0);
+            SIM_CHECK(sim->regs[map->box_status / 4] == 0);
+        }
+        SIM_CHECK(HA_disable_overflow(habox, i) == 0);
+        SIM_CHECK(HA_disable(habox, i) == 0);
+        SIM_CHECK(!(sim->regs[map->ctl[i] / 4] &
+                    (HA_ctl_en_mask | HA_ctl_ov_en_mask)));
+    }
+
+    SIM_CHECK(HA_box_reset_ctrs(habox) == 0);
+    SIM_CHECK(HA_box_reset_ctls(habox) == 0);
+    for (i = 0; i < 4; i++) {
+        SIM_CHECK(sim_counter(sim, i) == 0);
+        SIM_CHECK(sim->regs[map->ctl[i] / 4] == 0);
+    }
+
+    if (map->addrmatch0) {
+        SIM_CHECK(HA_set_addr_match(habox, 0x123456789000ULL) == 0);
+        SIM_CHECK(sim->regs[map->addrmatch0 / 4] == 0x56789000);
+        SIM_CHECK(sim->regs[map->addrmatch1 / 4] == 0x1234);
+        SIM_CHECK(HA_set_opcode_match(habox, 0x2a) == 0);
+        SIM_CHECK(pcicfg_sim_read_dword(sim, map->opcodematch, &opc) == 0 &&
+                  (opc & HA_opcodematch_opc_mask) == 0x2a);
+    } else {
+        SIM_CHECK(HA_set_addr_match(habox, 0x1000) != 0);
+    }
+    ret = 0;
+
+out:
+    if (habox)
+        free_HAbox(habox);
+    kfree(sim);
+    memcpy(HA_pairs, saved_pairs, sizeof(saved_pairs));
+    uncore_map = saved;
+    return ret;
+}
+
+int platform_selftest(void) {
+    int i, failed = 0;
+
+    for (i = 0; i < ARRAY_SIZE(uncore_maps); i++) {
+        if (platform_check_map(uncore_maps[i]) != 0)
+            failed++;
+        else
+            printk(KERN_INFO "%s map passed\n", uncore_maps[i]->name);
+    }
+    return failed ? -EIO : 0;
+}
+
+static const uncore_map_t *detect_platform(void) {
+    struct cpuinfo_x86 *c = &boot_cpu_data;
+    int i, j;
+
+    if (c->x86_vendor != X86_VENDOR_INTEL || c->x86 != 6)
+        return NULL;
+    for (i = 0; i < ARRAY_SIZE(uncore_maps); i++)
+        for (j = 0; j < ARRAY_SIZE(uncore_maps[i]->models); j++)
+            if (uncore_maps[i]->models[j] &&
+                uncore_maps[i]->models[j] == c->x86_model)
+                return uncore_maps[i];
+    return NULL;
+}
+
+// @name overrides the detection, NULL to detect
+int init_platform(const char *name, bool selftest) {
+    const uncore_map_t *map = NULL;
+    int i;
+
+    if (selftest && platform_selftest() != 0) {
+        printk(KERN_ERR "uncore register maps failed the self test\n");
+        return -EIO;
+    }
+
+    if (name) {
+        for (i = 0; i < ARRAY_SIZE(uncore_maps); i++)
+            if (strcmp(uncore_maps[i]->name, name) == 0)
+                map = uncore_maps[i];
+        if (!map) {
+            printk(KERN_ERR "unknown platform %s\n", name);
+            return -EINVAL;
+        }
+    } else if (!(map = detect_platform())) {
+        printk(KERN_ERR "no uncore register map for cpu family %d model 0x%x\n",
+               boot_cpu_data.x86, boot_cpu_data.x86_model);
+        return -ENODEV;
+    }
+
+    HA_set_map(map);
+    printk(KERN_INFO "%s uncore\n", map->name);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef __PMEM_DEV__
+#define __PMEM_DEV__
+
+#include <linux/atomic.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/huge_mm.h>
+#include <linux/ioport.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
+
+#include "common.h"
+#include "emulator_uapi.h"
+
+/*
+  Emulated persistent memory, /dev/nvmemu_pmem. Include after phase.h.
+
+  The device is backed by a physical range hidden from the kernel at boot
+  (memmap=<size>$<start>), so it has no struct pages and is mapped like DAX:
+  page table entries point straight at the range, with 2M entries whenever
+  the mapping is aligned. Nothing is copied and the page cache is never
+  involved, so clwb/sfence in userspace act on the range itself.
+
+  Persistence is emulated by charging write-back latency per cache line:
+  - NVMEMU_PMEM_FLUSH charges the lines of a range, for code that knows what
+    it flushed;
+  - NVMEMU_PMEM_FENCE charges every line written since the last fence, the
+    count comes from the write counter the emulator samples every tick.
+  The write counter is the HA's, so a fence charges the remote writes of
+  the whole socket, not only those of the caller or of the device: whoever
+  fences first pays for the writes of everyone since the previous fence.
+  Lines a FLUSH charged are taken off the lines owed, the counter sees
+  them again when they are written back, so clwb of a range followed by
+  sfence pays once.
+
+  The caller spins for the charge before the ioctl returns, at most
+  PMEM_MAX_STALL per call; the rest is carried to the next fence. The
+  lines owed, and the credit of flushed lines not yet counted, are capped
+  at one PMEM_MAX_STALL worth, so background traffic costs a fence at most
+  that and the excess is dropped. Nothing is charged while the emulation
+  is paused (phase.h).
+*/
+
+#define PMEM_DEV                     "nvmemu_pmem"
+#define PMEM_LINE                    (64)
+#define PMEM_MAX_STALL               (10 * NSEC_PER_MSEC)
+
+typedef struct {
+    uint64_t start;             // physical
+    uint64_t size;
+    uint64_t flush_latency;     // ns per written back line
+    spinlock_t lock;            // pending and dropped
+    int64_t pending;            // lines owed at the next fence, < 0 credit
+    uint64_t dropped;           // lines beyond the cap
+    atomic64_t flushes;
+    atomic64_t fences;
+    atomic64_t stalled;         // ns
+    struct resource *res;
+} pmem_dev_t;
+
+static pmem_dev_t pmem;
+
+// lines one call can be charged for
+static int64_t pmem_max_lines(void) {
+    return pmem.flush_latency ? PMEM_MAX_STALL / pmem.flush_latency : 0;
+}
+
+// @lines owed at the next fence, negative for a credit, capped both ways
+static void pmem_owe(int64_t lines) {
+    int64_t max = pmem_max_lines();
+
+    spin_lock(&pmem.lock);
+    pmem.pending += lines;
+    if (pmem.pending > max) {
+        pmem.dropped += pmem.pending - max;
+        pmem.pending = max;
+    } else if (pmem.pending < -max) {
+        pmem.pending = -max;
+    }
+    spin_unlock(&pmem.lock);
+}
+
+// the lines owed, a credit stays
+static uint64_t pmem_take(void) {
+    int64_t lines;
+
+    spin_lock(&pmem.lock);
+    lines = max_t(int64_t, pmem.pending, 0);
+    pmem.pending -= lines;
+    spin_unlock(&pmem.lock);
+    return lines;
+}
+
+// called by the sampler with the write delta of every tick
+void pmem_account_writes(uint64_t lines) {
+    // writes of a pause are not owed by the next fence
+    if (pmem.res && phase_running())
+        pmem_owe(lines);
+}
+
+// spin for up to PMEM_MAX_STALL worth of @lines, returns the lines charged
+static uint64_t pmem_stall(uint64_t lines) {
+    uint64_t start = ktime_get_ns(), ns;
+
+    if (!phase_running())
+        return 0;
+    lines = min_t(uint64_t, lines, pmem_max_lines());
+    ns = lines * pmem.flush_latency;
+    while (ktime_get_ns() - start < ns)
+        cpu_relax();
+    atomic64_add(ns, &pmem.stalled);
+    return lines;
+}
+
+static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct nvmemu_flush flush;
+    uint64_t first, last, lines, charged;
+
+    switch (cmd) {
+    case NVMEMU_PMEM_FLUSH:
+        if (copy_from_user(&flush, (void __user *)arg, sizeof(flush)))
+            return -EFAULT;
+        if (!flush.len || flush.offset >= pmem.size ||
+            flush.len > pmem.size - flush.offset)
+            return -EINVAL;
+        first = flush.offset / PMEM_LINE;
+        last = (flush.offset + flush.len - 1) / PMEM_LINE;
+        atomic64_inc(&pmem.flushes);
+        lines = last - first + 1;
+        charged = pmem_stall(lines);
+        // counted again as writes, the uncharged rest is owed at the fence
+        if (charged)
+            pmem_owe(-(int64_t)charged);
+        return 0;
+    case NVMEMU_PMEM_FENCE:
+        atomic64_inc(&pmem.fences);
+        lines = pmem_take();
+        charged = pmem_stall(lines);
+        if (lines > charged)
+            pmem_owe(lines - charged);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static vm_fault_t pmem_insert(struct vm_fault *vmf, unsigned int order) {
+    struct vm_area_struct *vma = vmf->vma;
+    unsigned long size = PAGE_SIZE << order;
+    unsigned long addr = vmf->address & ~(size - 1);
+    uint64_t offset = ((uint64_t)vma->vm_pgoff << PAGE_SHIFT) +
+                      (addr - vma->vm_start);
+
+    if (addr < vma->vm_start || addr + size > vma->vm_end ||
+        offset + size > pmem.size)
+        return order ? VM_FAULT_FALLBACK : VM_FAULT_SIGBUS;
+
+    if (order == PMD_ORDER) {
+        // the physical address must be 2M aligned as well
+        if (!IS_ALIGNED(pmem.start + offset, PMD_SIZE))
+            return VM_FAULT_FALLBACK;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+        return vmf_insert_pfn_pmd(vmf, PHYS_PFN(pmem.start + offset),
+                                  vmf->flags & FAULT_FLAG_WRITE);
+#else
+        return vmf_insert_pfn_pmd(vmf, phys_to_pfn_t(pmem.start + offset,
+                                                     PFN_DEV),
+                                  vmf->flags & FAULT_FLAG_WRITE);
+#endif
+    }
+    if (order)
+        return VM_FAULT_FALLBACK;
+    return vmf_insert_pfn(vma, addr, PHYS_PFN(pmem.start + offset));
+}
+
+static vm_fault_t pmem_fault(struct vm_fault *vmf) {
+    return pmem_insert(vmf, 0);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static vm_fault_t pmem_huge_fault(struct vm_fault *vmf, unsigned int order) {
+    return pmem_insert(vmf, order);
+}
+#else
+static vm_fault_t pmem_huge_fault(struct vm_fault *vmf,
+                                  enum page_entry_size pe_size) {
+    if (pe_size == PE_SIZE_PTE)
+        return pmem_insert(vmf, 0);
+    if (pe_size == PE_SIZE_PMD)
+        return pmem_insert(vmf, PMD_ORDER);
+    return VM_FAULT_FALLBACK;
+}
+#endif
+
+static const struct vm_operations_struct pmem_vm_ops = {
+    .fault = pmem_fault,
+    .huge_fault = pmem_huge_fault,
+};
+
+static int pmem_mmap(struct file *file, struct vm_area_struct *vma) {
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    vm_flags_set(vma, VM_PFNMAP | VM_HUGEPAGE | VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_ops = &pmem_vm_ops;
+    return 0;
+}
+
+static const struct file_operations pmem_fops = {
+    .owner = THIS_MODULE,
+    .mmap = pmem_mmap,
+    // hand out 2M aligned addresses so that huge entries can be used
+    .get_unmapped_area = thp_get_unmapped_area,
+    .unlocked_ioctl = pmem_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice pmem_misc = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = PMEM_DEV,
+    .fops = &pmem_fops,
+    .mode = 0600,
+};
+
+static int stats_pmem_show(struct seq_file *m, void *v) {
+    seq_printf(m, "region          %llx+%llx\n", pmem.start, pmem.size);
+    seq_printf(m, "flush_latency   %llu\n", pmem.flush_latency);
+    seq_printf(m, "pending_lines   %lld\n", READ_ONCE(pmem.pending));
+    seq_printf(m, "dropped_lines   %llu\n", READ_ONCE(pmem.dropped));
+    seq_printf(m, "flushes         %lld\n", atomic64_read(&pmem.flushes));
+    seq_printf(m, "fences          %lld\n", atomic64_read(&pmem.fences));
+    seq_printf(m, "stalled_ns      %lld\n", atomic64_read(&pmem.stalled));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_pmem);
+
+// @start and @size must be page aligned, 2M alignment enables huge mappings
+int init_pmem_dev(uint64_t start, uint64_t size, uint64_t flush_latency) {
+    if (!size || !PAGE_ALIGNED(start) || !PAGE_ALIGNED(size)) {
+        printk(KERN_ERR "pmem range %llx+%llx is not page aligned\n",
+               start, size);
+        return -EINVAL;
+    }
+
+    // System RAM would be handed out twice
+    if (region_intersects(start, size, IORESOURCE_SYSTEM_RAM,
+                          IORES_DESC_NONE) != REGION_DISJOINT) {
+        printk(KERN_ERR "pmem range %llx+%llx overlaps System RAM, reserve "
+               "it with memmap=\n", start, size);
+        return -EINVAL;
+    }
+
+    pmem.res = request_mem_region(start, size, PMEM_DEV);
+    if (!pmem.res) {
+        printk(KERN_ERR "pmem range %llx+%llx is busy\n", start, size);
+        return -EBUSY;
+    }
+    pmem.start = start;
+    pmem.size = size;
+    pmem.flush_latency = flush_latency;
+    spin_lock_init(&pmem.lock);
+    pmem.pending = 0;
+    pmem.dropped = 0;
+
+    if (misc_register(&pmem_misc) != 0) {
+        printk(KERN_ERR "Can not register /dev/%s\n", PMEM_DEV);
+        release_mem_region(start, size);
+        pmem.res = NULL;
+        return -ENODEV;
+    }
+
+    if (stats_dir)
+        debugfs_create_file("pmem", 0444, stats_dir, NULL, &stats_pmem_fops);
+    printk(KERN_INFO "pmem %llx+%llx, %llu ns per flushed line\n",
+           start, size, flush_latency);
+    return 0;
+}
+
+void free_pmem_dev(void) {
+    if (!pmem.res)
+        return;
+    misc_deregister(&pmem_misc);
+    release_mem_region(pmem.start, pmem.size);
+    pmem.res = NULL;
+}
+
+#endif
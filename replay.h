@@ -0,0 +1,179 @@
+#ifndef __REPLAY__
+#define __REPLAY__
+
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/kfifo.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+
+#include "common.h"
+#include "emulator_uapi.h"
+
+/*
+  Replay source, /dev/nvmemu_replay.
+
+  Instead of reading the HA counters, the sampler takes its counter deltas
+  from a trace recorded on another host: sample_t records as they come out of
+  /dev/nvmemu_samples, written to the device in timestamp order. Every record
+  is one tick, fed through the same latency model, wear accounting and delay
+  injection as a live tick. A record stamped T(k) counts the accesses of
+  (T(k-1), T(k)], so it is held back until T(k) - T(k-1) after the previous
+  record was applied and only then injected; the victim sees the recorded
+  access pattern at the recorded pace. Gaps are capped at REPLAY_MAX_GAP,
+  and a record that arrives late is applied at once.
+
+  Records are queued in a fifo of replay_records entries; write() blocks
+  while it is full (or fails with EAGAIN for O_NONBLOCK), so a trace of any
+  length can be streamed, e.g.
+      cat trace.bin > /dev/nvmemu_replay
+*/
+
+#define REPLAY_DEV                   "nvmemu_replay"
+#define REPLAY_MAX_GAP               (NSEC_PER_SEC)
+
+typedef struct {
+    DECLARE_KFIFO_PTR(fifo, sample_t);
+    struct mutex lock;            // writers
+    wait_queue_head_t writable;
+    wait_queue_head_t readable;
+    uint64_t last_timestamp;      // recorded time of the previous record
+    uint64_t last_applied;        // ns, when the previous record was taken
+    atomic64_t replayed;
+    bool registered;
+} replay_t;
+
+static replay_t replay;
+
+static ssize_t replay_write(struct file *file, const char __user *buf,
+                            size_t len, loff_t *ppos) {
+    unsigned int copied;
+    ssize_t done = 0;
+    int err;
+
+    if (len % sizeof(sample_t))
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&replay.lock))
+        return -ERESTARTSYS;
+    while (done < len) {
+        if (kfifo_is_full(&replay.fifo)) {
+            if (done || (file->f_flags & O_NONBLOCK))
+                break;
+            mutex_unlock(&replay.lock);
+            if (wait_event_interruptible(replay.writable,
+                                         !kfifo_is_full(&replay.fifo)))
+                return -ERESTARTSYS;
+            if (mutex_lock_interruptible(&replay.lock))
+                return -ERESTARTSYS;
+            continue;
+        }
+        // only whole records, a partial copy is left for the next round
+        err = kfifo_from_user(&replay.fifo, buf + done,
+                              min_t(size_t, len - done,
+                                    kfifo_avail(&replay.fifo) * sizeof(sample_t)),
+                              &copied);
+        if (err) {
+            mutex_unlock(&replay.lock);
+            return done ? done : err;
+        }
+        done += copied;
+        wake_up_interruptible(&replay.readable);
+    }
+    mutex_unlock(&replay.lock);
+    return done ? done : -EAGAIN;
+}
+
+static const struct file_operations replay_fops = {
+    .owner = THIS_MODULE,
+    .write = replay_write,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice replay_misc = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = REPLAY_DEV,
+    .fops = &replay_fops,
+    .mode = 0600,
+};
+
+/*
+  Take the next record, waiting up to @timeout jiffies for one, and then
+  until its recorded gap since the previous record has passed, so it is
+  applied at the end of the interval it counts. Only the sampler calls this.
+*/
+int replay_next(sample_t *sample, long timeout) {
+    uint64_t gap = 0, due, now;
+
+    if (!wait_event_interruptible_timeout(replay.readable,
+                                          !kfifo_is_empty(&replay.fifo),
+                                          timeout))
+        return -EAGAIN;
+    if (!kfifo_get(&replay.fifo, sample))
+        return -EAGAIN;
+    wake_up_interruptible(&replay.writable);
+
+    if (replay.last_timestamp && sample->timestamp > replay.last_timestamp)
+        gap = min_t(uint64_t, sample->timestamp - replay.last_timestamp,
+                    REPLAY_MAX_GAP);
+    replay.last_timestamp = sample->timestamp;
+
+    due = replay.last_applied + gap;
+    now = ktime_get_ns();
+    if (replay.last_applied && due > now) {
+        if (due - now >= NSEC_PER_USEC)
+            usleep_range((due - now) / NSEC_PER_USEC,
+                         (due - now) / NSEC_PER_USEC + 50);
+        // the next gap counts from the recorded pace, not from the wakeup
+        now = due;
+    }
+    replay.last_applied = now;
+    atomic64_inc(&replay.replayed);
+    return 0;
+}
+
+static int stats_replay_show(struct seq_file *m, void *v) {
+    seq_printf(m, "queued          %u\n", kfifo_len(&replay.fifo));
+    seq_printf(m, "replayed        %lld\n", atomic64_read(&replay.replayed));
+    seq_printf(m, "last_timestamp  %llu\n", replay.last_timestamp);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_replay);
+
+// @records is rounded up to a power of two
+int init_replay(unsigned long records) {
+    if (kfifo_alloc(&replay.fifo, records, GFP_KERNEL) != 0) {
+        printk(KERN_ERR "Can not allocate %lu replay records\n", records);
+        return -ENOMEM;
+    }
+    mutex_init(&replay.lock);
+    init_waitqueue_head(&replay.writable);
+    init_waitqueue_head(&replay.readable);
+    replay.last_timestamp = 0;
+    replay.last_applied = 0;
+    atomic64_set(&replay.replayed, 0);
+
+    if (misc_register(&replay_misc) != 0) {
+        printk(KERN_ERR "Can not register /dev/%s\n", REPLAY_DEV);
+        kfifo_free(&replay.fifo);
+        return -ENODEV;
+    }
+    replay.registered = true;
+
+    if (stats_dir)
+        debugfs_create_file("replay", 0444, stats_dir, NULL, &stats_replay_fops);
+    printk(KERN_INFO "replaying counters written to /dev/%s\n", REPLAY_DEV);
+    return 0;
+}
+
+void free_replay(void) {
+    if (!replay.registered)
+        return;
+    misc_deregister(&replay_misc);
+    kfifo_free(&replay.fifo);
+    replay.registered = false;
+}
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef __SAMPLE_RING__
+#define __SAMPLE_RING__
+
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+
+#include "common.h"
+#include "emulator_uapi.h"
+
+/*
+  Per-cpu ring buffers of sampling records, see emulator_uapi.h for the layout
+  seen by userspace.
+  Each ring has exactly one producer, the cpu owning it, and writers run with
+  preemption disabled, so no lock is needed: the producer publishes a record
+  by a release store to data_head, the consumer frees space by storing
+  data_tail.
+*/
+
+#define SAMPLE_RING_DEV             "nvmemu_samples"
+
+typedef struct {
+    sample_ring_page_t *page;     // control page followed by data pages
+    uint8_t *data;
+    uint64_t mask;                // data_size - 1
+    unsigned long size;           // bytes of the whole vmalloc area
+} sample_ring_t;
+
+static DEFINE_PER_CPU(sample_ring_t, sample_rings);
+static unsigned long sample_ring_data_pages;
+
+int sample_ring_write(const sample_t *sample) {
+    sample_ring_t *ring = get_cpu_ptr(&sample_rings);
+    sample_ring_page_t *page = ring->page;
+    uint64_t head, tail;
+
+    if (!page) {
+        put_cpu_ptr(&sample_rings);
+        return -1;
+    }
+
+    head = page->data_head;
+    tail = smp_load_acquire(&page->data_tail);
+    if (head - tail + sizeof(sample_t) > ring->mask + 1) {
+        page->lost++;
+        put_cpu_ptr(&sample_rings);
+        return -1;
+    }
+
+    memcpy(ring->data + (head & ring->mask), sample, sizeof(sample_t));
+    smp_store_release(&page->data_head, head + sizeof(sample_t));
+    put_cpu_ptr(&sample_rings);
+    return 0;
+}
+
+static int sample_ring_mmap(struct file *file, struct vm_area_struct *vma) {
+    unsigned long pages_per_ring = 1 + sample_ring_data_pages;
+    unsigned long cpu = vma->vm_pgoff / pages_per_ring;
+    sample_ring_t *ring;
+
+    if (vma->vm_pgoff % pages_per_ring != 0 || cpu >= nr_cpu_ids ||
+        !cpu_possible(cpu))
+        return -EINVAL;
+
+    ring = per_cpu_ptr(&sample_rings, cpu);
+    if (!ring->page || vma->vm_end - vma->vm_start != ring->size)
+        return -EINVAL;
+
+    // userspace has to write data_tail back, so the ring must be shared
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    return remap_vmalloc_range(vma, ring->page, 0);
+}
+
+static const struct file_operations sample_ring_fops = {
+    .owner = THIS_MODULE,
+    .mmap = sample_ring_mmap,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice sample_ring_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = SAMPLE_RING_DEV,
+    .fops = &sample_ring_fops,
+    .mode = 0600,
+};
+
+static void __free_sample_rings(void) {
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        sample_ring_t *ring = per_cpu_ptr(&sample_rings, cpu);
+        vfree(ring->page);
+        ring->page = NULL;
+        ring->data = NULL;
+    }
+}
+
+// @data_pages must be a power of two
+int init_sample_rings(unsigned long data_pages) {
+    int cpu;
+    if (!data_pages || !is_power_of_2(data_pages)) {
+        printk(KERN_ERR "ring pages %lu is not a power of two\n", data_pages);
+        return -EINVAL;
+    }
+    sample_ring_data_pages = data_pages;
+
+    for_each_possible_cpu(cpu) {
+        sample_ring_t *ring = per_cpu_ptr(&sample_rings, cpu);
+        ring->size = (1 + data_pages) * PAGE_SIZE;
+        ring->page = vmalloc_user(ring->size);
+        if (!ring->page) {
+            printk(KERN_ERR "No memory for sample ring of cpu %d\n", cpu);
+            __free_sample_rings();
+            return -ENOMEM;
+        }
+        ring->data = (uint8_t *)ring->page + PAGE_SIZE;
+        ring->mask = data_pages * PAGE_SIZE - 1;
+        ring->page->version = SAMPLE_RING_VERSION;
+        ring->page->record_size = sizeof(sample_t);
+        ring->page->data_offset = PAGE_SIZE;
+        ring->page->data_size = data_pages * PAGE_SIZE;
+    }
+
+    if (misc_register(&sample_ring_dev) != 0) {
+        printk(KERN_ERR "Can not register /dev/%s\n", SAMPLE_RING_DEV);
+        __free_sample_rings();
+        return -ENODEV;
+    }
+    return 0;
+}
+
+void free_sample_rings(void) {
+    misc_deregister(&sample_ring_dev);
+    __free_sample_rings();
+}
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef __EMU_STATS__
+#define __EMU_STATS__
+
+#include <linux/debugfs.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+
+#include "common.h"
+
+/*
+  Health statistics of the emulator, exported under
+  /sys/kernel/debug/nvmemu/.
+  All statistics are per-cpu and only updated with this_cpu_*() operations, so
+  writers never take a lock. Readers sum up all cpus, a reading may be
+  slightly stale but never blocks the sampler.
+
+  Histograms are log2 bucketed: value v falls into bucket fls64(v), i.e.
+  bucket b counts values in [2^(b-1), 2^b).
+*/
+
+#define STATS_DIR                    "nvmemu"
+#define STATS_SOCKETS                (2)
+#define STATS_BOXES                  (2)
+#define STATS_PAIRS                  (4)
+#define HIST_BUCKETS                 (65)
+
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+typedef struct {
+    hist_t tick;                 // sampler tick duration, ns
+    hist_t cfg;                  // config space access latency, ns
+    uint64_t accesses[STATS_SOCKETS][STATS_BOXES][STATS_PAIRS];
+    uint64_t delay_requested;    // ns
+    uint64_t delay_injected;     // ns
+    uint64_t ipi_failures;
+    uint64_t ticks;
+} emu_stats_t;
+
+static DEFINE_PER_CPU(emu_stats_t, emu_stats);
+static const char *stats_events[STATS_SOCKETS][STATS_BOXES][STATS_PAIRS];
+static struct dentry *stats_dir;
+
+#define stats_hist_add(hist, v) \
+    this_cpu_inc(emu_stats.hist.buckets[fls64(v)])
+
+void stats_set_event(int socket, int box, int pair, const char *name) {
+    if (socket < 0 || socket >= STATS_SOCKETS || box < 0 ||
+        box >= STATS_BOXES || pair < 0 || pair >= STATS_PAIRS)
+        return;
+    stats_events[socket][box][pair] = name;
+}
+
+void stats_add_accesses(int socket, int box, int pair, uint64_t n) {
+    if (socket < 0 || socket >= STATS_SOCKETS || box < 0 ||
+        box >= STATS_BOXES || pair < 0 || pair >= STATS_PAIRS)
+        return;
+    this_cpu_add(emu_stats.accesses[socket][box][pair], n);
+}
+
+void stats_add_delay(uint64_t requested, uint64_t injected) {
+    this_cpu_add(emu_stats.delay_requested, requested);
+    this_cpu_add(emu_stats.delay_injected, injected);
+}
+
+void stats_ipi_failed(void) {
+    this_cpu_inc(emu_stats.ipi_failures);
+}
+
+void stats_tick(uint64_t ns) {
+    this_cpu_inc(emu_stats.ticks);
+    stats_hist_add(tick, ns);
+}
+
+// declared in common.h, called by the pcicfg layer
+void account_cfg_access(uint64_t ns) {
+    stats_hist_add(cfg, ns);
+}
+
+#define stats_sum(field) ({                                 \
+    uint64_t __sum = 0;                                     \
+    int __cpu;                                              \
+    for_each_possible_cpu(__cpu)                            \
+        __sum += per_cpu(emu_stats.field, __cpu);           \
+    __sum;                                                  \
+})
+
+static uint64_t hist_bucket_upper(int b) {
+    if (b == 0)
+        return 1;
+    return b < 64 ? 1ULL << b : U64_MAX;
+}
+
+static void stats_show_hist(struct seq_file *m, size_t offset) {
+    static const int permille[] = { 500, 900, 990, 999 };
+    uint64_t buckets[HIST_BUCKETS] = { 0 };
+    uint64_t total = 0, seen = 0;
+    int cpu, b, p = 0;
+
+    for_each_possible_cpu(cpu) {
+        hist_t *hist = (hist_t *)((char *)per_cpu_ptr(&emu_stats, cpu) + offset);
+        for (b = 0; b < HIST_BUCKETS; b++)
+            buckets[b] += READ_ONCE(hist->buckets[b]);
+    }
+    for (b = 0; b < HIST_BUCKETS; b++)
+        total += buckets[b];
+
+    seq_printf(m, "count %llu\n", total);
+    // a percentile is reported as the upper bound of its bucket
+    for (b = 0; b < HIST_BUCKETS && total && p < ARRAY_SIZE(permille); b++) {
+        seen += buckets[b];
+        while (p < ARRAY_SIZE(permille) && seen * 1000 >= total * permille[p]) {
+            seq_printf(m, "p%-4d < %llu ns\n", permille[p],
+                       hist_bucket_upper(b));
+            p++;
+        }
+    }
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        if (buckets[b])
+            seq_printf(m, "[%llu, %llu) %llu\n",
+                       b ? 1ULL << (b - 1) : 0ULL,
+                       hist_bucket_upper(b), buckets[b]);
+    }
+}
+
+static int stats_tick_latency_show(struct seq_file *m, void *v) {
+    stats_show_hist(m, offsetof(emu_stats_t, tick));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_tick_latency);
+
+static int stats_cfg_latency_show(struct seq_file *m, void *v) {
+    stats_show_hist(m, offsetof(emu_stats_t, cfg));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_cfg_latency);
+
+static int stats_accesses_show(struct seq_file *m, void *v) {
+    int s, b, p;
+    for (s = 0; s < STATS_SOCKETS; s++)
+        for (b = 0; b < STATS_BOXES; b++)
+            for (p = 0; p < STATS_PAIRS; p++) {
+                if (!stats_events[s][b][p])
+                    continue;
+                seq_printf(m, "socket %d HA%d pair %d %-16s %llu\n", s, b, p,
+                           stats_events[s][b][p],
+                           stats_sum(accesses[s][b][p]));
+            }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_accesses);
+
+static int stats_delay_show(struct seq_file *m, void *v) {
+    uint64_t requested = stats_sum(delay_requested);
+    uint64_t injected = stats_sum(delay_injected);
+
+    seq_printf(m, "ticks           %llu\n", stats_sum(ticks));
+    seq_printf(m, "requested_ns    %llu\n", requested);
+    seq_printf(m, "injected_ns     %llu\n", injected);
+    seq_printf(m, "backlog_ns      %llu\n",
+               requested > injected ? requested - injected : 0);
+    seq_printf(m, "ipi_failures    %llu\n", stats_sum(ipi_failures));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_delay);
+
+int init_stats(void) {
+    stats_dir = debugfs_create_dir(STATS_DIR, NULL);
+    if (IS_ERR_OR_NULL(stats_dir)) {
+        printk(KERN_WARNING "debugfs not available, no statistics\n");
+        stats_dir = NULL;
+        return -1;
+    }
+    debugfs_create_file("accesses", 0444, stats_dir, NULL, &stats_accesses_fops);
+    debugfs_create_file("delay", 0444, stats_dir, NULL, &stats_delay_fops);
+    debugfs_create_file("tick_latency", 0444, stats_dir, NULL,
+                        &stats_tick_latency_fops);
+    debugfs_create_file("cfg_latency", 0444, stats_dir, NULL,
+                        &stats_cfg_latency_fops);
+    return 0;
+}
+
+void free_stats(void) {
+    debugfs_remove_recursive(stats_dir);
+    stats_dir = NULL;
+}
+
+#endif
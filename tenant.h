@@ -0,0 +1,295 @@
+#ifndef __TENANT__
+#define __TENANT__
+
+#include <linux/cpumask.h>
+#include <linux/perf_event.h>
+#include <linux/smp.h>
+#include <linux/string.h>
+
+#include "common.h"
+#include "emulator_uapi.h"
+
+/*
+  Emulation tenants. Include after inject.h, wear.h, fanout.h, stats.h and
+  sample_ring.h.
+
+  Several groups of target cpus can be emulated side by side, each with its
+  own latency, e.g. a "DRAM" service next to an "NVM" one, or two NVM
+  generations:
+      tenants="dram:12-13:0;nvm1:14-15:300;nvm2:16,18:600"
+  i.e. name:cpulist:ns per access, separated by ';'. Latency 0 counts the
+  tenant but never delays it.
+
+  The HA counts requests of the whole socket and can not tell cores apart,
+  so the counter delta of every tick is attributed to the target cpus by
+  their own core PMU: every target cpu counts LLC misses, and cpu i of any
+  tenant is charged
+      delta * misses(i) / misses(all target cpus)
+  accesses in the tick. Every cpu is then delayed for its own share, all
+  of them with one broadcast of fanout.h, so tenants and cpus are delayed in
+  parallel. A cpu whose previous delay is still running is skipped and its
+  delay counted as missed.
+
+  The misses are read by each cpu itself when the broadcast lands, never by
+  the sampler: reading a counter of another cpu is a synchronous IPI, which
+  would wait for a cpu still spinning with interrupts off. Every tenant cpu
+  that is not busy is in every broadcast, with or without a delay, and the
+  weights of a tick are the misses between its two last collected readings,
+  i.e. they lag the HA delta by about a tick. A busy cpu weighs nothing in
+  that tick, its misses count when it is collected again.
+
+  The delay of a cpu is computed like the one of TARGET_CPU without
+  tenants, except that the latency per access is the tenant's own instead
+  of nvm_latency or the closed loop: shares are carried over until
+  MIN_DELAYED_ACCESSES add up, the RMW delay of wear.h is split by the same
+  weights, compensate_delay() subtracts the calibrated overhead and the
+  global requested/injected delay in debugfs nvmemu/ counts them too. The
+  injected delay of a cpu is only known when its slot is collected, so it is
+  accounted one tick or more after the requested one.
+
+  Accesses, delays and misses are reported per tenant in debugfs
+  nvmemu/tenants, and every tenant writes its own sample per tick.
+*/
+
+#define TENANT_MAX                   (8)
+#define TENANT_MAX_CPUS              (64)
+#define TENANT_NAME                  (16)
+
+typedef struct {
+    int cpu;
+    struct perf_event *misses;   // LLC misses of this cpu
+    uint64_t last;               // misses at the previous reading
+    uint64_t weight;             // misses in this tick
+    uint64_t carried;            // accesses not delayed yet
+    uint64_t injected;           // ns collected in this tick
+    bool busy;                   // still spinning, skipped in this tick
+} tenant_cpu_t;
+
+typedef struct {
+    char name[TENANT_NAME];
+    uint64_t latency;            // ns per access
+    int nr_cpus;
+    tenant_cpu_t cpus[TENANT_MAX_CPUS];
+    atomic64_t accesses;
+    atomic64_t delay_requested;  // ns
+    atomic64_t delay_injected;   // ns
+    atomic64_t delay_missed;     // ns not injected, the cpu was still busy
+} tenant_t;
+
+static tenant_t tenants[TENANT_MAX];
+static int nr_tenants;
+static struct cpumask tenant_cpus;      // a cpu belongs to one tenant only
+
+static struct perf_event_attr tenant_misses_attr = {
+    .type = PERF_TYPE_HARDWARE,
+    .config = PERF_COUNT_HW_CACHE_MISSES,
+    .size = sizeof(struct perf_event_attr),
+    .pinned = 1,
+};
+
+// "name:cpulist:latency"
+static int parse_tenant(tenant_t *t, char *spec) {
+    char *name = strsep(&spec, ":");
+    char *cpus = strsep(&spec, ":");
+    cpumask_var_t mask;
+    int cpu;
+
+    if (!name || !*name || !cpus || !spec || kstrtou64(spec, 0, &t->latency)) {
+        printk(KERN_ERR "tenant spec is name:cpulist:latency\n");
+        return -EINVAL;
+    }
+    strscpy(t->name, name, TENANT_NAME);
+
+    if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+        return -ENOMEM;
+    if (cpulist_parse(cpus, mask) != 0 || cpumask_empty(mask) ||
+        cpumask_weight(mask) > TENANT_MAX_CPUS ||
+        cpumask_intersects(mask, &tenant_cpus)) {
+        printk(KERN_ERR "tenant %s: bad cpu list %s\n", t->name, cpus);
+        free_cpumask_var(mask);
+        return -EINVAL;
+    }
+    cpumask_or(&tenant_cpus, &tenant_cpus, mask);
+    t->nr_cpus = 0;
+    for_each_cpu(cpu, mask)
+        t->cpus[t->nr_cpus++].cpu = cpu;
+    free_cpumask_var(mask);
+    return 0;
+}
+
+/*
+  Collect the slots of every target cpu and attribute their misses since
+  the previous collection, returns the sum.
+*/
+static uint64_t tenants_weigh(void) {
+    uint64_t total = 0, count;
+    int i, j;
+
+    for (i = 0; i < nr_tenants; i++) {
+        for (j = 0; j < tenants[i].nr_cpus; j++) {
+            tenant_cpu_t *c = &tenants[i].cpus[j];
+
+            c->busy = fanout_collect(c->cpu, &c->injected) == -EBUSY;
+            c->weight = 0;
+            if (c->busy)
+                continue;
+            count = fanout_count(c->cpu);
+            c->weight = count > c->last ? count - c->last : 0;
+            c->last = count;
+            total += c->weight;
+        }
+    }
+    return total;
+}
+
+/*
+  Charge @accesses counted by the HA in this tick, and @rmw media RMWs, to
+  the tenants and delay their cpus. @sample carries the fields common to
+  all tenants and gets the delays of all of them.
+*/
+void tenants_charge(uint64_t accesses, uint64_t rmw, sample_t *sample) {
+    uint64_t total = tenants_weigh();
+    uint64_t share, ns, inject;
+    sample_t record;
+    int i, j;
+
+    for (i = 0; i < nr_tenants; i++) {
+        tenant_t *t = &tenants[i];
+
+        record = *sample;
+        record.target_cpu = t->cpus[0].cpu;
+        record.deltas[0] = 0;
+        record.computed_delay = 0;
+        record.injected_delay = 0;
+        for (j = 0; j < t->nr_cpus; j++) {
+            tenant_cpu_t *c = &t->cpus[j];
+
+            // the delay sent in an earlier tick
+            atomic64_add(c->injected, &t->delay_injected);
+            record.injected_delay += c->injected;
+            if (c->injected)
+                stats_add_delay(0, c->injected + calibration_overhead());
+
+            share = total ? div64_u64(accesses * c->weight, total) : 0;
+            record.deltas[0] += share;
+            c->carried += share;
+            ns = total ? div64_u64(wear_delay(rmw) * c->weight, total) : 0;
+            if (c->carried >= MIN_DELAYED_ACCESSES) {
+                ns += c->carried * t->latency;
+                share = c->carried;
+                c->carried = 0;
+            } else {
+                share = 0;
+            }
+            if (ns) {
+                record.computed_delay += ns;
+                atomic64_add(ns, &t->delay_requested);
+                stats_add_delay(ns, 0);
+            }
+            if (c->busy) {
+                atomic64_add(ns, &t->delay_missed);
+                continue;
+            }
+            // also without a delay, the broadcast reads the misses
+            inject = compensate_delay(ns);
+            if (fanout_set(c->cpu, inject, share, ns) != 0) {
+                if (ns) {
+                    atomic64_add(ns, &t->delay_missed);
+                    stats_ipi_failed();
+                }
+                continue;
+            }
+            if (inject)
+                record.flags |= SAMPLE_FLAG_DELAYED;
+        }
+        atomic64_add(record.deltas[0], &t->accesses);
+        sample_ring_write(&record);
+        sample->computed_delay += record.computed_delay;
+        sample->injected_delay += record.injected_delay;
+    }
+    fanout_send();
+}
+
+static int stats_tenants_show(struct seq_file *m, void *v) {
+    int i;
+
+    seq_printf(m, "%-16s %8s %16s %16s %16s %16s\n", "tenant", "latency",
+               "accesses", "requested_ns", "injected_ns", "missed_ns");
+    for (i = 0; i < nr_tenants; i++)
+        seq_printf(m, "%-16s %8llu %16lld %16lld %16lld %16lld\n",
+                   tenants[i].name, tenants[i].latency,
+                   atomic64_read(&tenants[i].accesses),
+                   atomic64_read(&tenants[i].delay_requested),
+                   atomic64_read(&tenants[i].delay_injected),
+                   atomic64_read(&tenants[i].delay_missed));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_tenants);
+
+void free_tenants(void) {
+    int i, j;
+
+    fanout_wait(&tenant_cpus);
+    for (i = 0; i < nr_tenants; i++) {
+        for (j = 0; j < tenants[i].nr_cpus; j++) {
+            tenant_cpu_t *c = &tenants[i].cpus[j];
+            fanout_set_counter(c->cpu, NULL);
+            if (!IS_ERR_OR_NULL(c->misses))
+                perf_event_release_kernel(c->misses);
+            c->misses = NULL;
+        }
+    }
+    nr_tenants = 0;
+    cpumask_clear(&tenant_cpus);
+}
+
+// @specs is modified
+int init_tenants(char *specs) {
+    char *spec;
+    int i, j;
+
+    nr_tenants = 0;
+    cpumask_clear(&tenant_cpus);
+    init_fanout();
+    while ((spec = strsep(&specs, ";")) != NULL) {
+        if (!*spec)
+            continue;
+        if (nr_tenants == TENANT_MAX) {
+            printk(KERN_ERR "at most %d tenants\n", TENANT_MAX);
+            goto err;
+        }
+        memset(&tenants[nr_tenants], 0, sizeof(tenant_t));
+        if (parse_tenant(&tenants[nr_tenants], spec) != 0)
+            goto err;
+        nr_tenants++;
+    }
+
+    for (i = 0; i < nr_tenants; i++) {
+        for (j = 0; j < tenants[i].nr_cpus; j++) {
+            tenant_cpu_t *c = &tenants[i].cpus[j];
+            c->misses = perf_event_create_kernel_counter(&tenant_misses_attr,
+                                                         c->cpu, NULL, NULL,
+                                                         NULL);
+            if (IS_ERR(c->misses)) {
+                printk(KERN_ERR "tenant %s: no LLC miss counter on cpu %d\n",
+                       tenants[i].name, c->cpu);
+                goto err;
+            }
+            fanout_set_counter(c->cpu, c->misses);
+        }
+        printk(KERN_INFO "tenant %s: %d cpus from %d, %llu ns per access\n",
+               tenants[i].name, tenants[i].nr_cpus, tenants[i].cpus[0].cpu,
+               tenants[i].latency);
+    }
+
+    if (stats_dir)
+        debugfs_create_file("tenants", 0444, stats_dir, NULL,
+                            &stats_tenants_fops);
+    return 0;
+
+err:
+    free_tenants();
+    return -EINVAL;
+}
+
+#endif
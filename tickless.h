@@ -0,0 +1,189 @@
+#ifndef __TICKLESS__
+#define __TICKLESS__
+
+#include <linux/irq_work.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/topology.h>
+#include <asm/msr.h>
+#include <asm/nmi.h>
+
+#include "common.h"
+
+/*
+  Tickless sampling. Include after platform.h.
+
+  Instead of polling, the sampler preloads its counter with 2^48 - threshold
+  and sleeps. When the counter overflows, the HA raises an uncore PMI on the
+  core picked by U_MSR_PMON_GLOBAL_CTL.pmi_core_sel; the PMI arrives as an
+  NMI, where only the overflow is acknowledged and an irq_work is queued,
+  which wakes the sampler. A long timeout still wakes it, so the accesses of
+  a slowly running workload are charged eventually.
+  While the workload is idle the sampler's cpu can enter deep C-states and
+  the emulator causes no config space traffic at all.
+*/
+
+#define U_MSR_PMON_GLOBAL_CTL        (0x700)
+#define U_MSR_PMON_GLOBAL_STATUS     (0x701)
+#define U_MSR_PMON_GLOBAL_CTL_frz_all      (1ULL << 31)
+#define U_MSR_PMON_GLOBAL_CTL_wk_on_pmi    (1ULL << 30)
+#define U_MSR_PMON_GLOBAL_CTL_unfrz_all    (1ULL << 29)
+#define U_MSR_PMON_GLOBAL_CTL_pmi_core_sel (0x3ffff)
+
+typedef struct {
+    HABox_t *habox;
+    int pairnr;
+    int pmi_cpu;              // a cpu of the monitored socket
+    uint64_t ov_bit;          // status bit of the monitored HA
+    uint64_t threshold;       // accesses per wake-up
+    struct irq_work work;
+    wait_queue_head_t wait;
+    bool fired;
+    bool armed;
+    atomic64_t pmis;
+    atomic64_t timeouts;
+} tickless_t;
+
+static tickless_t tickless;
+
+static void tickless_wake(struct irq_work *work) {
+    WRITE_ONCE(tickless.fired, true);
+    wake_up_interruptible(&tickless.wait);
+}
+
+static int tickless_nmi(unsigned int type, struct pt_regs *regs) {
+    uint64_t status;
+
+    if (!READ_ONCE(tickless.armed) || smp_processor_id() != tickless.pmi_cpu)
+        return NMI_DONE;
+    rdmsrl(U_MSR_PMON_GLOBAL_STATUS, status);
+    if (!(status & tickless.ov_bit))
+        return NMI_DONE;
+    // RW1C, the box status is cleared by the sampler
+    wrmsrl(U_MSR_PMON_GLOBAL_STATUS, tickless.ov_bit);
+    atomic64_inc(&tickless.pmis);
+    irq_work_queue(&tickless.work);
+    return NMI_HANDLED;
+}
+
+// preload the counter for the next wake-up, @habox must be frozen
+int tickless_rearm(void) {
+    return HA_write_counter(tickless.habox, tickless.pairnr,
+                            (1ULL << 48) - tickless.threshold);
+}
+
+// events counted since the last rearm, from the raw counter value
+uint64_t tickless_count(uint64_t raw) {
+    return (raw - ((1ULL << 48) - tickless.threshold)) & HA_PCI_PMON_CTR_MASK;
+}
+
+// sleep until the counter overflows, or @timeout jiffies passed
+void tickless_wait(long timeout) {
+    if (!wait_event_interruptible_timeout(tickless.wait,
+                                          READ_ONCE(tickless.fired) ||
+                                          kthread_should_stop(),
+                                          timeout))
+        atomic64_inc(&tickless.timeouts);
+    WRITE_ONCE(tickless.fired, false);
+}
+
+static int stats_tickless_show(struct seq_file *m, void *v) {
+    seq_printf(m, "threshold       %llu\n", tickless.threshold);
+    seq_printf(m, "pmi_cpu         %d\n", tickless.pmi_cpu);
+    seq_printf(m, "pmis            %lld\n", atomic64_read(&tickless.pmis));
+    seq_printf(m, "timeouts        %lld\n", atomic64_read(&tickless.timeouts));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_tickless);
+
+/*
+  @habox must be frozen and pair @pairnr programmed, the pair is preloaded
+  and its overflow enabled. The PMI is sent to a core of @socket.
+*/
+int init_tickless(HABox_t *habox, int pairnr, int socket, int box,
+                  uint64_t threshold) {
+    uint64_t ctl;
+    int cpu;
+
+    if (!uncore_map->ov_bits[box]) {
+        printk(KERN_ERR "%s boxes can not raise the uncore PMI\n",
+               uncore_map->name);
+        return -ENODEV;
+    }
+
+    if (!threshold || threshold > HA_PCI_PMON_CTR_MASK) {
+        printk(KERN_ERR "tickless threshold %llu is invalid\n", threshold);
+        return -EINVAL;
+    }
+
+    tickless.pmi_cpu = -1;
+    for_each_online_cpu(cpu) {
+        // pmi_core_sel has one bit per core, 18 of them
+        if (topology_physical_package_id(cpu) == socket &&
+            topology_core_id(cpu) < 18) {
+            tickless.pmi_cpu = cpu;
+            break;
+        }
+    }
+    if (tickless.pmi_cpu < 0) {
+        printk(KERN_ERR "no online cpu on socket %d for the PMI\n", socket);
+        return -ENODEV;
+    }
+
+    tickless.habox = habox;
+    tickless.pairnr = pairnr;
+    tickless.ov_bit = uncore_map->ov_bits[box];
+    tickless.threshold = threshold;
+    tickless.fired = false;
+    atomic64_set(&tickless.pmis, 0);
+    atomic64_set(&tickless.timeouts, 0);
+    init_irq_work(&tickless.work, tickless_wake);
+    init_waitqueue_head(&tickless.wait);
+
+    if (register_nmi_handler(NMI_LOCAL, tickless_nmi, 0, "nvmemu") != 0) {
+        printk(KERN_ERR "Can not register the PMI handler\n");
+        return -EBUSY;
+    }
+
+    if (rdmsrl_on_cpu(tickless.pmi_cpu, U_MSR_PMON_GLOBAL_CTL, &ctl) != 0)
+        goto err;
+    ctl &= ~U_MSR_PMON_GLOBAL_CTL_pmi_core_sel;
+    ctl |= (1ULL << topology_core_id(tickless.pmi_cpu)) |
+           U_MSR_PMON_GLOBAL_CTL_wk_on_pmi;
+    if (wrmsrl_on_cpu(tickless.pmi_cpu, U_MSR_PMON_GLOBAL_CTL, ctl) != 0)
+        goto err;
+
+    if (tickless_rearm() != 0 || HA_enable_overflow(habox, pairnr) != 0)
+        goto err;
+    WRITE_ONCE(tickless.armed, true);
+
+    if (stats_dir)
+        debugfs_create_file("tickless", 0444, stats_dir, NULL,
+                            &stats_tickless_fops);
+    printk(KERN_INFO "tickless, waking up every %llu accesses on cpu %d\n",
+           threshold, tickless.pmi_cpu);
+    return 0;
+
+err:
+    unregister_nmi_handler(NMI_LOCAL, "nvmemu");
+    printk(KERN_ERR "Can not route the uncore PMI to cpu %d\n",
+           tickless.pmi_cpu);
+    return -EIO;
+}
+
+void free_tickless(void) {
+    uint64_t ctl;
+
+    if (!tickless.armed)
+        return;
+    WRITE_ONCE(tickless.armed, false);
+    HA_disable_overflow(tickless.habox, tickless.pairnr);
+    if (rdmsrl_on_cpu(tickless.pmi_cpu, U_MSR_PMON_GLOBAL_CTL, &ctl) == 0)
+        wrmsrl_on_cpu(tickless.pmi_cpu, U_MSR_PMON_GLOBAL_CTL,
+                      ctl & ~(U_MSR_PMON_GLOBAL_CTL_pmi_core_sel |
+                              U_MSR_PMON_GLOBAL_CTL_wk_on_pmi));
+    unregister_nmi_handler(NMI_LOCAL, "nvmemu");
+    irq_work_sync(&tickless.work);
+}
+
+#endif
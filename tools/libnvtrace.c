@@ -0,0 +1,231 @@
+/*
+  Streaming reader and writer of the trace format, see nvtrace.h.
+*/
+#include <errno.h>
+#include <string.h>
+
+#include "nvtrace.h"
+
+#define HEADER_SIZE      (24)
+
+static void split(const sample_t *sample, uint64_t *streams) {
+    int i;
+    streams[0] = sample->timestamp;
+    streams[1] = sample->socket;
+    streams[2] = sample->box;
+    streams[3] = sample->target_cpu;
+    streams[4] = sample->flags;
+    for (i = 0; i < SAMPLE_NR_COUNTERS; i++)
+        streams[5 + i] = sample->deltas[i];
+    streams[5 + SAMPLE_NR_COUNTERS] = sample->computed_delay;
+    streams[6 + SAMPLE_NR_COUNTERS] = sample->injected_delay;
+}
+
+static void join(const uint64_t *streams, sample_t *sample) {
+    int i;
+    sample->timestamp = streams[0];
+    sample->socket = streams[1];
+    sample->box = streams[2];
+    sample->target_cpu = streams[3];
+    sample->flags = streams[4];
+    for (i = 0; i < SAMPLE_NR_COUNTERS; i++)
+        sample->deltas[i] = streams[5 + i];
+    sample->computed_delay = streams[5 + SAMPLE_NR_COUNTERS];
+    sample->injected_delay = streams[6 + SAMPLE_NR_COUNTERS];
+}
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int put_varint(FILE *file, uint64_t v) {
+    uint8_t buf[10];
+    int n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t)v;
+    return fwrite(buf, 1, n, file) == (size_t)n ? 0 : -1;
+}
+
+// 1 on success, 0 at a clean end of file, -1 on a truncated or bad varint
+static int get_varint(FILE *file, uint64_t *v) {
+    int shift, c;
+    *v = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        c = getc(file);
+        if (c == EOF)
+            return shift ? -1 : 0;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 1;
+    }
+    return -1;
+}
+
+static void put_le(uint8_t *buf, uint64_t v, int bytes) {
+    int i;
+    for (i = 0; i < bytes; i++)
+        buf[i] = v >> (8 * i);
+}
+
+static uint64_t get_le(const uint8_t *buf, int bytes) {
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < bytes; i++)
+        v |= (uint64_t)buf[i] << (8 * i);
+    return v;
+}
+
+int nvtrace_open_write(nvtrace_t *trace, FILE *file, uint32_t interval) {
+    uint8_t header[HEADER_SIZE] = { 0 };
+
+    memset(trace, 0, sizeof(*trace));
+    trace->file = file;
+    trace->interval = interval ? interval : NVTRACE_KEYFRAME_INTERVAL;
+
+    memcpy(header, NVTRACE_MAGIC, sizeof(NVTRACE_MAGIC));
+    put_le(header + 8, NVTRACE_VERSION, 2);
+    put_le(header + 10, SAMPLE_NR_COUNTERS, 2);
+    put_le(header + 12, trace->interval, 4);
+    return fwrite(header, 1, HEADER_SIZE, file) == HEADER_SIZE ? 0 : -1;
+}
+
+int nvtrace_write(nvtrace_t *trace, const sample_t *sample) {
+    uint64_t streams[NVTRACE_STREAMS];
+    uint8_t sync[12];
+    int keyframe = trace->records % trace->interval == 0;
+    int i;
+
+    split(sample, streams);
+    if (keyframe) {
+        put_le(sync, NVTRACE_SYNC, 4);
+        put_le(sync + 4, trace->records, 8);
+        if (fwrite(sync, 1, sizeof(sync), trace->file) != sizeof(sync))
+            return -1;
+    }
+    for (i = 0; i < NVTRACE_STREAMS; i++) {
+        uint64_t v = keyframe ? streams[i] :
+                     zigzag((int64_t)(streams[i] - trace->prev[i]));
+        if (put_varint(trace->file, v) != 0)
+            return -1;
+    }
+    memcpy(trace->prev, streams, sizeof(streams));
+    trace->records++;
+    return 0;
+}
+
+int nvtrace_close_write(nvtrace_t *trace) {
+    return fflush(trace->file) == 0 ? 0 : -1;
+}
+
+int nvtrace_open_read(nvtrace_t *trace, FILE *file) {
+    uint8_t header[HEADER_SIZE];
+
+    memset(trace, 0, sizeof(*trace));
+    trace->file = file;
+    if (fread(header, 1, HEADER_SIZE, file) != HEADER_SIZE ||
+        memcmp(header, NVTRACE_MAGIC, sizeof(NVTRACE_MAGIC)) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (get_le(header + 8, 2) != NVTRACE_VERSION ||
+        get_le(header + 10, 2) != SAMPLE_NR_COUNTERS) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    trace->interval = get_le(header + 12, 4);
+    if (!trace->interval) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int nvtrace_read(nvtrace_t *trace, sample_t *sample) {
+    uint64_t streams[NVTRACE_STREAMS];
+    uint8_t sync[12];
+    int keyframe = trace->records % trace->interval == 0;
+    size_t n;
+    int i, ret;
+
+    if (keyframe) {
+        n = fread(sync, 1, sizeof(sync), trace->file);
+        if (n == 0)
+            return 0;
+        if (n != sizeof(sync) || get_le(sync, 4) != NVTRACE_SYNC ||
+            get_le(sync + 4, 8) != trace->records)
+            return -1;
+    }
+    for (i = 0; i < NVTRACE_STREAMS; i++) {
+        ret = get_varint(trace->file, &streams[i]);
+        if (ret <= 0)
+            return i == 0 && !keyframe ? ret : -1;
+        if (!keyframe)
+            streams[i] = trace->prev[i] + (uint64_t)unzigzag(streams[i]);
+    }
+    memcpy(trace->prev, streams, sizeof(streams));
+    join(streams, sample);
+    trace->records++;
+    return 1;
+}
+
+// record number of the first keyframe at or after @offset, -1 if none
+static int64_t next_keyframe(nvtrace_t *trace, long offset, long *at) {
+    uint8_t sync[12];
+    uint32_t window = 0;
+    int c;
+
+    if (fseek(trace->file, offset, SEEK_SET) != 0)
+        return -1;
+    while ((c = getc(trace->file)) != EOF) {
+        window = (window >> 8) | ((uint32_t)c << 24);
+        offset++;
+        if (window != NVTRACE_SYNC || offset - HEADER_SIZE < 4)
+            continue;
+        put_le(sync, window, 4);
+        if (fread(sync + 4, 1, 8, trace->file) != 8)
+            return -1;
+        // varint bytes may look like a sync word, real keyframes are aligned
+        if (get_le(sync + 4, 8) % trace->interval == 0) {
+            *at = offset - 4;
+            return get_le(sync + 4, 8);
+        }
+        if (fseek(trace->file, offset, SEEK_SET) != 0)
+            return -1;
+    }
+    return -1;
+}
+
+int nvtrace_seek(nvtrace_t *trace, uint64_t record) {
+    long lo = HEADER_SIZE, hi, at, best = HEADER_SIZE;
+    uint64_t best_record = 0;
+    int64_t found;
+
+    if (fseek(trace->file, 0, SEEK_END) != 0)
+        return -1;
+    hi = ftell(trace->file);
+
+    // last keyframe whose record number is <= @record
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        found = next_keyframe(trace, mid, &at);
+        if (found < 0 || (uint64_t)found > record) {
+            hi = mid;
+        } else {
+            best = at;
+            best_record = found;
+            lo = at + 1;
+        }
+    }
+
+    if (fseek(trace->file, best, SEEK_SET) != 0)
+        return -1;
+    trace->records = best_record;
+    return 0;
+}
@@ -0,0 +1,261 @@
+/*
+  Record, convert and dump emulator sample traces, see nvtrace.h.
+
+  usage: nvtrace record [-c cpu] [-p ring_pages] [-i interval] [-t secs] > out
+         nvtrace encode [-i interval] < raw > out
+         nvtrace decode [-s record] [-n count] trace > raw
+         nvtrace csv [-s record] [-n count] trace
+         nvtrace columns -o dir [-s record] [-n count] trace
+
+      record   consume the sample ring of @cpu (default 1, the sampler) from
+               /dev/nvmemu_samples until interrupted or -t seconds passed;
+               -p must match the module's ring_pages (default 16)
+      encode   raw sample_t records, e.g. saved from the ring, to a trace
+      decode   trace to raw sample_t records, as /dev/nvmemu_replay takes
+      csv      one line per sample
+      columns  one little endian u64 file per stream in @dir, plus a
+               manifest "columns" with the stream names and the row count
+      -s, -n   start at record @record, stop after @count records
+      -i       records between keyframes, default 1024
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nvtrace.h"
+
+#define SAMPLES_DEV      "/dev/nvmemu_samples"
+
+static const char *column_names[NVTRACE_STREAMS] = {
+    "timestamp", "socket", "box", "target_cpu", "flags",
+    "delta0", "delta1", "delta2", "delta3",
+    "computed_delay", "injected_delay",
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: nvtrace record [-c cpu] [-p ring_pages] [-i interval] [-t secs]\n"
+            "       nvtrace encode [-i interval]\n"
+            "       nvtrace decode|csv [-s record] [-n count] trace\n"
+            "       nvtrace columns -o dir [-s record] [-n count] trace\n");
+    exit(1);
+}
+
+static int record(int cpu, long ring_pages, uint32_t interval, int secs) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t size = (1 + ring_pages) * page_size;
+    sample_ring_page_t *page;
+    uint8_t *data;
+    uint64_t head, tail, mask, written = 0;
+    time_t deadline = secs ? time(NULL) + secs : 0;
+    struct timespec idle = { 0, 1000000 };
+    nvtrace_t trace;
+    sample_t sample;
+    int fd;
+
+    fd = open(SAMPLES_DEV, O_RDWR);
+    if (fd < 0) {
+        perror(SAMPLES_DEV);
+        return 1;
+    }
+    page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                (off_t)cpu * size);
+    if (page == MAP_FAILED) {
+        perror("mmap, does -p match ring_pages?");
+        return 1;
+    }
+    if (page->version != SAMPLE_RING_VERSION ||
+        page->record_size != sizeof(sample_t)) {
+        fprintf(stderr, "unknown sample ring version %u\n", page->version);
+        return 1;
+    }
+    data = (uint8_t *)page + page->data_offset;
+    mask = page->data_size - 1;
+
+    if (nvtrace_open_write(&trace, stdout, interval) != 0) {
+        perror("nvtrace");
+        return 1;
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    tail = page->data_tail;
+    while (running && (!deadline || time(NULL) < deadline)) {
+        head = __atomic_load_n(&page->data_head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        for (; tail != head; tail += sizeof(sample_t)) {
+            memcpy(&sample, data + (tail & mask), sizeof(sample));
+            if (nvtrace_write(&trace, &sample) != 0) {
+                perror("write");
+                return 1;
+            }
+            written++;
+        }
+        __atomic_store_n(&page->data_tail, tail, __ATOMIC_RELEASE);
+    }
+    nvtrace_close_write(&trace);
+    fprintf(stderr, "%llu samples recorded, %llu lost\n",
+            (unsigned long long)written, (unsigned long long)page->lost);
+    munmap(page, size);
+    close(fd);
+    return 0;
+}
+
+static int encode(uint32_t interval) {
+    nvtrace_t trace;
+    sample_t sample;
+
+    if (nvtrace_open_write(&trace, stdout, interval) != 0)
+        return 1;
+    while (fread(&sample, sizeof(sample), 1, stdin) == 1) {
+        if (nvtrace_write(&trace, &sample) != 0) {
+            perror("write");
+            return 1;
+        }
+    }
+    return nvtrace_close_write(&trace) != 0;
+}
+
+static void print_csv(const sample_t *s) {
+    printf("%llu,%u,%u,%u,%u,%llu,%llu,%llu,%llu,%llu,%llu\n",
+           (unsigned long long)s->timestamp, s->socket, s->box, s->target_cpu,
+           s->flags, (unsigned long long)s->deltas[0],
+           (unsigned long long)s->deltas[1], (unsigned long long)s->deltas[2],
+           (unsigned long long)s->deltas[3],
+           (unsigned long long)s->computed_delay,
+           (unsigned long long)s->injected_delay);
+}
+
+static void put_column(FILE *file, uint64_t v) {
+    uint8_t buf[8];
+    int i;
+    for (i = 0; i < 8; i++)
+        buf[i] = v >> (8 * i);
+    fwrite(buf, 1, 8, file);
+}
+
+static FILE *open_file(const char *dir, const char *name, const char *mode) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return fopen(path, mode);
+}
+
+int main(int argc, char **argv) {
+    const char *cmd, *dir = NULL;
+    uint64_t start = 0, count = UINT64_MAX, n = 0;
+    uint32_t interval = 0;
+    long ring_pages = 16;
+    int cpu = 1, secs = 0, opt, ret = 0, i;
+    FILE *columns[NVTRACE_STREAMS] = { NULL };
+    FILE *in, *manifest;
+    nvtrace_t trace;
+    sample_t sample;
+
+    if (argc < 2)
+        usage();
+    cmd = argv[1];
+    optind = 2;
+    while ((opt = getopt(argc, argv, "c:p:i:t:s:n:o:")) != -1) {
+        switch (opt) {
+        case 'c': cpu = atoi(optarg); break;
+        case 'p': ring_pages = atol(optarg); break;
+        case 'i': interval = strtoul(optarg, NULL, 0); break;
+        case 't': secs = atoi(optarg); break;
+        case 's': start = strtoull(optarg, NULL, 0); break;
+        case 'n': count = strtoull(optarg, NULL, 0); break;
+        case 'o': dir = optarg; break;
+        default: usage();
+        }
+    }
+
+    if (strcmp(cmd, "record") == 0)
+        return record(cpu, ring_pages, interval, secs);
+    if (strcmp(cmd, "encode") == 0)
+        return encode(interval);
+    if (strcmp(cmd, "decode") != 0 && strcmp(cmd, "csv") != 0 &&
+        strcmp(cmd, "columns") != 0)
+        usage();
+    if (optind != argc - 1 || (strcmp(cmd, "columns") == 0 && !dir))
+        usage();
+
+    in = fopen(argv[optind], "rb");
+    if (!in || nvtrace_open_read(&trace, in) != 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    if (start && nvtrace_seek(&trace, start) != 0) {
+        perror("seek");
+        return 1;
+    }
+
+    if (strcmp(cmd, "csv") == 0) {
+        printf("timestamp,socket,box,target_cpu,flags,delta0,delta1,delta2,"
+               "delta3,computed_delay,injected_delay\n");
+    } else if (strcmp(cmd, "columns") == 0) {
+        mkdir(dir, 0755);
+        for (i = 0; i < NVTRACE_STREAMS; i++) {
+            columns[i] = open_file(dir, column_names[i], "wb");
+            if (!columns[i]) {
+                fprintf(stderr, "%s/%s: %s\n", dir, column_names[i],
+                        strerror(errno));
+                return 1;
+            }
+        }
+    }
+
+    while (n < count && (ret = nvtrace_read(&trace, &sample)) == 1) {
+        // seek lands on a keyframe, skip up to the asked record
+        if (trace.records <= start)
+            continue;
+        if (strcmp(cmd, "decode") == 0) {
+            fwrite(&sample, sizeof(sample), 1, stdout);
+        } else if (strcmp(cmd, "csv") == 0) {
+            print_csv(&sample);
+        } else {
+            uint64_t streams[NVTRACE_STREAMS] = {
+                sample.timestamp, sample.socket, sample.box,
+                sample.target_cpu, sample.flags, sample.deltas[0],
+                sample.deltas[1], sample.deltas[2], sample.deltas[3],
+                sample.computed_delay, sample.injected_delay,
+            };
+            for (i = 0; i < NVTRACE_STREAMS; i++)
+                put_column(columns[i], streams[i]);
+        }
+        n++;
+    }
+    if (ret < 0)
+        fprintf(stderr, "trace corrupt after record %llu\n",
+                (unsigned long long)trace.records);
+
+    if (strcmp(cmd, "columns") == 0) {
+        manifest = open_file(dir, "columns", "w");
+        if (manifest) {
+            fprintf(manifest, "nvtrace-columns 1\nrows %llu\n",
+                    (unsigned long long)n);
+            for (i = 0; i < NVTRACE_STREAMS; i++)
+                fprintf(manifest, "u64le %s\n", column_names[i]);
+            fclose(manifest);
+        }
+        for (i = 0; i < NVTRACE_STREAMS; i++)
+            fclose(columns[i]);
+    }
+    fclose(in);
+    return ret < 0;
+}
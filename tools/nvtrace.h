@@ -0,0 +1,58 @@
+#ifndef __NVTRACE__
+#define __NVTRACE__
+
+/*
+  Compact on-disk trace of emulator samples, version 1.
+
+  A trace is a header followed by records, one per sample_t:
+
+      header    "NVTRACE\0", u16 version, u16 nr_counters,
+                u32 keyframe interval, u64 reserved     (little endian)
+      record    keyframe every interval records, delta record otherwise
+
+  A sample is split into streams: timestamp, socket, box, target_cpu, flags,
+  each counter delta, computed_delay and injected_delay. A delta record
+  stores every stream as the zigzag varint of its difference to the previous
+  record, so a steady stream costs one byte per record. A keyframe starts
+  with the sync word "NVKF" and its u64 record number, followed by every
+  stream as a plain varint; decoding can start at any keyframe, which is what
+  nvtrace_seek() does with a binary search over the file.
+
+  The library streams: the writer and reader keep one sample of state and
+  need no index, so traces can be written while recording and be truncated
+  anywhere, losing at most the last record.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../emulator_uapi.h"
+
+#define NVTRACE_MAGIC                "NVTRACE"
+#define NVTRACE_VERSION              (1)
+#define NVTRACE_SYNC                 (0x464b564eU)   // "NVKF"
+#define NVTRACE_KEYFRAME_INTERVAL    (1024)
+#define NVTRACE_STREAMS              (7 + SAMPLE_NR_COUNTERS)
+
+typedef struct {
+    FILE *file;
+    uint32_t interval;         // records between keyframes
+    uint64_t records;          // records written or read so far
+    uint64_t prev[NVTRACE_STREAMS];
+} nvtrace_t;
+
+// write the header, @interval 0 takes NVTRACE_KEYFRAME_INTERVAL
+int nvtrace_open_write(nvtrace_t *trace, FILE *file, uint32_t interval);
+int nvtrace_write(nvtrace_t *trace, const sample_t *sample);
+// flush buffered records, the FILE stays open
+int nvtrace_close_write(nvtrace_t *trace);
+
+// check the header
+int nvtrace_open_read(nvtrace_t *trace, FILE *file);
+// 1 if a sample was read, 0 at the end of the trace, -1 if it is corrupt
+int nvtrace_read(nvtrace_t *trace, sample_t *sample);
+// position at the last keyframe at or before record @record, needs a
+// seekable file; the next nvtrace_read returns that keyframe
+int nvtrace_seek(nvtrace_t *trace, uint64_t record);
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef __UNCORE_GEN__
+#define __UNCORE_GEN__
+
+#include <linux/build_bug.h>
+
+#include "common.h"
+
+/*
+  Accessors, event tables and the simulator model generated from
+  uncore.def. Include after the event_t definition of large_header.h.
+
+  For every register
+      box_reg, box_reg_stride, box_reg_count    offset of instance 0 etc.
+      UNCORE_AT(box, reg, i)                    offset of instance i, a
+                                                build error if i is out of
+                                                range
+  for every field
+      box_reg_field_mask
+      box_reg_field(v)                          the field of register value v
+      box_reg_field_set(v, x)                   v with the field set to x
+  for every event
+      box_event_name
+  and uncore_fields[], the write semantics of every field for the
+  simulated register file of platform.h.
+
+  The accessors are masks and shifts only, no branches; offsets, field
+  widths and event codes are checked at build time.
+*/
+
+#define UF_MASK(shift, width) \
+    ((uint32_t)(((1ULL << (width)) - 1) << (shift)))
+
+typedef enum {
+    UF_RW,
+    UF_W1C,
+    UF_RST_CTR,
+    UF_RST_CTRS,
+    UF_RST_CTLS,
+} uncore_field_kind_t;
+
+#define UNCORE_BOX(box)
+#define UNCORE_REG(box, reg, offset, stride, count)
+#define UNCORE_FIELD(box, reg, field, shift, width, kind)
+#define UNCORE_EVENT(box, ev, code, um, desc)
+
+// box types
+#undef UNCORE_BOX
+#define UNCORE_BOX(box) UNCORE_##box,
+typedef enum {
+#include "uncore.def"
+    UNCORE_BOXES
+} uncore_box_t;
+#undef UNCORE_BOX
+#define UNCORE_BOX(box)
+
+// register offsets
+#undef UNCORE_REG
+#define UNCORE_REG(box, reg, offset, stride, count) \
+    box##_##reg = (offset), \
+    box##_##reg##_stride = (stride), \
+    box##_##reg##_count = (count),
+enum {
+#include "uncore.def"
+};
+#undef UNCORE_REG
+
+#define UNCORE_REG(box, reg, offset, stride, count) \
+    static_assert((offset) % 4 == 0 && (count) > 0 && \
+                  (offset) + (stride) * ((count) - 1) + 4 <= 4096, \
+                  #box "_" #reg " is not a dword in config space");
+#include "uncore.def"
+#undef UNCORE_REG
+#define UNCORE_REG(box, reg, offset, stride, count)
+
+#define UNCORE_AT(box, reg, i) \
+    (box##_##reg + BUILD_BUG_ON_ZERO((i) < 0 || (i) >= box##_##reg##_count) + \
+     (i) * box##_##reg##_stride)
+
+// field accessors
+#undef UNCORE_FIELD
+#define UNCORE_FIELD(box, reg, field, shift, width, kind) \
+    static_assert((width) > 0 && (shift) + (width) <= 32, \
+                  #box "_" #reg "_" #field " is not within a dword"); \
+    static const uint32_t box##_##reg##_##field##_mask = \
+        UF_MASK(shift, width); \
+    static __always_inline uint32_t box##_##reg##_##field(uint32_t v) { \
+        return (v & UF_MASK(shift, width)) >> (shift); \
+    } \
+    static __always_inline uint32_t box##_##reg##_##field##_set(uint32_t v, \
+                                                               uint32_t x) { \
+        return (v & ~UF_MASK(shift, width)) | \
+               ((x << (shift)) & UF_MASK(shift, width)); \
+    }
+#include "uncore.def"
+#undef UNCORE_FIELD
+
+// write semantics for the simulator
+typedef struct {
+    uncore_box_t box;
+    const char *name;
+    uint32_t offset;
+    uint32_t stride;
+    uint32_t count;
+    uint32_t mask;
+    uncore_field_kind_t kind;
+} uncore_field_t;
+
+#define UNCORE_FIELD(box, reg, field, shift, width, kind) \
+    { UNCORE_##box, #box "_" #reg "_" #field, box##_##reg, \
+      box##_##reg##_stride, box##_##reg##_count, UF_MASK(shift, width), kind },
+static const uncore_field_t uncore_fields[] = {
+#include "uncore.def"
+};
+#undef UNCORE_FIELD
+#define UNCORE_FIELD(box, reg, field, shift, width, kind)
+
+// events
+#undef UNCORE_EVENT
+#define UNCORE_EVENT(box, ev, code, um, desc) \
+    static_assert((code) <= 0xff && (um) <= 0xff && sizeof(desc) <= 24, \
+                  #box "_event_" #ev " does not fit event_t"); \
+    const event_t box##_event_##ev = { \
+        .event_code = (code), \
+        .umask = (um), \
+        .name = desc, \
+    };
+#include "uncore.def"
+#undef UNCORE_EVENT
+
+#undef UNCORE_BOX
+#undef UNCORE_REG
+#undef UNCORE_FIELD
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef __WEAR__
+#define __WEAR__
+
+#include <linux/atomic.h>
+
+#include "common.h"
+
+/*
+  Write amplification and wear accounting of emulated NVM.
+
+  NVM media is written in blocks larger than a cache line (256B XPLines on
+  Optane). A block written only in part needs a read-modify-write (RMW) of
+  the media block.
+
+  The HA write counters deliver only a count of lines, no addresses, so
+  there is nothing to combine by block and no write-combining buffer is
+  modelled. wear_write_lines() splits the count instead: @locality percent
+  of the lines are sequential and fill whole blocks, one media write per
+  block, the lines short of a block carried to the next tick; the rest are
+  random, one media write and one RMW each (none for 64B blocks). Off
+  unless media_block is set.
+
+  Host lines, media writes and RMWs are reported in debugfs nvmemu/wear.
+*/
+
+#define WEAR_LINE                    (64)
+#define WEAR_MAX_BLOCK               (8 * WEAR_LINE)
+
+typedef struct {
+    uint32_t block;           // media block size in bytes
+    uint32_t lines_per_block;
+    uint32_t locality;        // % of counted lines assumed sequential
+    uint64_t rmw_latency;     // ns charged per media RMW
+    uint64_t sequential;      // sequential lines not yet filling a block
+    atomic64_t host_lines;
+    atomic64_t media_writes;
+    atomic64_t rmw;
+} wear_t;
+
+static wear_t wear;
+
+// @block must be a multiple of 64 bytes, at most 512
+int init_wear(uint32_t block, uint32_t locality, uint64_t rmw_latency) {
+    if (block < WEAR_LINE || block > WEAR_MAX_BLOCK || block % WEAR_LINE) {
+        printk(KERN_ERR "media block %u is not 64 to 512 in lines\n", block);
+        return -EINVAL;
+    }
+    if (locality > 100) {
+        printk(KERN_ERR "locality %u is not a percentage\n", locality);
+        return -EINVAL;
+    }
+    memset(&wear, 0, sizeof(wear));
+    wear.block = block;
+    wear.lines_per_block = block / WEAR_LINE;
+    wear.locality = locality;
+    wear.rmw_latency = rmw_latency;
+    return 0;
+}
+
+// returns the number of RMWs caused by @lines line writes
+uint64_t wear_write_lines(uint64_t lines) {
+    uint64_t sequential, random, blocks, rmw;
+
+    if (!wear.block || !lines)
+        return 0;
+    atomic64_add(lines, &wear.host_lines);
+
+    sequential = lines * wear.locality / 100;
+    random = lines - sequential;
+    // only the sampler calls this, the carried lines need no lock
+    wear.sequential += sequential;
+    blocks = wear.sequential / wear.lines_per_block;
+    wear.sequential %= wear.lines_per_block;
+
+    rmw = wear.lines_per_block > 1 ? random : 0;
+    atomic64_add(blocks + random, &wear.media_writes);
+    atomic64_add(rmw, &wear.rmw);
+    return rmw;
+}
+
+uint64_t wear_delay(uint64_t rmw) {
+    return rmw * wear.rmw_latency;
+}
+
+static int stats_wear_show(struct seq_file *m, void *v) {
+    uint64_t host = atomic64_read(&wear.host_lines);
+    uint64_t media = atomic64_read(&wear.media_writes);
+    uint64_t amplification = host ? media * wear.block * 1000 /
+                                    (host * WEAR_LINE) : 0;
+
+    seq_printf(m, "block           %u\n", wear.block);
+    seq_printf(m, "locality        %u\n", wear.locality);
+    seq_printf(m, "host_lines      %llu\n", host);
+    seq_printf(m, "host_bytes      %llu\n", host * WEAR_LINE);
+    seq_printf(m, "media_writes    %llu\n", media);
+    seq_printf(m, "media_bytes     %llu\n", media * wear.block);
+    seq_printf(m, "rmw             %lld\n", atomic64_read(&wear.rmw));
+    seq_printf(m, "amplification   %llu.%03llu\n", amplification / 1000,
+               amplification % 1000);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats_wear);
+
+void init_wear_stats(void) {
+    if (stats_dir)
+        debugfs_create_file("wear", 0444, stats_dir, NULL, &stats_wear_fops);
+}
+
+#endif